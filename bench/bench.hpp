@@ -0,0 +1,69 @@
+#ifndef __BENCH_HPP__
+#define __BENCH_HPP__
+
+#include <memory>
+#include <chrono>
+#include <string>
+
+#include "../external/json/json.h"
+
+#include "../src/primitives.hpp"
+
+class Scene;
+class Config;
+class Camera;
+
+struct BenchOptions{
+    // Rays per fixed ray set, for traversal benchmarks.
+    unsigned int rays = 200000;
+    // Each measurement is repeated this many times, and the best result is reported.
+    unsigned int repeats = 5;
+    // Rendering rounds for the frame time benchmark.
+    unsigned int frame_rounds = 1;
+    // Seed for generating all benchmark inputs.
+    unsigned int seed = 42;
+    // Overrides the acceleration structure selected by scene configs.
+    bool force_accel = false;
+    AccelStructure accel = AccelStructure::Kd;
+    // Makes the kd-tree builder clip triangles to node boxes, for all scenes.
+    bool force_kd_clip = false;
+    // Loads repeated scene objects once and instances them, for all scenes.
+    bool force_instancing = false;
+    // Stores vertex attributes compressed, for all scenes.
+    bool force_compress_attributes = false;
+};
+
+// Each benchmark group returns its results as a JSON object. Throughputs are given in millions per second, times in
+// seconds.
+
+// FindIntersectKd* variants over camera, bounce and shadow ray sets, packet traversal of camera rays, and occlusion
+// queries from a common point. For kd-trees, also compares the full and short stack traversals, which it switches between.
+Json::Value BenchTraversal(Scene& scene, const Camera& camera, const BenchOptions& opts);
+// Time taken by Scene::Commit (building the acceleration structure) on freshly loaded copies of the scene.
+Json::Value BenchBuild(std::string configfile, const BenchOptions& opts);
+// OfflineSampler::PrepareSamples for each sampler type.
+Json::Value BenchSamplers(const BenchOptions& opts);
+// BxDF::sample and BxDF::value for each BxDF class.
+Json::Value BenchBxDFs(const BenchOptions& opts);
+// Full frame render time, using the renderer's fixed seeds.
+Json::Value BenchFrame(const Scene& scene, std::shared_ptr<Config> cfg, const BenchOptions& opts);
+
+// Loads the config file and installs everything into scene, without committing it. Returns null on failure.
+std::shared_ptr<Config> BenchLoadScene(std::string configfile, Scene& scene, const BenchOptions& opts,
+                                       bool use_scene_cache = true);
+
+// Runs f repeats times and returns the shortest wall time of a single run, in seconds.
+template <typename F>
+double BestTime(unsigned int repeats, F f){
+    double best = -1.0;
+    for(unsigned int k = 0; k < repeats; k++){
+        auto start = std::chrono::high_resolution_clock::now();
+        f();
+        auto end = std::chrono::high_resolution_clock::now();
+        double s = std::chrono::duration<double>(end - start).count();
+        if(best < 0.0 || s < best) best = s;
+    }
+    return best;
+}
+
+#endif // __BENCH_HPP__
@@ -0,0 +1,23 @@
+// Acceleration structure build time. The scene is loaded anew for each repetition, since Scene::Commit consumes its load buffers,
+// and only the commit itself is timed. The scene cache is ignored, so that the tree is always built.
+
+#include "bench.hpp"
+
+#include "../src/scene.hpp"
+#include "../src/config.hpp"
+
+Json::Value BenchBuild(std::string configfile, const BenchOptions& opts){
+    Json::Value res;
+    double best = -1.0;
+    unsigned int triangles = 0;
+    for(unsigned int k = 0; k < opts.repeats; k++){
+        Scene scene;
+        if(!BenchLoadScene(configfile, scene, opts, false)) return res;
+        double t = BestTime(1, [&](){ scene.Commit(); });
+        if(best < 0.0 || t < best) best = t;
+        triangles = scene.n_triangles;
+    }
+    res["commit-time"] = best;
+    res["mtriangles-per-second"] = triangles / best / 1e6;
+    return res;
+}
@@ -0,0 +1,34 @@
+// Full frame render time. The renderer seeds each task deterministically, so with the same number of rounds and
+// threads, every run traces the same paths. Only the rendering rounds are timed, the image is not written out.
+
+#include "bench.hpp"
+
+#include "../src/scene.hpp"
+#include "../src/config.hpp"
+#include "../src/camera.hpp"
+#include "../src/render_driver.hpp"
+
+Json::Value BenchFrame(const Scene& scene, std::shared_ptr<Config> cfg, const BenchOptions& opts){
+    cfg->render_limit_mode = RenderLimitMode::Rounds;
+    cfg->render_rounds = opts.frame_rounds;
+    Camera camera = cfg->GetCamera(0.0f);
+
+    unsigned int rays = 0;
+    double t = -1.0;
+    for(unsigned int k = 0; k < opts.repeats; k++){
+        RenderDriver::RenderFrame(scene, cfg, camera, "");
+        rays = RenderDriver::GetRaysDone();
+        double s = RenderDriver::GetRenderTime();
+        if(t < 0.0 || s < t) t = s;
+    }
+
+    Json::Value res;
+    res["width"] = cfg->xres;
+    res["height"] = cfg->yres;
+    res["multisample"] = cfg->multisample;
+    res["rounds"] = opts.frame_rounds;
+    res["time"] = t;
+    res["rays"] = rays;
+    res["mrays-per-second"] = rays / t / 1e6;
+    return res;
+}
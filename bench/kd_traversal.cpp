@@ -0,0 +1,177 @@
+// kd-tree traversal throughput of each Scene::FindIntersectKd* variant on a few fixed-seed ray sets. Compare the
+// numbers between builds to verify that a change to the traversal does not make any of the variants slower.
+
+#include <random>
+
+#include "bench.hpp"
+
+#include "../src/scene.hpp"
+#include "../src/camera.hpp"
+#include "../src/ray.hpp"
+#include "../src/random_utils.hpp"
+
+struct BenchRay{
+    Ray r;
+    const Triangle* source;
+};
+
+// Rays leaving random points on random triangles in random directions. Only world space triangles are used, as
+// instanced ones are in object space.
+static std::vector<BenchRay> MakeBounceRays(const Scene& scene, unsigned int n, std::mt19937& gen){
+    std::uniform_real_distribution<float> u(0.0f, 1.0f);
+    std::uniform_int_distribution<unsigned int> tri(0, scene.n_world_triangles - 1);
+    std::vector<BenchRay> res(n);
+    for(unsigned int i = 0; i < n; i++){
+        unsigned int t = tri(gen);
+        glm::vec3 p = scene.GetRandomPoint(t, glm::vec2(u(gen), u(gen)));
+        glm::vec3 d = RandomUtils::Sample2DToSphereUniform(glm::vec2(u(gen), u(gen)));
+        res[i] = BenchRay{Ray(p, d), &scene.triangles[t]};
+    }
+    return res;
+}
+
+// Rays from the camera towards random points on random triangles.
+static std::vector<BenchRay> MakeCameraRays(const Scene& scene, glm::vec3 origin, unsigned int n, std::mt19937& gen){
+    std::uniform_real_distribution<float> u(0.0f, 1.0f);
+    std::uniform_int_distribution<unsigned int> tri(0, scene.n_world_triangles - 1);
+    std::vector<BenchRay> res(n);
+    for(unsigned int i = 0; i < n; i++){
+        unsigned int t = tri(gen);
+        glm::vec3 p = scene.GetRandomPoint(t, glm::vec2(u(gen), u(gen)));
+        res[i] = BenchRay{Ray(origin, p - origin), nullptr};
+    }
+    return res;
+}
+
+// Jittered camera rays, multisample per pixel for a grid of pixels, consecutive rays belong to the same pixel.
+static std::vector<Ray> MakePixelRays(const Camera& camera, unsigned int n, unsigned int multisample, std::mt19937& gen){
+    std::uniform_real_distribution<float> u(0.0f, 1.0f);
+    unsigned int pixels = n / multisample;
+    unsigned int res = std::max(1.0f, std::sqrt((float)pixels));
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    for(unsigned int p = 0; p < pixels; p++)
+        for(unsigned int i = 0; i < multisample; i++)
+            rays.push_back(camera.GetPixelRay(p % res, (p / res) % res, res, res, glm::vec2(u(gen), u(gen))));
+    return rays;
+}
+
+// Finite segments between pairs of random points on random triangles.
+static std::vector<BenchRay> MakeShadowRays(const Scene& scene, unsigned int n, std::mt19937& gen){
+    std::uniform_real_distribution<float> u(0.0f, 1.0f);
+    std::uniform_int_distribution<unsigned int> tri(0, scene.n_world_triangles - 1);
+    std::vector<BenchRay> res(n);
+    for(unsigned int i = 0; i < n; i++){
+        unsigned int t = tri(gen);
+        glm::vec3 a = scene.GetRandomPoint(t, glm::vec2(u(gen), u(gen)));
+        unsigned int t2 = tri(gen);
+        glm::vec3 b = scene.GetRandomPoint(t2, glm::vec2(u(gen), u(gen)));
+        res[i] = BenchRay{Ray(a, b, scene.epsilon), &scene.triangles[t]};
+    }
+    return res;
+}
+
+// Runs f over the whole ray set several times and returns the best throughput in Mrays/s.
+template <typename F>
+static double Measure(const std::vector<BenchRay>& rays, unsigned int repeats, F f){
+    // Results are stored to a volatile, to keep the compiler from discarding the queries.
+    volatile unsigned int sink;
+    double t = BestTime(repeats, [&](){
+            unsigned int hits = 0;
+            for(const BenchRay& br : rays) hits += f(br) ? 1 : 0;
+            sink = hits;
+        });
+    return rays.size() / t / 1e6;
+}
+
+Json::Value BenchTraversal(Scene& scene, const Camera& camera, const BenchOptions& opts){
+    std::mt19937 gen(opts.seed);
+    std::vector<std::pair<std::string, std::vector<BenchRay>>> sets = {
+        {"camera", MakeCameraRays(scene, camera.origin, opts.rays, gen)},
+        {"bounce", MakeBounceRays(scene, opts.rays, gen)},
+        {"shadow", MakeShadowRays(scene, opts.rays, gen)},
+    };
+
+    Json::Value res;
+    res["rays-per-set"] = opts.rays;
+    for(const auto& s : sets){
+        const auto& rays = s.second;
+        Json::Value& r = res["sets"][s.first];
+        r["nearest"] = Measure(rays, opts.repeats, [&](const BenchRay& br){
+                return scene.FindIntersectKd(br.r).triangle != nullptr;});
+        r["any"] = Measure(rays, opts.repeats, [&](const BenchRay& br){
+                return scene.FindIntersectKdAny(br.r) != nullptr;});
+        r["other-than"] = Measure(rays, opts.repeats, [&](const BenchRay& br){
+                return scene.FindIntersectKdOtherThan(br.r, br.source).triangle != nullptr;});
+        ThinglassIsections thinglass;
+        r["thinglass"] = Measure(rays, opts.repeats, [&](const BenchRay& br){
+                return scene.FindIntersectKdOtherThanWithThinglass(br.r, br.source, thinglass).triangle != nullptr;});
+    }
+
+    // The kd-tree's full and short stack traversals, on the same bounce and shadow rays.
+    if(scene.GetAccelStructure() == AccelStructure::Kd){
+        bool short_stack = scene.GetKdShortStack();
+        for(bool s : {false, true}){
+            scene.SetKdShortStack(s);
+            Json::Value& k = res["kd-traversal"][s ? "short-stack" : "stack"];
+            for(const auto& set : sets){
+                if(set.first == "camera") continue;
+                k[set.first]["nearest"] = Measure(set.second, opts.repeats, [&](const BenchRay& br){
+                        return scene.FindIntersectKd(br.r).triangle != nullptr;});
+                k[set.first]["any"] = Measure(set.second, opts.repeats, [&](const BenchRay& br){
+                        return scene.FindIntersectKdAny(br.r) != nullptr;});
+                k[set.first]["other-than"] = Measure(set.second, opts.repeats, [&](const BenchRay& br){
+                        return scene.FindIntersectKdOtherThan(br.r, br.source).triangle != nullptr;});
+            }
+        }
+        scene.SetKdShortStack(short_stack);
+    }
+
+    // Batched camera rays, as used for the first hit of each path.
+    const unsigned int multisample = 16;
+    std::vector<Ray> pixel_rays = MakePixelRays(camera, opts.rays, multisample, gen);
+    std::vector<Intersection> hits(multisample);
+    double single = BestTime(opts.repeats, [&](){
+            for(const Ray& r : pixel_rays) scene.FindIntersectKd(r);
+        });
+    double stream = BestTime(opts.repeats, [&](){
+            for(unsigned int i = 0; i + multisample <= pixel_rays.size(); i += multisample)
+                scene.IntersectStream(&pixel_rays[i], hits.data(), multisample);
+        });
+    Json::Value& p = res["pixel-rays"];
+    p["per-pixel"] = multisample;
+    p["single"] = pixel_rays.size() / single / 1e6;
+    p["stream"] = pixel_rays.size() / stream / 1e6;
+
+    // Shadow rays as the path tracer casts them, in groups from one point to several others. Compares a nearest hit
+    // search for each segment with occlusion queries from each point.
+    const unsigned int group = 8;
+    std::uniform_real_distribution<float> u(0.0f, 1.0f);
+    std::uniform_int_distribution<unsigned int> tri(0, scene.n_world_triangles - 1);
+    std::vector<glm::vec3> origins(opts.rays / group);
+    std::vector<ShadowQuery> queries(origins.size() * group);
+    for(glm::vec3& o : origins){
+        unsigned int t = tri(gen);
+        o = scene.GetRandomPoint(t, glm::vec2(u(gen), u(gen)));
+    }
+    for(ShadowQuery& q : queries){
+        unsigned int t = tri(gen);
+        q.to = scene.GetRandomPoint(t, glm::vec2(u(gen), u(gen)));
+    }
+    double nearest = BestTime(opts.repeats, [&](){
+            for(unsigned int i = 0; i < queries.size(); i++){
+                Ray r(origins[i / group], queries[i].to, scene.epsilon * 20.0f);
+                queries[i].occluded = scene.FindIntersectKd(r).triangle != nullptr;
+            }
+        });
+    double occluded = BestTime(opts.repeats, [&](){
+            OcclusionCache cache;
+            for(unsigned int i = 0; i < origins.size(); i++)
+                scene.OccludedFrom(origins[i], &queries[i * group], group, &cache);
+        });
+    Json::Value& sb = res["shadow-groups"];
+    sb["group-size"] = group;
+    sb["nearest"] = queries.size() / nearest / 1e6;
+    sb["occluded"] = queries.size() / occluded / 1e6;
+    return res;
+}
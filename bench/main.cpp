@@ -0,0 +1,197 @@
+// Benchmark suite. Runs the selected benchmark groups, on each of the given scene config files where a group needs
+// a scene, and writes all results as a single JSON document, so that results of different builds can be compared
+// by scripts.
+
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include "bench.hpp"
+
+#include "../src/scene.hpp"
+#include "../src/config.hpp"
+#include "../src/camera.hpp"
+#include "../src/utils.hpp"
+#include "../src/out.hpp"
+#include "../src/simd.hpp"
+
+std::string usage_text = R"--(
+Runs benchmarks, on scenes from each config FILE where needed, and writes the
+results as JSON. Progress is reported on stderr.
+ -o, --output FILE  Writes the results to FILE instead of stdout.
+ -g, --groups LIST  Comma-separated benchmark groups to run. Available groups:
+                      traversal, build, frame (per scene),
+                      samplers, bxdfs. By default all groups are run.
+ --rays N           Rays per fixed ray set, and BxDF samples. Default: 200000.
+ --repeats N        Runs of each measurement, the best one is reported.
+                      Default: 5.
+ --rounds N         Rendering rounds for frame time. Default: 1.
+ --seed N           Seed for benchmark inputs. Default: 42.
+ --accel kd|bvh|wide-bvh
+                    Overrides the acceleration structure of all scenes.
+ --kd-clip          Enables kd-clip-triangles for all scenes.
+ --instancing       Enables instancing for all scenes.
+ --compress-attributes
+                    Enables compress-attributes for all scenes.
+ -v                 Increases renderer verbosity. Renderer output goes to
+                      stdout, so use with -o.
+ -h, --help         Prints out this message.
+)--";
+
+void usage(const char* prog) __attribute__((noreturn));
+void usage(const char* prog){
+    std::cout << "Usage: " << prog << " [OPTIONS]... [FILE]...\n";
+    std::cout << usage_text;
+    exit(0);
+}
+
+std::shared_ptr<Config> BenchLoadScene(std::string configfile, Scene& scene, const BenchOptions& opts,
+                                       bool use_scene_cache){
+    std::shared_ptr<Config> cfg;
+    try{
+        cfg = ConfigJSON::CreateFromFile(configfile);
+        cfg->use_scene_cache = use_scene_cache;
+        if(opts.force_accel) cfg->accel = opts.accel;
+        if(opts.force_kd_clip) cfg->kd_clip_triangles = true;
+        if(opts.force_instancing) cfg->instancing = true;
+        if(opts.force_compress_attributes) cfg->compress_attributes = true;
+        cfg->InstallMaterials(scene);
+        cfg->InstallScene(scene);
+        cfg->InstallLights(scene);
+        cfg->InstallSky(scene);
+        scene.MakeThinglassSet(cfg->thinglass);
+    }catch(ConfigFileException ex){
+        std::cerr << "Failed to load config file: " << ex.what() << std::endl;
+        return nullptr;
+    }
+    return cfg;
+}
+
+int main(int argc, char** argv){
+    static struct option long_opts[] =
+        {
+            {"output", required_argument, 0, 'o'},
+            {"groups", required_argument, 0, 'g'},
+            {"rays", required_argument, 0, 'R'},
+            {"repeats", required_argument, 0, 'n'},
+            {"rounds", required_argument, 0, 'r'},
+            {"seed", required_argument, 0, 'S'},
+            {"accel", required_argument, 0, 'a'},
+            {"kd-clip", no_argument, 0, 'c'},
+            {"instancing", no_argument, 0, 'I'},
+            {"compress-attributes", no_argument, 0, 'A'},
+            {"help", no_argument, 0, 'h'},
+            {0,0,0,0}
+        };
+
+    BenchOptions opts;
+    std::string output = "";
+    std::vector<std::string> groups = {"traversal", "build", "frame", "samplers", "bxdfs"};
+    out::verbosity_level = 0;
+    int c, opt_index = 0;
+    while((c = getopt_long(argc,argv,"ho:g:v",long_opts,&opt_index)) != -1){
+        switch (c){
+        case 'h': usage(argv[0]); break;
+        case 'o': output = optarg; break;
+        case 'g': groups = Utils::SplitString(optarg, ","); break;
+        case 'R': opts.rays = std::stoi(optarg); break;
+        case 'n': opts.repeats = std::max(1, std::stoi(optarg)); break;
+        case 'r': opts.frame_rounds = std::max(1, std::stoi(optarg)); break;
+        case 'S': opts.seed = std::stoi(optarg); break;
+        case 'a':
+            opts.force_accel = true;
+            if(std::string(optarg) == "kd") opts.accel = AccelStructure::Kd;
+            else if(std::string(optarg) == "bvh") opts.accel = AccelStructure::Bvh;
+            else if(std::string(optarg) == "wide-bvh") opts.accel = AccelStructure::WideBvh;
+            else{
+                std::cout << "ERROR: Invalid argument for --accel.\n";
+                usage(argv[0]);
+            }
+            break;
+        case 'c': opts.force_kd_clip = true; break;
+        case 'I': opts.force_instancing = true; break;
+        case 'A': opts.force_compress_attributes = true; break;
+        case 'v': out::verbosity_level++; break;
+        default:
+            std::cout << "ERROR: Unrecognized option " << (char)c << std::endl;
+            usage(argv[0]);
+            break;
+        }
+    }
+    std::vector<std::string> configfiles;
+    while(optind < argc) configfiles.push_back(argv[optind++]);
+
+    auto enabled = [&](std::string g){ return std::find(groups.begin(), groups.end(), g) != groups.end(); };
+
+    Json::Value res;
+    res["simd-width"] = SIMD_WIDTH;
+#ifndef NO_SIMD_LEAVES
+    res["simd-leaves"] = true;
+#else
+    res["simd-leaves"] = false;
+#endif
+    res["threads"] = std::thread::hardware_concurrency();
+    res["rays"] = opts.rays;
+    res["repeats"] = opts.repeats;
+    res["seed"] = opts.seed;
+
+    if(enabled("samplers")){
+        std::cerr << "Benchmarking samplers..." << std::endl;
+        res["samplers"] = BenchSamplers(opts);
+    }
+    if(enabled("bxdfs")){
+        std::cerr << "Benchmarking BxDFs..." << std::endl;
+        res["bxdfs"] = BenchBxDFs(opts);
+    }
+
+    res["scenes"] = Json::Value(Json::arrayValue);
+    for(const std::string& configfile : configfiles){
+        Json::Value s;
+        s["config"] = configfile;
+        if(enabled("build")){
+            std::cerr << "Benchmarking acceleration structure build on " << configfile << "..." << std::endl;
+            s["build"] = BenchBuild(configfile, opts);
+        }
+        if(enabled("traversal") || enabled("frame")){
+            Scene scene;
+            std::shared_ptr<Config> cfg = BenchLoadScene(configfile, scene, opts);
+            if(!cfg) return 1;
+            scene.Commit();
+            switch(scene.GetAccelStructure()){
+            case AccelStructure::Kd:      s["accel"] = "kd";       break;
+            case AccelStructure::Bvh:     s["accel"] = "bvh";      break;
+            case AccelStructure::WideBvh: s["accel"] = "wide-bvh"; break;
+            }
+            s["triangles"] = scene.n_triangles;
+            if(scene.n_triangles == 0){
+                std::cerr << "The scene is empty." << std::endl;
+                return 1;
+            }
+            if(enabled("traversal")){
+                std::cerr << "Benchmarking traversal on " << configfile << "..." << std::endl;
+                s["traversal"] = BenchTraversal(scene, cfg->GetCamera(0.0f), opts);
+            }
+            if(enabled("frame")){
+                std::cerr << "Benchmarking frame time on " << configfile << "..." << std::endl;
+                s["frame"] = BenchFrame(scene, cfg, opts);
+            }
+        }
+        res["scenes"].append(s);
+    }
+
+    Json::StyledWriter writer;
+    if(output == ""){
+        std::cout << writer.write(res);
+    }else{
+        std::ofstream f(output);
+        f << writer.write(res);
+        if(!f){
+            std::cerr << "Failed to write " << output << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Costs of the per-sample building blocks of the path tracer: preparing sample sets, and sampling and evaluating
+// each BxDF class. The inputs do not depend on the scene.
+
+#include <random>
+
+#include "bench.hpp"
+
+#include "../src/sampler.hpp"
+#include "../src/bxdf/bxdf.hpp"
+#include "../src/random_utils.hpp"
+
+// The path tracer prepares a sampler with this many dimensions for each pixel.
+#define BENCH_SAMPLER_DIM 64
+#define BENCH_SAMPLER_SET_SIZE 16
+#define BENCH_SAMPLER_CALLS 200
+
+template <typename S>
+static Json::Value MeasureSampler(const BenchOptions& opts){
+    Json::Value res;
+    S sampler(opts.seed, BENCH_SAMPLER_DIM, BENCH_SAMPLER_SET_SIZE);
+    double t = BestTime(opts.repeats, [&](){
+            for(unsigned int i = 0; i < BENCH_SAMPLER_CALLS; i++) sampler.PrepareSamples();
+        });
+    res["prepare-time"] = t / BENCH_SAMPLER_CALLS;
+    // Constructing the sampler is a part of the per-pixel cost as well.
+    double c = BestTime(opts.repeats, [&](){
+            for(unsigned int i = 0; i < BENCH_SAMPLER_CALLS; i++){
+                S s(opts.seed + i, BENCH_SAMPLER_DIM, BENCH_SAMPLER_SET_SIZE);
+                s.Advance();
+            }
+        });
+    res["setup-time"] = c / BENCH_SAMPLER_CALLS;
+    return res;
+}
+
+Json::Value BenchSamplers(const BenchOptions& opts){
+    Json::Value res;
+    res["dimensions"] = BENCH_SAMPLER_DIM;
+    res["set-size"] = BENCH_SAMPLER_SET_SIZE;
+    res["types"]["latin-hypercube"]     = MeasureSampler<LatinHypercubeSampler>(opts);
+    res["types"]["independent-offline"] = MeasureSampler<IndependentOfflineSampler>(opts);
+    res["types"]["stratified"]          = MeasureSampler<StratifiedSampler>(opts);
+    res["types"]["van-der-corput"]      = MeasureSampler<VanDerCoruptSampler>(opts);
+    res["types"]["halton"]              = MeasureSampler<HaltonSampler>(opts);
+    return res;
+}
+
+struct BxDFInput{
+    glm::vec3 Vi, Vr;
+    glm::vec2 uv, sample;
+};
+
+static Json::Value MeasureBxDF(const BxDF& bxdf, const std::vector<BxDFInput>& inputs, unsigned int repeats){
+    Json::Value res;
+    // Results are stored to a volatile, to keep the compiler from discarding the calls.
+    volatile float sink;
+    double ts = BestTime(repeats, [&](){
+            float sum = 0.0f;
+            for(const BxDFInput& in : inputs){
+                auto s = bxdf.sample(in.Vi, in.uv, in.sample);
+                sum += std::get<1>(s).r;
+            }
+            sink = sum;
+        });
+    double tv = BestTime(repeats, [&](){
+            float sum = 0.0f;
+            for(const BxDFInput& in : inputs)
+                sum += bxdf.value(in.Vi, in.Vr, in.uv).r;
+            sink = sum;
+        });
+    res["sample"] = inputs.size() / ts / 1e6;
+    res["value"] = inputs.size() / tv / 1e6;
+    return res;
+}
+
+template <typename B>
+static std::shared_ptr<Material> MakeLTCMaterial(float roughness){
+    auto bxdf = std::make_unique<B>();
+    bxdf->roughness = roughness;
+    auto m = std::make_shared<Material>();
+    m->bxdf = std::move(bxdf);
+    return m;
+}
+
+Json::Value BenchBxDFs(const BenchOptions& opts){
+    // Directions in the upper hemisphere of the shading space, as produced by the path tracer.
+    std::mt19937 gen(opts.seed);
+    std::uniform_real_distribution<float> u(0.0f, 1.0f);
+    std::vector<BxDFInput> inputs(opts.rays);
+    for(BxDFInput& in : inputs){
+        in.Vi = RandomUtils::Sample2DToHemisphereCosineZ(glm::vec2(u(gen), u(gen)));
+        in.Vr = RandomUtils::Sample2DToHemisphereCosineZ(glm::vec2(u(gen), u(gen)));
+        in.uv = glm::vec2(u(gen), u(gen));
+        in.sample = glm::vec2(u(gen), u(gen));
+    }
+
+    std::shared_ptr<Material> ggx = MakeLTCMaterial<BxDFLTC<LTC::GGX>>(0.3f);
+    std::shared_ptr<Material> ggx_diffuse = MakeLTCMaterial<BxDFLTCDiffuse<LTC::GGX>>(0.3f);
+    std::shared_ptr<Material> beckmann = MakeLTCMaterial<BxDFLTC<LTC::Beckmann>>(0.3f);
+    std::shared_ptr<Material> beckmann_diffuse = MakeLTCMaterial<BxDFLTCDiffuse<LTC::Beckmann>>(0.3f);
+    BxDFDiffuse diffuse;
+    BxDFMirror mirror;
+    BxDFTransparent transparent;
+    BxDFDielectric dielectric;
+    dielectric.ior = 1.5f;
+    BxDFMix mix;
+    mix.m1 = ggx;
+    mix.m2 = ggx_diffuse;
+    mix.amt1 = 0.5f;
+
+    Json::Value res;
+    res["samples"] = opts.rays;
+    Json::Value& b = res["classes"];
+    b["diffuse"]              = MeasureBxDF(diffuse, inputs, opts.repeats);
+    b["mirror"]               = MeasureBxDF(mirror, inputs, opts.repeats);
+    b["transparent"]          = MeasureBxDF(transparent, inputs, opts.repeats);
+    b["dielectric"]           = MeasureBxDF(dielectric, inputs, opts.repeats);
+    b["ltc-ggx"]              = MeasureBxDF(*ggx->bxdf, inputs, opts.repeats);
+    b["ltc-ggx-diffuse"]      = MeasureBxDF(*ggx_diffuse->bxdf, inputs, opts.repeats);
+    b["ltc-beckmann"]         = MeasureBxDF(*beckmann->bxdf, inputs, opts.repeats);
+    b["ltc-beckmann-diffuse"] = MeasureBxDF(*beckmann_diffuse->bxdf, inputs, opts.repeats);
+    b["mix"]                  = MeasureBxDF(mix, inputs, opts.repeats);
+    return res;
+}
@@ -56,34 +56,57 @@ std::pair<glm::mat3, float> LTC::get_bilinear(LTCdef ltc, const float theta, con
 	return {resM, resAMP};
 }
 
-float LTC::GetPDF(LTCdef ltc, glm::vec3 N, glm::vec3 Vr, glm::vec3 Vi, float alpha, bool debug){
-    assert(alpha >= 0.0f && alpha <= 1.0f);
-    (void)debug;
-
+glm::mat3 LTC::get_frame(glm::vec3 N, glm::vec3 Vi){
     glm::vec3 tangent = glm::cross(N,Vi);
+    // At normal incidence Vi does not choose a tangent, but the distribution is then symmetric about N, so any
+    // tangent will do.
+    if(glm::length(tangent) < 0.0001f)
+        tangent = glm::cross(N, (glm::abs(N.x) < 0.9f) ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f));
+    tangent = glm::normalize(tangent);
     glm::vec3 Vi_cast = glm::cross(tangent,N);
     // X unit vector has to go to Vi_cast
     // Y unit vector has to go to tangent (direction does not matter)
     // Z unit vector has to go to N
-    glm::mat3 rotate(Vi_cast, tangent, N);
-    glm::mat3 unrotate = glm::inverse(rotate);
+    return glm::mat3(Vi_cast, tangent, N);
+}
+
+float LTC::GetPDF(LTCdef ltc, glm::vec3 N, glm::vec3 Vr, glm::vec3 Vi, float alpha, bool debug){
+    assert(alpha >= 0.0f && alpha <= 1.0f);
+    (void)debug;
+
+    glm::mat3 rotate = get_frame(N, Vi);
+    glm::mat3 unrotate = glm::transpose(rotate);
 
     glm::vec3 Vr3 = unrotate * Vr;
 
     float theta = glm::angle(Vi, N);
     auto q = get_bilinear(ltc, theta, alpha);
-    glm::mat3 M = q.first;
-    float amplitude = q.second;
+    return q.second * get_distribution(q.first, Vr3);
+}
+
+float LTC::GetSamplePDF(LTCdef ltc, glm::vec3 N, glm::vec3 Vr, glm::vec3 Vi, float alpha, bool debug){
+    (void)debug;
+
+    // The same frame and matrix as in GetRandom.
+    glm::mat3 rotate = get_frame(N, Vi);
+
+    float theta = glm::angle(Vi, N);
+    auto q = get_bilinear(ltc, glm::max(theta, glm::pi<float>()/4.0f), alpha);
+    float res = get_distribution(rotate * q.first, Vr);
+    qassert_true(std::isfinite(res));
+    return res;
+}
+
+float LTC::get_distribution(glm::mat3 M, glm::vec3 L){
     glm::mat3 invM = glm::inverse(M);
-    glm::vec3 p = glm::normalize( invM * Vr3 );
+    glm::vec3 p = glm::normalize( invM * L );
     glm::vec3 Loriginal = p;
     glm::vec3 L_ = M * Loriginal;
     float l = glm::length(L_);
     float detM = glm::determinant(M);
 	float Jacobian = detM / (l*l*l);
     float D = 1.0f / 3.14159f * glm::max<float>(0.0f, Loriginal.z);
-    float res = amplitude * D / Jacobian;
-    return res;
+    return D / Jacobian;
 }
 
 
@@ -112,12 +135,7 @@ float LTC::GetPDFZ(LTCdef ltc, glm::vec3 Vr, glm::vec3 Vi, float alpha, bool deb
 
 glm::vec3 LTC::GetRandom(LTCdef ltc, glm::vec3 N, glm::vec3 Vi, float roughness, glm::vec3 rand_hscos, bool debug){
 
-    glm::vec3 tangent = glm::cross(N,Vi);
-    glm::vec3 Vi_cast = glm::cross(tangent,N);
-    // X unit vector has to go to Vi_cast
-    // Y unit vector has to go to tangent (direction does not matter)
-    // Z unit vector has to go to N
-    glm::mat3 rotate(Vi_cast, tangent, N);
+    glm::mat3 rotate = get_frame(N, Vi);
 
     float theta = glm::angle(Vi, N);
     auto q = get_bilinear(ltc, glm::max(theta, glm::pi<float>()/4.0f), roughness, debug);
@@ -23,6 +23,9 @@ public:
     // vector, incoming/reflected vectors, and roughness.
     static float GetPDF(LTCdef ltc, glm::vec3 N, glm::vec3 Vr, glm::vec3 Vi, float alpha, bool debug = false);
     static float GetPDFZ(LTCdef ltc, glm::vec3 Vr, glm::vec3 Vi, float alpha, bool debug = false);
+    // The probability density of GetRandom returning Vr. Ignores that GetRandom lifts directions from below the
+    // horizon, so it is only an approximation for directions close to it.
+    static float GetSamplePDF(LTCdef ltc, glm::vec3 N, glm::vec3 Vr, glm::vec3 Vi, float alpha, bool debug = false);
     // Given a random Z-oriented vector rand_hscos, this method
     // applies the linear transform that approximates the LTC BRDF.
     static glm::vec3 GetRandom(LTCdef ltc, glm::vec3 normal, glm::vec3 incoming, float roughness, glm::vec3 rand_hscos, bool debug = false);
@@ -32,4 +35,8 @@ public:
     static const LTCdef GGX;
 private:
     static std::pair<glm::mat3, float> get_bilinear(LTCdef ltc, const float theta, const float alpha, bool debug = false);
+    // An orthonormal frame with N as its Z axis and Vi in its XZ plane, in which the LTC matrices are tabulated.
+    static glm::mat3 get_frame(glm::vec3 N, glm::vec3 Vi);
+    // The density of a clamped cosine distribution transformed by M, in direction L.
+    static float get_distribution(glm::mat3 M, glm::vec3 L);
 };
@@ -0,0 +1,60 @@
+#ifndef __ALIAS_TABLE_HPP__
+#define __ALIAS_TABLE_HPP__
+
+#include <vector>
+
+/* Walker's alias method (in Vose's formulation): chooses an index with probability proportional to its weight.
+ * Building is O(n), each choice is O(1).
+ */
+class AliasTable{
+public:
+    // Weights must not be negative, and at least one of them must be positive.
+    void Build(const std::vector<float>& weights){
+        unsigned int n = weights.size();
+        double total = 0.0;
+        for(float w : weights) total += w;
+        buckets_.resize(n);
+        probabilities_.resize(n);
+        // Weights scaled so that their average is 1. A bucket of a weight below 1 is topped up by a larger one.
+        std::vector<double> scaled(n);
+        std::vector<unsigned int> small, large;
+        for(unsigned int i = 0; i < n; i++){
+            probabilities_[i] = weights[i] / total;
+            scaled[i] = weights[i] * n / total;
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        while(!small.empty() && !large.empty()){
+            unsigned int s = small.back(), l = large.back();
+            small.pop_back();
+            buckets_[s] = Bucket{(float)scaled[s], l};
+            scaled[l] -= 1.0 - scaled[s];
+            if(scaled[l] < 1.0){
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Whatever remains is 1 up to rounding errors.
+        for(unsigned int i : small) buckets_[i] = Bucket{1.0f, i};
+        for(unsigned int i : large) buckets_[i] = Bucket{1.0f, i};
+    }
+    // Both samples are in [0,1). The first selects a bucket, the second chooses within it. A single sample would have
+    // to do both, leaving too few bits of a float to choose within buckets of large tables.
+    unsigned int Sample(float bucket_sample, float sample) const{
+        unsigned int i = bucket_sample * buckets_.size();
+        if(i >= buckets_.size()) i = buckets_.size() - 1;
+        const Bucket& b = buckets_[i];
+        return (sample < b.threshold) ? i : b.alias;
+    }
+    // The probability of Sample choosing index i.
+    float Probability(unsigned int i) const {return probabilities_[i];}
+    unsigned int size() const {return buckets_.size();}
+private:
+    struct Bucket{
+        float threshold;
+        unsigned int alias;
+    };
+    std::vector<Bucket> buckets_;
+    std::vector<float> probabilities_;
+};
+
+#endif // __ALIAS_TABLE_HPP__
@@ -86,25 +86,25 @@ void Material::LoadFromJson(Json::Value& node, Scene& scene, std::string texture
 }
 
 void Material::LoadFromAiMaterial(const aiMaterial* mat, Scene& scene, std::string texture_directory){
+    LoadFromImported(ImportAiMaterial(mat, texture_directory), scene);
+}
+
+ImportedMaterial Material::ImportAiMaterial(const aiMaterial* mat, std::string texture_directory){
+    ImportedMaterial m;
 
     aiString ainame;
     mat->Get(AI_MATKEY_NAME, ainame);
-    name = ainame.C_Str();
+    m.name = ainame.C_Str();
     aiColor3D c;
     mat->Get(AI_MATKEY_COLOR_DIFFUSE,c);
     //std::cout << "Processing ai material named " << name << std::endl;
-    auto diffuse = scene.CreateSolidTexture(Color(c.r, c.g, c.b));
-    //std::cout << "Example diffuse: " << diffuse->Get(glm::vec2(0,0)) << std::endl;
+    m.diffuse = Color(c.r, c.g, c.b);
     mat->Get(AI_MATKEY_COLOR_SPECULAR,c);
-    auto specular = scene.CreateSolidTexture(Color(c.r, c.g, c.b));
-    //std::cout << "Example specular: " << specular->Get(glm::vec2(0,0)) << std::endl;
+    m.specular = Color(c.r, c.g, c.b);
     mat->Get(AI_MATKEY_COLOR_EMISSIVE,c);
-    emission = Radiance(c.r, c.g, c.b);
-    float f;
+    m.emission = Radiance(c.r, c.g, c.b);
 
     /* TODO: Incorporate this information into bxdf choice
-    mat->Get(AI_MATKEY_SHININESS, f);
-    m.exponent = f/4; // This is weird. Why does assimp multiply by 4 in the first place?
     mat->Get(AI_MATKEY_REFRACTI, f);
     m.refraction_index = f;
     mat->Get(AI_MATKEY_OPACITY, f);
@@ -118,7 +118,7 @@ void Material::LoadFromAiMaterial(const aiMaterial* mat, Scene& scene, std::stri
         mat->GetTexture(aiTextureType_DIFFUSE, 0, &as); s = as.C_Str();
         if(s != ""){
             out::cout(5) << "Material has diffuse texture " << s << std::endl;
-            diffuse = scene.GetTexture(texture_directory + s);
+            m.diffuse_texture = texture_directory + s;
         }
     }
     n = mat->GetTextureCount(aiTextureType_SPECULAR);
@@ -126,7 +126,7 @@ void Material::LoadFromAiMaterial(const aiMaterial* mat, Scene& scene, std::stri
         mat->GetTexture(aiTextureType_SPECULAR, 0, &as); s = as.C_Str();
         if(s != ""){
             out::cout(5) << "Material has specular texture " << s << std::endl;
-            specular = scene.GetTexture(texture_directory + s);
+            m.specular_texture = texture_directory + s;
         }
     }
     n = mat->GetTextureCount(aiTextureType_HEIGHT);
@@ -134,12 +134,28 @@ void Material::LoadFromAiMaterial(const aiMaterial* mat, Scene& scene, std::stri
         mat->GetTexture(aiTextureType_HEIGHT, 0, &as); s = as.C_Str();
         if(s != ""){
             out::cout(5) << "Material has bump texture " << s << std::endl;
-            bumpmap = scene.GetTexture(texture_directory + s);
+            m.bump_texture = texture_directory + s;
         }
     }
 
-    mat->Get(AI_MATKEY_SHININESS, f);
-    float phong_exp = f/4; // This is weird. Why does assimp multiply by 4 in the first place?
+    mat->Get(AI_MATKEY_SHININESS, m.shininess);
+
+    return m;
+}
+
+void Material::LoadFromImported(const ImportedMaterial& m, Scene& scene){
+    name = m.name;
+    emission = m.emission;
+
+    auto diffuse = scene.CreateSolidTexture(m.diffuse);
+    //std::cout << "Example diffuse: " << diffuse->Get(glm::vec2(0,0)) << std::endl;
+    auto specular = scene.CreateSolidTexture(m.specular);
+    //std::cout << "Example specular: " << specular->Get(glm::vec2(0,0)) << std::endl;
+    if(m.diffuse_texture != "") diffuse = scene.GetTexture(m.diffuse_texture);
+    if(m.specular_texture != "") specular = scene.GetTexture(m.specular_texture);
+    if(m.bump_texture != "") bumpmap = scene.GetTexture(m.bump_texture);
+
+    float phong_exp = m.shininess/4; // This is weird. Why does assimp multiply by 4 in the first place?
     float roughness = glm::pow(2.0f / (2.0f + phong_exp), 0.5f);
 
     /*
@@ -203,6 +219,11 @@ BxDFDiffuse::sample(glm::vec3 Vi, glm::vec2 texUV, glm::vec2 sample, bool) const
     return std::make_tuple(v,diffuse->GetSpectrum(texUV), false);
 }
 
+float BxDFDiffuse::pdf(glm::vec3 Vi, glm::vec3 Vr, glm::vec2, bool) const{
+    if(Vi.z <= 0 || Vr.z <= 0) return 0.0f;
+    return Vr.z / glm::pi<float>();
+}
+
 
 void BxDFDiffuse::LoadFromJson(Json::Value& node, Scene& scene, std::string texturedir) {
     std::string texfile;
@@ -248,6 +269,19 @@ BxDFMix::sample(glm::vec3 Vi, glm::vec2 texUV, glm::vec2 sample, bool debug) con
     }
 }
 
+bool BxDFMix::IsSpecularDirection(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug) const{
+    // The direction a specular part scatters into is most likely where sample() chose that part.
+    for(const Material* m : {m1.get(), m2.get()})
+        if(m->bxdf->IsSpecularDirection(Vi,Vr,texUV,debug) && m->bxdf->value(Vi,Vr,texUV,debug).max() > 0.0f)
+            return true;
+    return false;
+}
+
+float BxDFMix::pdf(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug) const{
+    if(IsSpecularDirection(Vi,Vr,texUV,debug)) return 0.0f;
+    return m1->bxdf->pdf(Vi,Vr,texUV,debug)*amt1 + m2->bxdf->pdf(Vi,Vr,texUV,debug)*(1.0f-amt1);
+}
+
 
 // ================ Mirror ===============
 
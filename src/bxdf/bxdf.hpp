@@ -7,6 +7,7 @@
 #include "../../external/json/json.h"
 
 #include "../texture.hpp"
+#include "../primitives.hpp"
 #include "../LTC/ltc.hpp"
 #include "../random_utils.hpp"
 #include "../jsonutils.hpp"
@@ -31,6 +32,10 @@ public:
 
     void LoadFromJson(Json::Value& node, Scene& scene, std::string texturedir);
     void LoadFromAiMaterial(const aiMaterial* mat, Scene& scene, std::string texturedir);
+    void LoadFromImported(const ImportedMaterial& mat, Scene& scene);
+
+    // Reads the properties of an assimp material, texture paths are prefixed with texturedir.
+    static ImportedMaterial ImportAiMaterial(const aiMaterial* mat, std::string texturedir);
 };
 
 #define BxDFUpVector glm::vec3(0.0f, 0.0f, 1.0f)
@@ -40,6 +45,15 @@ public:
     virtual Spectrum value(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const = 0;
     virtual std::tuple<glm::vec3, Spectrum, bool> sample(glm::vec3 Vi, glm::vec2 texUV, glm::vec2 sample, bool debug = false) const = 0;
     virtual void LoadFromJson(Json::Value&, Scene&, std::string){};
+    // The probability density, per solid angle, of sample(Vi, ...) choosing the direction Vr. Zero for directions
+    // that only following sample() finds light from, see IsSpecular().
+    virtual float pdf(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const = 0;
+    // True if it only scatters into single directions, so value() is zero almost everywhere, and light reaching it
+    // can only be found by following sample().
+    virtual bool IsSpecular() const {return false;}
+    // True if sample() can only have scattered Vi into Vr (its result) through a specular part, so light sampling
+    // does not find the light coming from Vr.
+    virtual bool IsSpecularDirection(glm::vec3, glm::vec3, glm::vec2, bool = false) const {return IsSpecular();}
 };
 
 
@@ -48,6 +62,7 @@ class BxDFDiffuse : public BxDF{
 public:
     virtual Spectrum value(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const override;
     virtual std::tuple<glm::vec3, Spectrum, bool> sample(glm::vec3 Vi, glm::vec2 texUV, glm::vec2 sample, bool debug = false) const override;
+    virtual float pdf(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const override;
 
     void LoadFromJson(Json::Value& node, Scene& scene, std::string texturedir) override;
     std::shared_ptr<ReadableTexture> diffuse = std::make_shared<EmptyTexture>();
@@ -57,6 +72,8 @@ class BxDFTransparent : public BxDF{
 public:
     virtual Spectrum value(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const override;
     virtual std::tuple<glm::vec3, Spectrum, bool> sample(glm::vec3 Vi, glm::vec2 texUV, glm::vec2 sample, bool debug = false) const override;
+    virtual float pdf(glm::vec3, glm::vec3, glm::vec2, bool) const override {return 0.0f;}
+    virtual bool IsSpecular() const override {return true;}
 };
 
 class BxDFMirror : public BxDF{
@@ -66,6 +83,8 @@ public:
 
     std::shared_ptr<ReadableTexture> color = std::make_shared<EmptyTexture>();
     void LoadFromJson(Json::Value& node, Scene& scene, std::string texturedir) override;
+    virtual float pdf(glm::vec3, glm::vec3, glm::vec2, bool) const override {return 0.0f;}
+    virtual bool IsSpecular() const override {return true;}
 };
 
 class BxDFDielectric : public BxDF{
@@ -76,14 +95,21 @@ public:
     float ior = 1.0;
     std::shared_ptr<ReadableTexture> color = std::make_shared<EmptyTexture>();
     void LoadFromJson(Json::Value& node, Scene& scene, std::string texturedir) override;
+    virtual float pdf(glm::vec3, glm::vec3, glm::vec2, bool) const override {return 0.0f;}
+    virtual bool IsSpecular() const override {return true;}
 };
 
 class BxDFMix : public BxDF{
 public:
     virtual Spectrum value(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const override;
     virtual std::tuple<glm::vec3, Spectrum, bool> sample(glm::vec3 Vi, glm::vec2 texUV, glm::vec2 sample, bool debug = false) const override;
+    virtual float pdf(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const override;
 
     void LoadFromJson(Json::Value& node, Scene& scene, std::string texturedir) override;
+    // A mix with a non-specular part counts as non-specular, so light sampling finds that part's light.
+    // IsSpecularDirection tells apart the directions of its specular part.
+    virtual bool IsSpecular() const override {return m1->bxdf->IsSpecular() && m2->bxdf->IsSpecular();}
+    virtual bool IsSpecularDirection(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const override;
     std::shared_ptr<const Material> m1;
     std::shared_ptr<const Material> m2;
     float amt1;
@@ -119,6 +145,10 @@ public:
         if(v.z <= 0) return std::make_tuple(v, Spectrum(0), false);
         return std::make_tuple(v,color->GetSpectrum(texUV), false);
     }
+    virtual float pdf(glm::vec3 Vi, glm::vec3 Vr, glm::vec2, bool debug = false) const override{
+        if(Vi.z <= 0 || Vr.z <= 0) return 0.0f;
+        return LTC::GetSamplePDF(ltc, BxDFUpVector, Vr, Vi, roughness, debug);
+    }
 };
 
 
@@ -135,11 +165,7 @@ public:
                diff / glm::pi<float>() ;
     }
     virtual std::tuple<glm::vec3, Spectrum, bool> sample(glm::vec3 Vi, glm::vec2 texUV, glm::vec2 sample, bool debug = false) const override{
-        auto diff = diffuse->Get(texUV);
-        auto spec = color->Get(texUV);
-        float diffuse_power = diff.r + diff.g + diff.b; // Integral over diffuse spectrum...
-        float specular_power = spec.r + spec.g + spec.b; // Integral over specular spectrum...
-        float diffuse_probability = diffuse_power / (diffuse_power + specular_power + 0.0001f);
+        float diffuse_probability = DiffuseProbability(texUV);
         IFDEBUG std::cout << "[BxDF] Roughness: " << roughness << std::endl;
         if(RandomUtils::DecideAndRescale(sample.x, diffuse_probability)){
             // Diffuse ray
@@ -156,6 +182,21 @@ public:
             return std::make_tuple(v,color->GetSpectrum(texUV), false);
         }
     }
+    virtual float pdf(glm::vec3 Vi, glm::vec3 Vr, glm::vec2 texUV, bool debug = false) const override{
+        if(Vi.z <= 0 || Vr.z <= 0) return 0.0f;
+        float diffuse_probability = DiffuseProbability(texUV);
+        return diffuse_probability * Vr.z / glm::pi<float>() +
+               (1.0f - diffuse_probability) * LTC::GetSamplePDF(ltc, BxDFUpVector, Vr, Vi, roughness, debug);
+    }
+private:
+    // The probability of sample() choosing the diffuse part.
+    float DiffuseProbability(glm::vec2 texUV) const{
+        auto diff = diffuse->Get(texUV);
+        auto spec = color->Get(texUV);
+        float diffuse_power = diff.r + diff.g + diff.b; // Integral over diffuse spectrum...
+        float specular_power = spec.r + spec.g + spec.b; // Integral over specular spectrum...
+        return diffuse_power / (diffuse_power + specular_power + 0.0001f);
+    }
 };
 
 #endif // __BXDF_HPP__
@@ -2,6 +2,9 @@
 
 #include <fstream>
 #include <cmath>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -228,6 +231,11 @@ static const aiScene* loadAssimpScene(Assimp::Importer& importer, std::string mo
 }
 
 void ConfigRTC::InstallScene(Scene& s) const{
+    s.SetAccelStructure(accel);
+    s.SetKdClipTriangles(kd_clip_triangles);
+    s.SetCompressAttributes(compress_attributes);
+    s.SetKdShortStack(kd_short_stack);
+    s.SetLightTree(light_tree);
     std::string configdir = Utils::GetDir(config_file_path);
     std::string modelfile = configdir + "/" + model_file;
     std::string modeldir  = Utils::GetDir(modelfile);
@@ -311,6 +319,31 @@ std::shared_ptr<ConfigJSON> ConfigJSON::CreateFromFile(std::string path){
         }else throw ConfigFileException("The value of \"output-scale\" must either be a number, or \"auto\".");
     }
 
+    std::string accel = JsonUtils::getOptionalString(root, "accel", "kd");
+    if(accel == "kd"){
+        cfg.accel = AccelStructure::Kd;
+    }else if(accel == "bvh"){
+        cfg.accel = AccelStructure::Bvh;
+    }else if(accel == "wide-bvh"){
+        cfg.accel = AccelStructure::WideBvh;
+    }else throw ConfigFileException("The value of \"accel\" must be one of \"kd\", \"bvh\" or \"wide-bvh\".");
+    cfg.kd_clip_triangles = JsonUtils::getOptionalBool(root, "kd-clip-triangles", false);
+    cfg.compress_attributes = JsonUtils::getOptionalBool(root, "compress-attributes", false);
+    cfg.kd_short_stack = JsonUtils::getOptionalBool(root, "kd-short-stack", false);
+    cfg.light_tree = JsonUtils::getOptionalBool(root, "light-tree", false);
+    cfg.instancing = JsonUtils::getOptionalBool(root, "instancing", false);
+
+    if(root.isMember("adaptive")){
+        auto& adaptive = root["adaptive"];
+        JsonUtils::markNodeUsed(adaptive);
+        JsonUtils::setNodeSemanticName(adaptive, "adaptive sampling configuration");
+        if(!adaptive.isObject()) throw ConfigFileException("Value \"adaptive\" is not a dictionary.");
+        cfg.adaptive_threshold = JsonUtils::getRequiredFloat(adaptive, "threshold");
+        cfg.adaptive_min_rounds = std::max(1, JsonUtils::getOptionalInt(adaptive, "min-rounds", 2));
+        // Light paths are traced per pixel, so skipping pixels would also skip side effects they cast elsewhere.
+        if(cfg.reverse > 0) throw ConfigFileException("Adaptive sampling cannot be used with \"reverse\".");
+    }
+
     if(root.isMember("thinglass")){
         auto thinglass = root["thinglass"];
         JsonUtils::markNodeUsed(thinglass);
@@ -412,10 +445,49 @@ void ConfigJSON::InstallSky(Scene& s) const{
 }
 
 
+// Hashes everything the imported geometry depends on: the scene description, material definitions (these decide
+// which meshes are lights), and the contents of all model files. Files referenced by model files (e.g. .mtl) are
+// not included.
+static uint64_t sceneCacheKey(const Json::Value& root, std::string configdir){
+    uint64_t h = Utils::HashFNV1a(nullptr, 0);
+    std::vector<std::string> model_files;
+    for(std::string key : {"model-file", "scene", "materials", "brdf", "instancing"}){
+        if(!root.isMember(key)) continue;
+        std::string text = key + "=" + Json::FastWriter().write(root[key]);
+        h = Utils::HashFNV1a(text.data(), text.size(), h);
+    }
+    if(root.isMember("model-file") && root["model-file"].isString())
+        model_files.push_back(root["model-file"].asString());
+    if(root.isMember("scene") && root["scene"].isArray())
+        for(const auto& object : root["scene"])
+            if(object.isObject() && object.isMember("file") && object["file"].isString())
+                model_files.push_back(object["file"].asString());
+    for(const std::string& file : model_files)
+        if(!Utils::HashFile(configdir + "/" + file, h))
+            throw ConfigFileException("Unable to read model file \"" + file + "\"");
+    return h;
+}
+
 void ConfigJSON::InstallScene(Scene& s) const{
     std::string configdir = Utils::GetDir(config_file_path);
     if(root.isMember("model-file") && root.isMember("scene"))
         throw ConfigFileException("The input file may not contain both \"model-file\" key and \"scene\" key, maximum one of these is allowed.");
+    s.SetAccelStructure(accel);
+    s.SetKdClipTriangles(kd_clip_triangles);
+    s.SetCompressAttributes(compress_attributes);
+    s.SetKdShortStack(kd_short_stack);
+    s.SetLightTree(light_tree);
+    if(root.isMember("scene-cache") && use_scene_cache){
+        std::string cache_file = configdir + "/" + JsonUtils::getRequiredString(root, "scene-cache");
+        uint64_t key = sceneCacheKey(root, configdir);
+        if(s.LoadCache(cache_file, key)){
+            // The scene description is fully represented by the cache.
+            for(std::string k : {"model-file", "scene", "brdf"})
+                if(root.isMember(k)) JsonUtils::markNodeUsed(root[k], true);
+            return;
+        }
+        s.SetCacheFile(cache_file, key);
+    }
     if(root.isMember("model-file")){
         std::string modelfile = configdir + "/" + JsonUtils::getRequiredString(root,"model-file");
         std::string modeldir  = Utils::GetDir(modelfile);
@@ -435,6 +507,22 @@ void ConfigJSON::InstallScene(Scene& s) const{
         auto& scene_node = root["scene"];
         JsonUtils::markNodeUsed(scene_node);
         if(!scene_node.isArray()) throw ConfigFileException("The value of \"scene\" key must be an array of objects");
+        // Instanced meshes, by everything their object space geometry and materials depend on.
+        std::unordered_map<std::string, unsigned int> meshes;
+        // Loads the geometry once per key when instancing, and places it with the transform.
+        auto place = [&](std::string key, glm::mat4 transform, std::function<void(glm::mat4)> load){
+            if(!instancing){
+                load(transform);
+                return;
+            }
+            auto it = meshes.find(key);
+            if(it == meshes.end()){
+                s.BeginMesh();
+                load(glm::mat4());
+                it = meshes.insert(std::make_pair(key, s.EndMesh())).first;
+            }
+            s.AddInstance(it->second, transform);
+        };
         for(unsigned int i = 0; i < scene_node.size(); i++){
             auto& object = scene_node[i];
             JsonUtils::setNodeSemanticName(object, "scene object " + std::to_string(i) + " configuration");
@@ -456,10 +544,6 @@ void ConfigJSON::InstallScene(Scene& s) const{
 
                 bool smooth_normals = JsonUtils::getOptionalBool(object, "smooth-normals", false);
 
-                // Load the model with assimp
-                Assimp::Importer importer;
-                const aiScene* scene = loadAssimpScene(importer, modelfile, smooth_normals);
-
                 std::string brdf = JsonUtils::getOptionalString(object,"brdf",
                                                                 JsonUtils::getOptionalString(root,"brdf","ltc_ggx")
                                                                 );
@@ -478,10 +562,19 @@ void ConfigJSON::InstallScene(Scene& s) const{
                 // 3. Translation
                 transform = glm::translate(translate) * transform;
 
-                if(import_materials)
-                    s.LoadAiSceneMaterials(scene, brdf, modeldir + "/", override_materials);
+                std::string key = "file:" + model_file + ":" + forced_material + ":" + brdf + ":" +
+                                  std::to_string(import_materials) + std::to_string(override_materials) +
+                                  std::to_string(smooth_normals);
+                place(key, transform, [&](glm::mat4 t){
+                        // Load the model with assimp
+                        Assimp::Importer importer;
+                        const aiScene* scene = loadAssimpScene(importer, modelfile, smooth_normals);
+
+                        if(import_materials)
+                            s.LoadAiSceneMaterials(scene, brdf, modeldir + "/", override_materials);
 
-                s.LoadAiSceneMeshes(scene, transform, forced_material);
+                        s.LoadAiSceneMeshes(scene, t, forced_material);
+                    });
 
             }else if(object.isMember("primitive")){
                 std::string type = JsonUtils::getRequiredString(object, "primitive");
@@ -527,7 +620,11 @@ void ConfigJSON::InstallScene(Scene& s) const{
 
                 std::string material = JsonUtils::getRequiredString(object, "material");
 
-                s.AddPrimitive(*data, transform, material, texture_transform);
+                std::string key = "primitive:" + type + ":" + material + ":" + std::to_string(texscale.x) + "," +
+                                  std::to_string(texscale.y) + "," + std::to_string(texscale.z);
+                place(key, transform, [&](glm::mat4 t){
+                        s.AddPrimitive(*data, t, material, texture_transform);
+                    });
 
                 out::cout(2) << "Added a primitive with " << data->size()/3 << " faces." << std::endl;
 
@@ -40,6 +40,19 @@ public:
     unsigned int render_minutes = -1;
     bool force_fresnell = false;
     unsigned int reverse = 0;
+    // When positive, rounds after the first adaptive_min_rounds only render pixels whose relative error is above
+    // this threshold. Never set together with reverse.
+    float adaptive_threshold = 0.0f;
+    unsigned int adaptive_min_rounds = 2;
+    AccelStructure accel = AccelStructure::Kd;
+    bool kd_clip_triangles = false;
+    bool compress_attributes = false;
+    bool kd_short_stack = false;
+    bool light_tree = false;
+    // When true, scene objects with the same geometry are loaded once and instanced, instead of copied.
+    bool instancing = false;
+    // When false, InstallScene ignores the scene cache and always loads the scene description.
+    bool use_scene_cache = true;
     //std::string brdf = "cooktorr";
     std::vector<std::string> thinglass;
 
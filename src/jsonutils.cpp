@@ -129,11 +129,16 @@ void JsonUtils::prepareNodeMetadata(Json::Value& node, bool recursive){
             prepareNodeMetadata(child, true);
     }
 }
-void JsonUtils::markNodeUsed(Json::Value& node){
+void JsonUtils::markNodeUsed(Json::Value& node, bool recursive){
     auto vs = Utils::SplitString(node.getComment(Json::CommentPlacement::commentAfterOnSameLine), "|");
     assert(vs.size() == 3);
     vs[1] = "Y";
     node.setComment(Utils::JoinString(vs, "|"), Json::CommentPlacement::commentAfterOnSameLine);
+    if(recursive && (node.type() == Json::ValueType::arrayValue ||
+                     node.type() == Json::ValueType::objectValue)){
+        for(auto& child : node)
+            markNodeUsed(child, true);
+    }
 }
 void JsonUtils::markNodeUnused(Json::Value& node){
     auto vs = Utils::SplitString(node.getComment(Json::CommentPlacement::commentAfterOnSameLine), "|");
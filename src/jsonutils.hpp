@@ -26,7 +26,7 @@ public:
     static glm::vec3   getOptionalVec3_255(const Json::Value& node, std::string key, glm::vec3 def);
 
     static void prepareNodeMetadata(Json::Value& node, bool recursive=1);
-    static void markNodeUsed(Json::Value& node);
+    static void markNodeUsed(Json::Value& node, bool recursive=0);
     static void markNodeUnused(Json::Value& node);
     static bool getNodeUsed(const Json::Value& node);
     // Note: Semantic name may not contain a | character
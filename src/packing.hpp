@@ -0,0 +1,103 @@
+#ifndef __PACKING_HPP__
+#define __PACKING_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+#include "glm.hpp"
+
+// Compact encodings of vertex attributes, see Scene::SetCompressAttributes.
+class Packing{
+public:
+    // Octahedral encoding of a direction into two 16-bit snorms. The direction is projected onto the octahedron
+    // |x|+|y|+|z| = 1, whose lower half is folded over the upper one, and the x, y coordinates of the result are
+    // stored. The length is not kept. Zero and NaN vectors, which some models have, get codes of their own (x = -1,
+    // which the encoding never produces), so that they are decoded as they were.
+    static uint32_t EncodeOctahedral(glm::vec3 n){
+        if(std::isnan(n.x) || std::isnan(n.y) || std::isnan(n.z)) return oct_nan;
+        float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        if(!(l1 > 0.0f)) return oct_zero;
+        float x = n.x / l1, y = n.y / l1;
+        if(n.z < 0.0f){
+            float t = x;
+            x = (1.0f - std::abs(y)) * SignNotZero(t);
+            y = (1.0f - std::abs(t)) * SignNotZero(y);
+        }
+        return (uint32_t)(uint16_t)ToSnorm16(x) | ((uint32_t)(uint16_t)ToSnorm16(y) << 16);
+    }
+    static glm::vec3 DecodeOctahedral(uint32_t p){
+        int16_t ix = (int16_t)(p & 0xffff), iy = (int16_t)(p >> 16);
+        if(ix == -32768) return iy == -32768 ? glm::vec3(0.0f) : glm::vec3(std::numeric_limits<float>::quiet_NaN());
+        float x = ix / 32767.0f, y = iy / 32767.0f;
+        float z = 1.0f - std::abs(x) - std::abs(y);
+        if(z < 0.0f){
+            float t = x;
+            x = (1.0f - std::abs(y)) * SignNotZero(t);
+            y = (1.0f - std::abs(t)) * SignNotZero(y);
+        }
+        return glm::normalize(glm::vec3(x, y, z));
+    }
+
+    // Two IEEE 754 half floats. About 3 significant digits, so texture coordinates far from 0 (heavily tiled
+    // textures) lose precision.
+    static uint32_t EncodeHalf2(glm::vec2 v){
+        return (uint32_t)FloatToHalf(v.x) | ((uint32_t)FloatToHalf(v.y) << 16);
+    }
+    static glm::vec2 DecodeHalf2(uint32_t p){
+        return glm::vec2(HalfToFloat(p & 0xffff), HalfToFloat(p >> 16));
+    }
+
+    // Rounds to nearest even, overflows to infinity.
+    static uint16_t FloatToHalf(float f){
+        uint32_t x;
+        memcpy(&x, &f, sizeof(x));
+        uint32_t sign = (x >> 16) & 0x8000;
+        uint32_t exp = (x >> 23) & 0xff;
+        uint32_t mant = x & 0x7fffff;
+        // Infinity or NaN
+        if(exp == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+        int e = (int)exp - 127 + 15;
+        if(e >= 0x1f) return sign | 0x7c00;
+        uint32_t h, rem, half;
+        if(e <= 0){
+            // Subnormal half, or zero.
+            if(e < -10) return sign;
+            mant |= 0x800000;
+            uint32_t shift = 14 - e;
+            h = mant >> shift;
+            rem = mant & ((1u << shift) - 1);
+            half = 1u << (shift - 1);
+        }else{
+            h = ((uint32_t)e << 10) | (mant >> 13);
+            rem = mant & 0x1fff;
+            half = 0x1000;
+        }
+        // A carry out of the mantissa correctly increments the exponent.
+        if(rem > half || (rem == half && (h & 1))) h++;
+        return sign | h;
+    }
+    static float HalfToFloat(uint16_t h){
+        uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+        uint32_t exp = (h >> 10) & 0x1f;
+        uint32_t mant = h & 0x3ff;
+        if(exp == 0){
+            float f = mant * 5.9604644775390625e-8f; // 2^-24
+            return sign ? -f : f;
+        }
+        uint32_t x = (exp == 0x1f) ? sign | 0x7f800000 | (mant << 13)
+                                   : sign | ((exp + 112) << 23) | (mant << 13);
+        float f;
+        memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+
+private:
+    static const uint32_t oct_zero = 0x80008000u;
+    static const uint32_t oct_nan  = 0x00008000u;
+    static float SignNotZero(float x) {return x >= 0.0f ? 1.0f : -1.0f;}
+    static int16_t ToSnorm16(float x) {return (int16_t)std::round(glm::clamp(x, -1.0f, 1.0f) * 32767.0f);}
+};
+
+#endif // __PACKING_HPP__
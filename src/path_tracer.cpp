@@ -7,6 +7,7 @@
 #include "sampler.hpp"
 #include "bxdf/bxdf.hpp"
 #include "utils.hpp"
+#include "texture.hpp"
 
 #include <tuple>
 #include <iostream>
@@ -17,6 +18,17 @@
 #include <glm/gtx/rotate_vector.hpp>
 #include <glm/gtc/constants.hpp>
 
+namespace{
+
+// The power heuristic (Veach: "Robust Monte Carlo Methods for Light Transport Simulation", 1997) weight of a sample
+// drawn with density pdf, where another strategy would have drawn it with density other_pdf. pdf must be positive.
+inline float PowerHeuristic(float pdf, float other_pdf){
+    float r = other_pdf / pdf;
+    return 1.0f / (1.0f + r * r);
+}
+
+} // namespace
+
 PathTracer::PathTracer(const Scene& scene,
                        const Camera& camera,
                        unsigned int xres,
@@ -37,6 +49,13 @@ PathTracer::PathTracer(const Scene& scene,
   reverse(reverse),
   samplerSeed(samplerSeed)
 {
+    // GeneratePath adds at most one point per ray, and casts at most as many rays as the depth it is given.
+    camera_path.reserve(depth);
+    light_path.reserve(reverse);
+    shadow_queries.reserve(reverse);
+    // Rays through more thinglass than reserved for grow the buffers, once per tracer.
+    thinglass_query.reserve(THINGLASS_PER_RAY);
+    path_thinglass.reserve((depth + reverse) * THINGLASS_PER_RAY);
 }
 
 PixelRenderResult PathTracer::RenderPixel(int x, int y, unsigned int & raycount, bool debug){
@@ -50,24 +69,38 @@ PixelRenderResult PathTracer::RenderPixel(int x, int y, unsigned int & raycount,
     //VanDerCoruptSampler sampler(samplerSeed, 64, multisample);
     //HaltonSampler sampler(samplerSeed, 64, multisample);
 
+    auto camera_ray = [&](){
+        glm::vec2 coords = sampler.Get2D();
+        return camera.IsSimple() ?
+            camera.GetPixelRay(x, y, xres, yres, coords) :
+            camera.GetPixelRayLens(x, y, xres, yres, coords, sampler.Get2D());
+    };
+
+    // Camera rays of a pixel are very coherent, so their first hits are found all at once, with packet
+    // traversal. The sampler is then rewound, so that each path still uses the same sample set as its camera
+    // ray. Thinglass requires the single-ray query, which gathers thinglass triangles along the ray.
+    bool stream = scene.thinglass.size() == 0;
+    if(stream){
+        camera_rays.resize(multisample);
+        camera_hits.resize(multisample);
+        for(unsigned int i = 0; i < multisample; i++){
+            sampler.Advance();
+            camera_rays[i] = camera_ray();
+        }
+        sampler.Rewind();
+        scene.IntersectStream(camera_rays.data(), camera_hits.data(), multisample);
+    }
+
     for(unsigned int i = 0; i < multisample; i++){
 
         sampler.Advance();
         IFDEBUG std::cout << "[SAMPLER] Advaincing sampler" << std::endl;
 
-        glm::vec2 coords = sampler.Get2D();
-        Ray r = camera.IsSimple() ?
-            camera.GetPixelRay(x, y, xres, yres, coords) :
-            camera.GetPixelRayLens(x, y, xres, yres, coords, sampler.Get2D());
+        Ray r = camera_ray();
 
-        PixelRenderResult q = TracePath(r, raycount, sampler, debug);
+        PixelRenderResult q = TracePath(r, raycount, sampler, stream ? &camera_hits[i] : nullptr, debug);
         total.main_pixel += q.main_pixel;
-
-        for(const auto& p : q.side_effects){
-            total.side_effects.push_back(p);
-        }
-
-        IFDEBUG std::cout << "Side effects: " << q.side_effects.size() << std::endl;
+        total.moment2 += q.main_pixel.luminance() * q.main_pixel.luminance();
 
         IFDEBUG std::cout << "[SAMPLER] Samples used for this ray: " << sampler.GetUsage().first + sampler.GetUsage().second << std::endl;
     }
@@ -78,10 +111,22 @@ PixelRenderResult PathTracer::RenderPixel(int x, int y, unsigned int & raycount,
 }
 
 
-Radiance PathTracer::ApplyThinglass(Radiance input, const ThinglassIsections& isections, glm::vec3 ray_direction) const {
+float PathTracer::SampledLightWeight(const PathPoint& from, float light_pdf, bool debug) const{
+    if(light_pdf <= 0.0f) return 1.0f;
+    float bxdf_pdf = from.mat->bxdf->pdf(from.transform.toLocal(from.Vr),
+                                         from.transform.toLocal(from.Vi),
+                                         from.texUV,
+                                         debug);
+    // Specular bounces are only found this way.
+    if(bxdf_pdf <= 0.0f) return 1.0f;
+    return PowerHeuristic(bxdf_pdf, light_pdf);
+}
+
+Radiance PathTracer::ApplyThinglass(Radiance input, const PathPoint& p, glm::vec3 ray_direction) const {
     Radiance result = input;
+    const auto* isections = path_thinglass.data() + p.thinglass_begin;
     float ct = -1.0f;
-    for(int n = isections.size()-1; n >= 0; n--){
+    for(int n = p.thinglass_n-1; n >= 0; n--){
         const Triangle* trig = std::get<0>(isections[n]);
         // Ignore repeated triangles within epsillon radius from
         // previous thinglass - they are probably clones of the same
@@ -99,7 +144,7 @@ Radiance PathTracer::ApplyThinglass(Radiance input, const ThinglassIsections& is
 
             // TODO: This is obsolete, use better BxDF instead
             /*
-            Color c = trig->GetMaterial().diffuse->Get(glm::vec2(0.0, 0.0));
+            Color c = scene.GetMaterial(scene.GetTriangleIndex(trig)).diffuse->Get(glm::vec2(0.0, 0.0));
             result = result * Spectrum(c);
             */
         }
@@ -107,9 +152,9 @@ Radiance PathTracer::ApplyThinglass(Radiance input, const ThinglassIsections& is
     return result;
 }
 
-std::vector<PathTracer::PathPoint> PathTracer::GeneratePath(Ray r, unsigned int& raycount, unsigned int depth__, float russian__, Sampler& sampler, bool debug) const {
+void PathTracer::GeneratePath(std::vector<PathPoint>& path, Ray r, unsigned int& raycount, unsigned int depth__, float russian__, Sampler& sampler, const Intersection* first_hit, bool debug) {
 
-    std::vector<PathPoint> path;
+    path.clear();
 
     IFDEBUG std::cout << "Ray origin: " << r.origin << std::endl;
     IFDEBUG std::cout << "Ray direction: " << r.direction << std::endl;
@@ -119,21 +164,29 @@ std::vector<PathTracer::PathPoint> PathTracer::GeneratePath(Ray r, unsigned int&
     Ray current_ray = r;
     unsigned int n = 0;
     const Triangle* last_triangle = nullptr;
+    const Instance* last_instance = nullptr;
     while(n < depth__){
         n++;
         IFDEBUG std::cout << "Generating path, n = " << n << std::endl;
 
         raycount++;
         Intersection i;
-        if(scene.thinglass.size() == 0){
+        if(n == 1 && first_hit){
+            // Already found by the caller.
+            i = *first_hit;
+        }else if(scene.thinglass.size() == 0){
             // This variant is a bit faster.
-            i = scene.FindIntersectKdOtherThan(current_ray, last_triangle);
+            i = scene.FindIntersectKdOtherThan(current_ray, last_triangle, last_instance);
         }else{
-            i = scene.FindIntersectKdOtherThanWithThinglass(current_ray, last_triangle);
+            i = scene.FindIntersectKdOtherThanWithThinglass(current_ray, last_triangle, thinglass_query, last_instance);
         }
         PathPoint p;
         p.contribution = cumulative_transfer_coefficients;
-        p.thinglass_isect = i.thinglass;
+        if(i.thinglass){
+            p.thinglass_begin = path_thinglass.size();
+            p.thinglass_n = i.thinglass->size();
+            path_thinglass.insert(path_thinglass.end(), i.thinglass->begin(), i.thinglass->end());
+        }
         if(!i.triangle){
             // A sky ray!
             IFDEBUG std::cout << "Sky ray!" << std::endl;
@@ -147,33 +200,37 @@ std::vector<PathTracer::PathPoint> PathTracer::GeneratePath(Ray r, unsigned int&
             if(i.triangle == last_triangle){
                 // std::cerr << "Ray collided with source triangle. This should never happen." << std::endl;
             }
+            unsigned int tri = scene.GetTriangleIndex(i.triangle);
             // Prepare normal
             assert(NEAR(glm::length(current_ray.direction),1.0f));
             p.pos = current_ray[i.t];
-            p.faceN = i.Interpolate(i.triangle->GetNormalA(),
-                                    i.triangle->GetNormalB(),
-                                    i.triangle->GetNormalC());
+            p.triangle = tri;
+            p.faceN = i.Interpolate(scene.GetNormalA(tri),
+                                    scene.GetNormalB(tri),
+                                    scene.GetNormalC(tri));
 
             if(std::isnan(p.faceN.x)){
                 // Ah crap. Assimp incorrectly merged some vertices.
                 // Just try another normal.
-                p.faceN = i.triangle->GetNormalA();
+                p.faceN = scene.GetNormalA(tri);
                 if(std::isnan(p.faceN.x)){
-                    p.faceN = i.triangle->GetNormalB();
+                    p.faceN = scene.GetNormalB(tri);
                     if(std::isnan(p.faceN.x)){
-                        p.faceN = i.triangle->GetNormalC();
+                        p.faceN = scene.GetNormalC(tri);
                         if(std::isnan(p.faceN.x)){
                             // All three vertices are messed up? Not much we can help now. Let's just ignore this ray.
-                            return path;
+                            return;
                         }
                     }
                 }
             }
+            // Instanced triangles are in object space.
+            if(i.instance) p.faceN = i.instance->normal_to_world * p.faceN;
             // Sometimes it may happen, when interpolating between reverse vectors,
             // the the the result is 0. Or worse: some models contain zero-length normal vectors!
             // In such unfortunate case, just igore this ray.
             if(glm::length(p.faceN) <= 0.0f){
-                return path;
+                return;
             }
 
             p.faceN = glm::normalize(p.faceN);
@@ -184,15 +241,15 @@ std::vector<PathTracer::PathPoint> PathTracer::GeneratePath(Ray r, unsigned int&
             // Invert normal in case this ray would enter from inside
             // if(glm::dot(p.faceN, p.Vr) <= 0.0f) p.faceN = -p.faceN;
 
-            const Material& mat = i.triangle->GetMaterial();
+            const Material& mat = scene.GetMaterial(tri);
             p.mat = &mat;
 
             assert(!std::isnan(p.faceN.x));
 
             // Interpolate textures
-            glm::vec2 a = i.triangle->GetTexCoordsA();
-            glm::vec2 b = i.triangle->GetTexCoordsB();
-            glm::vec2 c = i.triangle->GetTexCoordsC();
+            glm::vec2 a = scene.GetTexCoordsA(tri);
+            glm::vec2 b = scene.GetTexCoordsB(tri);
+            glm::vec2 c = scene.GetTexCoordsC(tri);
             p.texUV = i.Interpolate(a,b,c);
             IFDEBUG std::cout << "texUV = " << p.texUV << std::endl;
 
@@ -204,9 +261,10 @@ std::vector<PathTracer::PathPoint> PathTracer::GeneratePath(Ray r, unsigned int&
             if(!mat.bumpmap->Empty()){
                 float right = mat.bumpmap->GetSlopeRight(p.texUV);
                 float bottom = mat.bumpmap->GetSlopeBottom(p.texUV);
-                glm::vec3 tangent = i.Interpolate(i.triangle->GetTangentA(),
-                                                  i.triangle->GetTangentB(),
-                                                  i.triangle->GetTangentC());
+                glm::vec3 tangent = i.Interpolate(scene.GetTangentA(tri),
+                                                  scene.GetTangentB(tri),
+                                                  scene.GetTangentC(tri));
+                if(i.instance) tangent = glm::mat3(i.instance->to_world) * tangent;
                 if(tangent.x*tangent.x + tangent.y*tangent.y + tangent.z*tangent.z < 0.001f){
                     // Well, so apparently, sometimes assimp generates invalid tangents. They seem okay
                     // on their own, but they interpolate weird, because tangents at two coincident vertices
@@ -278,8 +336,8 @@ std::vector<PathTracer::PathPoint> PathTracer::GeneratePath(Ray r, unsigned int&
                 break;
             }
 
-            // Russian roulette path termination
-            if(!mat.no_russian && russian__ >= 0.0f && sampler.Get1D() > russian__){
+            // Russian roulette path termination. Not at the first point, whose russian_coefficient is 1.
+            if(!mat.no_russian && russian__ >= 0.0f && n > 1 && sampler.Get1D() > russian__){
                 IFDEBUG std::cout << "Russian terminating." << std::endl;
                 break;
             }
@@ -298,14 +356,13 @@ std::vector<PathTracer::PathPoint> PathTracer::GeneratePath(Ray r, unsigned int&
             IFDEBUG std::cout << "Next ray will be from " << p. pos << " dir " << dir << std::endl;
 
             last_triangle = i.triangle;
+            last_instance = i.instance;
             // Continue for next ray
         }
     }
-
-    return path;
 }
 
-PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sampler& sampler, bool debug){
+PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sampler& sampler, const Intersection* first_hit, bool debug){
     PixelRenderResult result;
 
     glm::vec3 camerapos = r.origin;
@@ -318,23 +375,19 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
 
     glm::vec2 lightdir_sample = sampler.Get2D();
 
-    std::vector<Light> lights;
-    lights.push_back(scene.GetRandomLight(sampler.Get2D(), sampler.Get1D(), areal_sample, debug));
+    glm::vec2 main_choice_sample = sampler.Get2D();
+    glm::vec2 main_light_sample = sampler.Get2D();
+    Light main_light = scene.GetRandomLight(main_choice_sample, main_light_sample, areal_sample, debug);
+
+    path_thinglass.clear();
 
     // ===== 1st Phase =======
     // Generate a forward path.
     IFDEBUG std::cout << "== FORWARD PATH" << std::endl;
-    std::vector<PathPoint> path = GeneratePath(r, raycount, depth, russian, sampler, debug);
-
-    // Choose auxiculary light sources
-    /*
-    const int AUX_LIGHTS = 4;
-    for(unsigned int i = 0; i < AUX_LIGHTS; i++)
-        lights.push_back(scene.GetRandomLight(rnd));
-    */
+    std::vector<PathPoint>& path = camera_path;
+    GeneratePath(path, r, raycount, depth, russian, sampler, first_hit, debug);
 
     // Generate backward path (from light)
-    Light& main_light = lights[0];
     glm::vec3 main_light_dir;
     if(main_light.type == Light::FULL_SPHERE){
         glm::vec3 dir = RandomUtils::Sample2DToSphereUniform(areal_sample);
@@ -345,8 +398,13 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
         main_light_dir = RandomUtils::Sample2DToHemisphereCosineDirected(lightdir_sample, main_light.normal);
     }
     IFDEBUG std::cout << "== LIGHT PATH" << std::endl;
-    Ray light_ray(main_light.pos + scene.epsilon * main_light.normal * 100.0f, main_light_dir);
-    std::vector<PathPoint> light_path = GeneratePath(light_ray, raycount, reverse, -1.0f, sampler, debug);
+    if(main_light.type == Light::DIRECTIONAL){
+        // The environment has no place in the scene to start a light path at.
+        light_path.clear();
+    }else{
+        Ray light_ray(main_light.pos + scene.epsilon * main_light.normal * 100.0f, main_light_dir);
+        GeneratePath(light_path, light_ray, raycount, reverse, -1.0f, sampler, nullptr, debug);
+    }
     IFDEBUG std::cout << "Light path size " << light_path.size() << std::endl;
 
     // ============== 2nd phase ==============
@@ -364,7 +422,14 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
 
     IFDEBUG std::cout << " === Carrying light along light path" << std::endl;
 
-    for(unsigned int n = 0; n < light_path.size(); n++){
+    // Connections of light path points with the camera are tested in one query from the camera, points at infinity
+    // are skipped.
+    shadow_queries.clear();
+    for(const PathPoint& p : light_path)
+        if(!p.infinity) shadow_queries.push_back(ShadowQuery{p.pos, true});
+    scene.OccludedFrom(camerapos, shadow_queries.data(), shadow_queries.size(), &camera_occlusion);
+
+    for(unsigned int n = 0, k = 0; n < light_path.size(); n++){
         PathPoint& p = light_path[n];
 
         Radiance light_here = p.contribution * light_at_path_start;
@@ -374,7 +439,7 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
         IFDEBUG std::cout << "At point " << n << ", light from path start reachin this point: " << light_here << std::endl;
 
         // Connect the point with camera and add as a side effect
-        if(!p.infinity && scene.Visibility(p.pos, camerapos)){
+        if(!p.infinity && !shadow_queries[k++].occluded){
             IFDEBUG std::cout << "Point " << p.pos << " is visible from camera." << std::endl;
             glm::vec3 direction = glm::normalize(p.pos - camerapos);
             Radiance q = light_here *
@@ -391,7 +456,7 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
                 bool in_view = camera.GetCoordsFromDirection( direction, x2, y2, debug);
                 if(in_view){
                     IFDEBUG std::cout << "In view at " << x2 << " " << y2 << ", radiance: " << q << std::endl;
-                    result.side_effects.push_back(std::make_tuple(x2, y2, q));
+                    splats->Splat(x2, y2, q);
                 }
             }
         }
@@ -408,10 +473,14 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
         const PathPoint& p = path[n];
         if(p.infinity){
             qassert_false(std::isnan(p.Vr.x));
-            Radiance sky_radiance = scene.GetSkyboxRay(p.Vr, debug);
+            // The radiance lookup needs exact coordinates anyway, the light pdf reuses them.
+            glm::vec2 sky_coords = scene.GetSkyboxCoords(p.Vr);
+            Radiance sky_radiance = scene.GetSkyboxRadiance(sky_coords);
+            // The environment light sampled at the previous point may have come from the same direction.
+            if(n > 0) sky_radiance *= Spectrum(SampledLightWeight(path[n-1], scene.GetEnvironmentPdf(sky_coords), debug));
             IFDEBUG std::cout << "This a sky ray, total: " << sky_radiance << std::endl;
             IFDEBUG std::cout << "contribution: " << p.contribution << std::endl;
-            path_total += p.contribution * ApplyThinglass(sky_radiance, p.thinglass_isect, -p.Vr);
+            path_total += p.contribution * ApplyThinglass(sky_radiance, p, -p.Vr);
             continue;
         }
 
@@ -424,17 +493,29 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
         // ==========
         // Direct lighting
 
-        const Light& light = main_light;
+        // With a light tree, each point chooses the light that is likely to illuminate it the most. The environment
+        // is not in the tree, so when it is the main light, it stays the light of all points.
+        Light light = main_light;
+        bool light_chosen = true;
+        if(scene.HasLightTree() && main_light.type != Light::DIRECTIONAL){
+            float choice_sample = sampler.Get1D();
+            glm::vec2 triangle_sample = sampler.Get2D();
+            light_chosen = scene.SampleLightTree(p.pos, p.lightN, choice_sample, triangle_sample, light);
+            glm::vec2 sphere_sample = sampler.Get2D();
+            if(light.type == Light::FULL_SPHERE)
+                light.pos += light.size * RandomUtils::Sample2DToSphereUniform(sphere_sample);
+        }
+
+        // A directional light is tested for visibility from a point outside the scene, in its direction.
+        glm::vec3 light_pos = (light.type == Light::DIRECTIONAL) ? p.pos - light.normal * light.size : light.pos;
 
-        ThinglassIsections thinglass_isect;
         // Visibility factor
-        if((scene.thinglass.size() == 0 && scene.Visibility(light.pos, p.pos)) ||
-           (scene.thinglass.size() != 0 && scene.VisibilityWithThinglass(light.pos, p.pos, thinglass_isect))){
+        if(light_chosen && !scene.Occluded(light_pos, p.pos, &light_occlusion, !scene.thinglass.empty())){
 
             IFDEBUG std::cout << "====> Light is visible" << std::endl;
 
             // Incoming direction
-            glm::vec3 Vi = glm::normalize(light.pos - p.pos);
+            glm::vec3 Vi = glm::normalize(light_pos - p.pos);
 
             Spectrum f = mat.bxdf->value(p.transform.toLocal(Vi),
                                          p.transform.toLocal(p.Vr),
@@ -443,16 +524,29 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
 
             IFDEBUG std::cout << "f = " << f << std::endl;
 
-            float G = glm::abs(glm::dot(p.lightN, Vi)) / glm::distance2(light.pos, p.pos);
+            float G = glm::abs(glm::dot(p.lightN, Vi));
+            // Directional light does not fall off with distance.
+            if(light.type != Light::DIRECTIONAL) G /= glm::distance2(light.pos, p.pos);
             IFDEBUG std::cout << "G = " << G << ", angle " << glm::angle(p.lightN, Vi) << std::endl;
             Radiance inc_l = Radiance(light.color) * Spectrum( light.intensity *
                                                                light.GetDirectionalFactor(-Vi)
                                                                );
-            inc_l = ApplyThinglass(inc_l, thinglass_isect, Vi);
-
             IFDEBUG std::cout << "incoming light with filters: " << inc_l << std::endl;
 
-            Radiance out = inc_l * ( f * G );
+            // Following sample() may find the same light, unless it is a point light. Both ways are weighted.
+            float weight = 1.0f;
+            if(light.pdf > 0.0f){
+                float light_pdf = light.pdf;
+                if(light.type != Light::DIRECTIONAL)
+                    light_pdf *= glm::distance2(light.pos, p.pos) / glm::abs(glm::dot(light.normal, Vi));
+                weight = PowerHeuristic(light_pdf, mat.bxdf->pdf(p.transform.toLocal(p.Vr),
+                                                                 p.transform.toLocal(Vi),
+                                                                 p.texUV,
+                                                                 debug));
+            }
+            IFDEBUG std::cout << "light sample weight: " << weight << std::endl;
+
+            Radiance out = inc_l * ( f * G * weight );
             IFDEBUG std::cout << "total direct lighting: " << out << std::endl;
             total_here += out;
         }else{
@@ -460,10 +554,14 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
         }
 
         // Reverse light
-        for(unsigned int q = 0; q < light_path.size(); q++){
+        shadow_queries.clear();
+        for(const PathPoint& l : light_path)
+            if(!l.infinity) shadow_queries.push_back(ShadowQuery{l.pos, true});
+        // TODO: Thinglass?
+        scene.OccludedFrom(p.pos, shadow_queries.data(), shadow_queries.size(), &reverse_occlusion);
+        for(unsigned int q = 0, k = 0; q < light_path.size(); q++){
             const PathPoint& l = light_path[q];
-            // TODO: Thinglass?
-            if(!l.infinity && scene.Visibility(l.pos, p.pos)){
+            if(!l.infinity && !shadow_queries[k++].occluded){
                 glm::vec3 light_to_p = glm::normalize(p.pos - l.pos);
                 glm::vec3 p_to_light = -light_to_p;
                 Spectrum f_light = l.mat->bxdf->value(l.transform.toLocal(light_to_p),
@@ -483,7 +581,15 @@ PixelRenderResult PathTracer::TracePath(const Ray& r, unsigned int& raycount, Sa
 
 
         if(glm::dot(p.faceN, p.Vr) > 0){
-            total_here += p.emission; /* * glm::dot(p.lightN, p.Vr); */
+            Radiance emission = p.emission; /* * glm::dot(p.lightN, p.Vr); */
+            // Light sampling at the previous point may have chosen this point too.
+            if(n > 0 && emission.isNonZero()){
+                const PathPoint& prev = path[n-1];
+                float light_pdf = scene.GetLightPdf(p.triangle, prev.pos, prev.lightN) *
+                                  glm::distance2(prev.pos, p.pos) / glm::dot(p.faceN, p.Vr);
+                emission *= Spectrum(SampledLightWeight(prev, light_pdf, debug));
+            }
+            total_here += emission;
         }
 
 
@@ -3,6 +3,10 @@
 
 #include "tracer.hpp"
 #include "primitives.hpp"
+
+// Thinglass intersections per ray that a tracer reserves its buffers for.
+#define THINGLASS_PER_RAY 8
+
 class Sampler;
 
 class PathTracer : public Tracer{
@@ -24,12 +28,15 @@ protected:
     PixelRenderResult RenderPixel(int x, int y, unsigned int & raycount, bool debug = false) override;
 
 private:
-    PixelRenderResult TracePath(const Ray& r, unsigned int& raycount, Sampler& sampler, bool debug = false);
+    // If first_hit is given, it is used as the nearest intersection of r, instead of searching for it.
+    PixelRenderResult TracePath(const Ray& r, unsigned int& raycount, Sampler& sampler, const Intersection* first_hit = nullptr, bool debug = false);
 
     struct PathPoint{
         bool infinity = false;
         // Point position
         glm::vec3 pos;
+        // The triangle hit, see Scene::GetTriangleIndex
+        unsigned int triangle;
         // Normal vectors
         glm::vec3 lightN;
         glm::vec3 faceN;
@@ -42,8 +49,8 @@ private:
         const Material* mat;
         glm::vec2 texUV;
         Radiance emission;
-        // Thinglass encountered on the way of the ray that generated this point
-        ThinglassIsections thinglass_isect;
+        // Thinglass encountered on the way of the ray that generated this point, a range in path_thinglass
+        unsigned int thinglass_begin = 0, thinglass_n = 0;
         // Currection for rusian roulette
         float russian_coefficient;
         // These take into account sampling, BRDF, color. Symmetric in both directions.
@@ -58,9 +65,14 @@ private:
         bool backside = false;
     };
 
-    std::vector<PathPoint> GeneratePath(Ray direction, unsigned int& raycount, unsigned int depth__, float russian__, Sampler& sampler, bool debug = false) const;
+    // Replaces the contents of path. Appends thinglass encountered on the way to path_thinglass.
+    void GeneratePath(std::vector<PathPoint>& path, Ray direction, unsigned int& raycount, unsigned int depth__, float russian__, Sampler& sampler, const Intersection* first_hit = nullptr, bool debug = false);
 
-    Radiance ApplyThinglass(Radiance input, const ThinglassIsections& isections, glm::vec3 ray_direction) const;
+    Radiance ApplyThinglass(Radiance input, const PathPoint& p, glm::vec3 ray_direction) const;
+
+    // The weight of light that the path found by following sample() at from, where light sampling at from would have
+    // chosen the same direction with density light_pdf (per solid angle, zero if it never would).
+    float SampledLightWeight(const PathPoint& from, float light_pdf, bool debug) const;
 
     //Radiance sky_radiance;
     float clamp;
@@ -69,6 +81,18 @@ private:
     bool force_fresnell;
     unsigned int reverse;
     mutable unsigned int samplerSeed;
+
+    // Scratch space for intersecting camera rays of a pixel together.
+    std::vector<Ray> camera_rays;
+    std::vector<Intersection> camera_hits;
+    // Shadow ray state. This tracer is only ever used by a single thread. Each kind of connection keeps its own
+    // occluder cache, as their rays go to different places.
+    OcclusionCache camera_occlusion, light_occlusion, reverse_occlusion;
+    std::vector<ShadowQuery> shadow_queries;
+    // Paths of the current sample, reserved for the longest paths allowed, so that tracing does not allocate.
+    std::vector<PathPoint> camera_path, light_path;
+    // Thinglass encountered by both paths of the current sample, and the buffer a single query gathers it into.
+    ThinglassIsections path_thinglass, thinglass_query;
 };
 
 #endif // __PATH_TRACER_HPP__
@@ -2,6 +2,7 @@
 #define __PRIMITITES_HPP__
 
 #include <functional>
+#include <string>
 
 #include "glm.hpp"
 
@@ -27,6 +28,8 @@ struct Light{
     enum Type{
         FULL_SPHERE,
         HEMISPHERE,
+        // Light from a single direction of the environment, arriving at every point of the scene. pos is unused.
+        DIRECTIONAL,
     };
     Light(Type t) : type(t) {}
     Type type;
@@ -34,15 +37,33 @@ struct Light{
     Radiance color;
     float intensity;
     // TODO: union?
-    float size; // Only for full_sphere lights
-    glm::vec3 normal; // Only for hemisphere lights
+    float size; // For full_sphere lights. For directional lights, a distance that leaves the scene from any point.
+    glm::vec3 normal; // For hemisphere lights. For directional lights, the direction the light travels.
+    // The probability density of a light sample choosing this point (per area), or this direction (per solid angle,
+    // for directional lights). Zero for lights that rays cannot hit, which only light sampling finds.
+    float pdf = 0.0f;
     float GetDirectionalFactor(glm::vec3 v) const{
-        if(type == FULL_SPHERE) return 1.0f;
+        if(type != HEMISPHERE) return 1.0f;
         else return glm::max(0.0f, glm::dot(v,normal));
     }
 };
 
 class Material;
+
+// Material properties read from a model file. Holds no assimp types, so that it can be stored in a scene cache
+// and turned into a Material later.
+struct ImportedMaterial{
+    std::string name;
+    Color diffuse;
+    Color specular;
+    Radiance emission;
+    // Full paths, or empty if the material has no such texture.
+    std::string diffuse_texture;
+    std::string specular_texture;
+    std::string bump_texture;
+    float shininess = 0.0f;
+};
+
 /*
 struct Material{
     Material();
@@ -62,52 +83,104 @@ struct Material{
 };
 */
 
+// A ray, prepared for watertight triangle tests (Woop, Benthin, Wald: "Watertight Ray/Triangle Intersection", 2013).
+// The axis along which the direction is largest becomes z, and vertices are sheared so that the ray runs along it,
+// through the origin. A triangle is then hit if the origin lies in its projection onto the xy plane. The edge
+// functions deciding that give exactly opposite results for the two triangles sharing an edge, so that no ray passes
+// between them.
+struct RayShear{
+    RayShear(const Ray& r){
+        glm::vec3 d = glm::abs(r.direction);
+        kz = (d.x > d.y) ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        sx = r.direction[kx] / r.direction[kz];
+        sy = r.direction[ky] / r.direction[kz];
+        sz = 1.0f / r.direction[kz];
+    }
+    int kx, ky, kz;
+    float sx, sy, sz;
+};
+
+// The part of a triangle that ray intersection reads. Its vertex indices also index normals, tangents and texture
+// coordinates. These, and the triangle's material, are only needed for shading, so Scene keeps them apart, in arrays
+// indexed by the triangle's position in Scene::triangles (see Scene::GetMaterial).
 class Triangle{
 public:
-    const Scene* parent_scene;
     unsigned int va, vb, vc; // Vertex and normal indices
-    Material* mat; // Material pointer
     glm::vec4 p; // plane
     inline glm::vec3 generic_normal() const {return p.xyz();}
-    void CalculatePlane() __attribute__((hot));
-    float GetArea() const;
-    glm::vec3 GetRandomPoint(glm::vec2 sample) const;
-
-    Triangle(const Scene* parent, unsigned int va, unsigned int vb, unsigned int vc, Material* mat) :
-        parent_scene(parent), va(va), vb(vb), vc(vc), mat(mat) {}
-    Triangle() : parent_scene(nullptr) {}
-
-    const Material& GetMaterial() const;
-    const glm::vec3 GetVertexA()  const;
-    const glm::vec3 GetVertexB()  const;
-    const glm::vec3 GetVertexC()  const;
-    const glm::vec3 GetNormalA()  const;
-    const glm::vec3 GetNormalB()  const;
-    const glm::vec3 GetNormalC()  const;
-    const glm::vec2 GetTexCoordsA()  const;
-    const glm::vec2 GetTexCoordsB()  const;
-    const glm::vec2 GetTexCoordsC()  const;
-    const glm::vec3 GetTangentA()  const;
-    const glm::vec3 GetTangentB()  const;
-    const glm::vec3 GetTangentC()  const;
-
-    bool TestIntersection(const Ray& r, /*out*/ float& t, float& a, float& b, bool debug = false) const __attribute__((hot));
+    void CalculatePlane(const glm::vec3* vertices) __attribute__((hot));
+
+    Triangle(unsigned int va, unsigned int vb, unsigned int vc) : va(va), vb(vb), vc(vc) {}
+    Triangle() {}
+
+    // Watertight, see RayShear. a and b are the barycentric coordinates of vertices B and C. t is not limited to the
+    // ray's range, callers check it.
+    bool TestIntersection(const Ray& r, const RayShear& s, const glm::vec3* vertices,
+                          /*out*/ float& t, float& a, float& b) const __attribute__((hot));
 };
 
+// A placement of an instanced mesh (see Scene::BeginMesh). Mesh triangles are in object space, rays are transformed
+// into it without normalizing their direction, so that distances along them stay the same as in world space.
+struct Instance{
+    glm::mat4 to_world;
+    glm::mat4 to_object;
+    // Transforms object space normals to world space.
+    glm::mat3 normal_to_world;
+    unsigned int mesh;
+
+    Ray ToObject(const Ray& r) const{
+        Ray o;
+        o.origin = (to_object * glm::vec4(r.origin, 1.0f)).xyz();
+        o.direction = glm::mat3(to_object) * r.direction;
+        o.near = r.near;
+        o.far = r.far;
+        return o;
+    }
+};
+
+// An ordered list of intersections with materials that are considered to be a thin glass.
+// The first element of pair is the triangle intersecting. The second is the distance from ray origin
+// to the intersection. The second parameter is used because triangles may get cloned during kD-tree
+// construction, and we need to apply a filter just once.
 typedef std::vector<std::tuple<const Triangle*,float>> ThinglassIsections;
+// Plain data, so that the many queries of each path construct and copy it without touching the heap.
 struct Intersection{
     const Triangle* triangle = nullptr;
+    // The instance the triangle was hit in, or nullptr if it is not instanced. Instanced triangles are in object
+    // space, the instance transforms them to world space.
+    const Instance* instance = nullptr;
     float t;
     float a,b,c;
     template <typename T>
     T Interpolate(const T& x, const T& y, const T& z) {return a*x + b*y + c*z;}
-    // An ordered list of intersections with materials that are considered to be a thin glass.
-    // The first element of pair is the triangle intersecting. The second is the distance from ray origin
-    // to the intersection. The second parameter is used because triangles may get cloned during kD-tree
-    // construction, and we need to apply a filter just once.
-    ThinglassIsections thinglass;
+    // Where thinglass queries gather the thinglass intersections along the ray (see
+    // Scene::FindIntersectKdOtherThanWithThinglass). A buffer owned by the caller, so that it is reused across queries.
+    ThinglassIsections* thinglass = nullptr;
 };
 
+// Remembers the triangle that blocked the previous shadow ray. Shadow rays cast from nearby points tend to be blocked
+// by the same triangle, so it is tested before traversing the whole structure. Not thread-safe, each thread should
+// keep its own.
+struct OcclusionCache{
+    const Triangle* last_occluder = nullptr;
+    const Instance* last_instance = nullptr;
+};
+
+// A target point of a shadow ray query from a common point (see Scene::OccludedFrom), and the query's result.
+struct ShadowQuery{
+    glm::vec3 to;
+    bool occluded;
+};
+
+// The structure used by Scene to find ray intersections.
+enum class AccelStructure{
+    Kd,
+    Bvh,
+    // A BVH with up to SIMD_WIDTH children per node, collapsed from the binary one.
+    WideBvh,
+};
 
 typedef std::vector<std::tuple<glm::vec3, glm::vec3, glm::vec2, glm::vec3>> primitive_data;
 class Primitives{
@@ -46,6 +46,7 @@ struct Radiance{
     Radiance& operator+=(const Radiance& o) {*this = *this + o; return *this;}
     Radiance& operator-=(const Radiance& o) {*this = *this - o; return *this;}
     float max() const {return glm::max(glm::max(r,g),b);}
+    float luminance() const {return 0.2126f*r + 0.7152f*g + 0.0722f*b;}
     bool isNonZero() const {return r > 0 || g > 0 || b > 0;}
     void clamp(float v){
         if(r > v) r = v;
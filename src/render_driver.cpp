@@ -8,7 +8,7 @@
 #include <algorithm>
 #include <unistd.h>
 
-#include "../external/ctpl_stl.h"
+#include <condition_variable>
 
 #include "path_tracer.hpp"
 #include "utils.hpp"
@@ -21,6 +21,7 @@ std::atomic<bool> RenderDriver::stop_monitor(false);
 std::atomic<int> RenderDriver::rounds_done(0);
 std::atomic<int> RenderDriver::pixels_done(0);
 std::atomic<unsigned int> RenderDriver::rays_done(0);
+double RenderDriver::render_time = 0.0;
 void RenderDriver::ResetCounters(){
     rounds_done = 0;
     pixels_done = 0;
@@ -120,7 +121,7 @@ void RenderDriver::FrameMonitorThread(RenderLimitMode render_limit_mode,
     while(!stop_monitor){
         print_progress_f();
         //if(pixels_done >= total_pixels) break;
-        usleep(1000*100); // 50ms
+        usleep(1000*100); // 100ms
     }
 
     // Output the message one more time to display "100%"
@@ -141,24 +142,27 @@ void RenderDriver::FrameMonitorThread(RenderLimitMode render_limit_mode,
 // TODO: Seed generator should be a standalone object
 // TODO: Create a different 'lite config' struct, which will only
 // contain render parameters, ideal for passing here
-void RenderDriver::RenderRound(const Scene& scene,
+void RenderDriver::SubmitRound(const Scene& scene,
                                std::shared_ptr<Config> cfg,
                                const Camera& camera,
                                const std::vector<RenderTask>& tasks,
                                unsigned int& seedcount,
                                const int seedstart,
-                               unsigned int concurrency,
-                               EXRTexture& total_ob
+                               WorkPool& pool,
+                               EXRTexture& total_ob,
+                               std::mutex& total_ob_mx,
+                               SplatFilm* splats,
+                               std::function<void()> round_done
                                ){
 
-    ctpl::thread_pool tpool(concurrency);
+    // Tasks of this round that have not completed yet.
+    auto remaining = std::make_shared<std::atomic<unsigned int>>(tasks.size());
 
-    std::mutex total_ob_mx;
     // Push all render tasks to thread pool
     for(unsigned int i = 0; i < tasks.size(); i++){
         const RenderTask& task = tasks[i];
         unsigned int c = seedcount++;
-        tpool.push( [seedstart, camera, &scene, &cfg, task, c, &total_ob_mx, &total_ob](int){
+        pool.Push( [seedstart, camera, &scene, cfg, task, c, &total_ob_mx, &total_ob, splats, remaining, round_done](int){
 
                 // THIS is the thread task
                 PathTracer rt(scene, camera,
@@ -174,19 +178,62 @@ void RenderDriver::RenderRound(const Scene& scene,
                 out::cout(6) << "Starting a new task with params: " << std::endl;
                 out::cout(6) << "camerapos = " << camera.origin << ", multisample = " << cfg->multisample << ", reclvl = " << cfg->recursion_level << ", russian = " << cfg->russian << ", reverse = " << cfg->reverse << std::endl;
 
-                EXRTexture output_buffer(cfg->xres, cfg->yres);
-                rt.Render(task, &output_buffer, pixels_done, rays_done);
+                EXRTexture output_buffer(task.xrange_end - task.xrange_start, task.yrange_end - task.yrange_start,
+                                         task.xrange_start, task.yrange_start);
+                rt.Render(task, &output_buffer, splats, pixels_done, rays_done);
                 {
                     std::lock_guard<std::mutex> lk(total_ob_mx);
                     total_ob.Accumulate(output_buffer);
                 }
+
+                if(--(*remaining) == 0){
+                    rounds_done++;
+                    round_done();
+                }
             });
     }
+}
 
-    // Wait for all remaining worker threads to complete.
-    tpool.stop(true);
+std::vector<RenderTask> RenderDriver::SelectUnconverged(const std::vector<RenderTask>& tasks,
+                                                        const EXRTexture& total_ob,
+                                                        unsigned int xres, unsigned int yres,
+                                                        float threshold){
+    float floor = 0.1f * total_ob.GetMeanLuminance();
+    std::vector<float> error(xres * yres);
+    for(unsigned int y = 0; y < yres; y++)
+        for(unsigned int x = 0; x < xres; x++)
+            error[y*xres + x] = total_ob.GetRelativeError(x, y, floor);
+
+    // A pixel which has so far missed the rare bright paths has both a low mean and a low variance estimate, and
+    // stopping it would bias the image towards dark. Its neighbours are unlikely to have all missed them as well,
+    // so a pixel only stops once its whole 3x3 neighbourhood has converged.
+    auto converged = [&](int x, int y){
+        for(int dy = -1; dy <= 1; dy++)
+            for(int dx = -1; dx <= 1; dx++){
+                int nx = x + dx, ny = y + dy;
+                if(nx < 0 || ny < 0 || nx >= (int)xres || ny >= (int)yres) continue;
+                if(error[ny*xres + nx] > threshold) return false;
+            }
+        return true;
+    };
 
-    rounds_done++;
+    std::vector<RenderTask> result;
+    unsigned int skipped_pixels = 0;
+    for(const RenderTask& task : tasks){
+        RenderTask t = task;
+        unsigned int skipped = 0;
+        t.skip.clear();
+        for(unsigned int y = task.yrange_start; y < task.yrange_end; y++)
+            for(unsigned int x = task.xrange_start; x < task.xrange_end; x++){
+                bool c = converged(x, y);
+                t.skip.push_back(c);
+                skipped += c;
+            }
+        skipped_pixels += skipped;
+        if(skipped < t.skip.size()) result.push_back(std::move(t));
+    }
+    pixels_done += skipped_pixels;
+    return result;
 }
 
 void RenderDriver::RenderFrame(const Scene& scene,
@@ -198,8 +245,10 @@ void RenderDriver::RenderFrame(const Scene& scene,
 
     // Preapare output buffer
     EXRTexture total_ob(cfg->xres, cfg->yres);
-    total_ob.Write(output_file);
-    out::cout(2) << "Writing to file " << output_file << std::endl;
+    if(!output_file.empty()){
+        total_ob.Write(output_file);
+        out::cout(2) << "Writing to file " << output_file << std::endl;
+    }
 
     // Determine thread pool size.
     unsigned int concurrency = std::thread::hardware_concurrency();
@@ -221,32 +270,111 @@ void RenderDriver::RenderFrame(const Scene& scene,
 
     unsigned int seedcount = 0, seedstart = 42;
 
+    // The pool persists for the entire frame. The next round is submitted as soon as all tiles of the current one
+    // have been taken, so that workers never idle while the last tiles of a round finish.
+    WorkPool pool(concurrency);
+    std::mutex total_ob_mx;
+
+    // Only light tracing produces side effects. Workers add them to the film, and the writer thread drains it.
+    std::unique_ptr<SplatFilm> splats;
+    if(cfg->reverse > 0) splats.reset(new SplatFilm(cfg->xres, cfg->yres));
+    // Side effects drained so far. Owned by the writer thread.
+    EXRTexture total_splats(cfg->xres, cfg->yres);
+
+    // Progress is written out by a separate thread, whenever a round completes, so that workers do not wait for it.
+    std::mutex writer_mx;
+    std::condition_variable writer_cv;
+    bool write_requested = false, writer_stop = false;
+    std::thread writer_thread([&](){
+            std::unique_lock<std::mutex> lk(writer_mx);
+            while(true){
+                writer_cv.wait(lk, [&]{return write_requested || writer_stop;});
+                if(!write_requested) break;
+                write_requested = false;
+                lk.unlock();
+                if(splats) splats->DrainInto(total_splats);
+                EXRTexture snapshot;
+                {
+                    std::lock_guard<std::mutex> lk2(total_ob_mx);
+                    snapshot = EXRTexture(total_ob);
+                }
+                if(splats) snapshot.Accumulate(total_splats);
+                // Write out current progress to the output file.
+                snapshot.Normalize(cfg->output_scale).Write(output_file);
+                lk.lock();
+            }
+        });
+    auto request_write = [&](){
+        if(output_file.empty()) return;
+        {
+            std::lock_guard<std::mutex> lk(writer_mx);
+            write_requested = true;
+        }
+        writer_cv.notify_one();
+    };
+
+    // With adaptive sampling, once enough rounds were submitted, only pixels that have not converged are rendered.
+    // Estimates are taken from whatever has been accumulated when the round is submitted. They are copied out, so
+    // that workers are not kept from merging their tiles while pixels are selected.
+    auto round_tasks = [&](unsigned int roundno){
+        if(cfg->adaptive_threshold <= 0.0f || roundno < cfg->adaptive_min_rounds) return tasks;
+        EXRTexture snapshot;
+        {
+            std::lock_guard<std::mutex> lk(total_ob_mx);
+            snapshot = EXRTexture(total_ob);
+        }
+        return SelectUnconverged(tasks, snapshot, cfg->xres, cfg->yres, cfg->adaptive_threshold);
+    };
+
     // Measuring render time, both for timed mode, and monitor output
     frame_render_start = std::chrono::high_resolution_clock::now();
 
     switch(cfg->render_limit_mode){
     case RenderLimitMode::Rounds:
         for(unsigned int roundno = 0; roundno < cfg->render_rounds; roundno++){
-            // Render a single round
-            RenderRound(scene, cfg, camera, tasks, seedcount, seedstart, concurrency, total_ob);
-            // Write out current progress to the output file.
-            total_ob.Normalize(cfg->output_scale).Write(output_file);
+            pool.WaitDrained();
+            std::vector<RenderTask> rtasks = round_tasks(roundno);
+            if(rtasks.empty()){
+                // All pixels have converged, so have all remaining rounds.
+                unsigned int remaining = cfg->render_rounds - roundno;
+                pixels_done += (remaining - 1) * cfg->xres * cfg->yres;
+                rounds_done += remaining;
+                out::cout(3) << std::endl << "All pixels converged after " << roundno << " rounds." << std::endl;
+                break;
+            }
+            SubmitRound(scene, cfg, camera, rtasks, seedcount, seedstart, pool, total_ob, total_ob_mx, splats.get(),
+                        request_write);
         }
         break;
     case RenderLimitMode::Timed:
-        while(true){
+        for(unsigned int roundno = 0; ; roundno++){
+            pool.WaitDrained();
             // Break loop if too much time elapsed
             std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
             float minutes_elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - frame_render_start).count() / 60.0;
             if(minutes_elapsed >= cfg->render_minutes) break;
-            // Render a single round
-            RenderRound(scene, cfg, camera, tasks, seedcount, seedstart, concurrency, total_ob);
-            // Write out current progress to the output file.
-            total_ob.Normalize(cfg->output_scale).Write(output_file);
+            std::vector<RenderTask> rtasks = round_tasks(roundno);
+            if(rtasks.empty()){
+                out::cout(3) << std::endl << "All pixels converged after " << roundno << " rounds." << std::endl;
+                break;
+            }
+            SubmitRound(scene, cfg, camera, rtasks, seedcount, seedstart, pool, total_ob, total_ob_mx, splats.get(),
+                        request_write);
         }
         break;
     }
 
+    // Wait for all submitted rounds to complete. The last of them has requested a write, which the writer thread
+    // completes before stopping, collecting all remaining side effects.
+    pool.Wait();
+    render_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - frame_render_start).count();
+    {
+        std::lock_guard<std::mutex> lk(writer_mx);
+        writer_stop = true;
+    }
+    writer_cv.notify_one();
+    writer_thread.join();
+
     // Shutdown monitor thread.
     stop_monitor = true;
     if(monitor_thread.joinable()) monitor_thread.join();
@@ -3,32 +3,55 @@
 #include <atomic>
 #include <chrono>
 #include <set>
+#include <mutex>
+#include <functional>
+#include <memory>
 
 #include "tracer.hpp"
+#include "work_pool.hpp"
+#include "texture.hpp"
 
 class RenderDriver{
 public:
+    // Renders a frame into output_file. With an empty output_file, nothing is written.
     static void RenderFrame(const Scene& scene,
                             std::shared_ptr<Config> cfg,
                             const Camera& camera,
                             std::string output_file
                             );
+    // The number of rays cast while rendering the last frame.
+    static unsigned int GetRaysDone() {return rays_done;}
+    // The time spent rendering the rounds of the last frame, in seconds. Writing the image out and stopping the
+    // monitor thread are not included.
+    static double GetRenderTime() {return render_time;}
 private:
-
     static void FrameMonitorThread(RenderLimitMode render_limit_mode,
                                    unsigned int limit_rounds,
                                    unsigned int limit_minutes,
                                    unsigned int pixels_per_round);
-    static void RenderRound(const Scene& scene,
+    // Pushes all tasks of a single round to the pool, without waiting for them. Each task renders into a tile-sized
+    // buffer, merged into total_ob, and adds its side effects directly to splats (null if there are none). Once the last of them completes,
+    // rounds_done is incremented and round_done is called (from a worker thread).
+    static void SubmitRound(const Scene& scene,
                             std::shared_ptr<Config> cfg,
                             const Camera& camera,
                             const std::vector<RenderTask>& tasks,
                             unsigned int& seedcount,
                             const int seedstart,
-                            unsigned int concurrency,
-                            EXRTexture& total_ob
+                            WorkPool& pool,
+                            EXRTexture& total_ob,
+                            std::mutex& total_ob_mx,
+                            SplatFilm* splats,
+                            std::function<void()> round_done
                             );
 
+    // Adaptive sampling: returns the tasks that contain a pixel whose relative error is above threshold, set up to
+    // skip their other pixels. Skipped pixels are counted as done.
+    static std::vector<RenderTask> SelectUnconverged(const std::vector<RenderTask>& tasks,
+                                                     const EXRTexture& total_ob,
+                                                     unsigned int xres, unsigned int yres,
+                                                     float threshold);
+
     static std::chrono::high_resolution_clock::time_point frame_render_start;
     static std::atomic<bool> stop_monitor;
 
@@ -36,5 +59,6 @@ private:
     static std::atomic<int> rounds_done;
     static std::atomic<int> pixels_done;
     static std::atomic<unsigned int> rays_done;
+    static double render_time;
     static void ResetCounters();
 };
@@ -17,12 +17,20 @@ OfflineSampler::OfflineSampler(unsigned int seed, unsigned int dim, unsigned int
     // Cannot call PrepareSample from constructor as it is a virtual function!
 }
 void OfflineSampler::Advance(){
-    if(current_set == (unsigned int)-1) PrepareSamples();
+    if(!prepared){
+        PrepareSamples();
+        prepared = true;
+    }
     current_sample1D = 0;
     current_sample2D = 0;
     current_set++;
     qassert_true(current_set < set_size);
 }
+void OfflineSampler::Rewind(){
+    current_sample1D = 0;
+    current_sample2D = 0;
+    current_set = -1;
+}
 float OfflineSampler::Get1D(){
     return (current_sample1D < dim_count) ?
         samples1D[current_sample1D++][current_set] :
@@ -49,6 +49,8 @@ public:
     virtual std::pair<unsigned int, unsigned int> GetUsage() const override{
         return {current_sample1D,current_sample2D};
     }
+    // Goes back to before the first set, so that the same sets are produced again.
+    void Rewind();
 protected:
     std::vector<std::vector<float>> samples1D;
     std::vector<std::vector<glm::vec2>> samples2D;
@@ -57,6 +59,7 @@ protected:
     unsigned int current_sample1D;
     unsigned int current_sample2D;
     unsigned int current_set;
+    bool prepared = false;
     std::mt19937 gen;
 };
 
@@ -6,9 +6,18 @@
 #include <limits>
 #include <cmath>
 #include <stack>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <cstdlib>
+#include <new>
 
 #include <glm/gtx/wrap.hpp>
 
+#include "../external/ctpl_stl.h"
+
 #include "utils.hpp"
 #include "out.hpp"
 #include "global_config.hpp"
@@ -21,15 +30,36 @@ Scene::~Scene(){
     FreeTextures();
     FreeMaterials();
     FreeCompressedTree();
+    FreeCache();
 }
 
 void Scene::FreeBuffers(){
-    if(vertices) delete[] vertices;
+    // Arrays mapped from a scene cache are released together with the mapping.
+    if(!cache_mapping){
+        if(vertices) delete[] vertices;
+        if(triangles) delete[] triangles;
+        if(triangle_materials) delete[] triangle_materials;
+        if(normals) delete[] normals;
+        if(tangents) delete[] tangents;
+        if(texcoords) delete[] texcoords;
+        if(packed_normals) delete[] packed_normals;
+        if(packed_tangents) delete[] packed_tangents;
+        if(packed_texcoords) delete[] packed_texcoords;
+    }
+    vertices = nullptr;
     n_vertices = 0;
-    if(triangles) delete[] triangles;
+    triangles = nullptr;
     n_triangles = 0;
-    if(normals) delete[] normals;
+    triangle_materials = nullptr;
+    normals = nullptr;
     n_normals = 0;
+    tangents = nullptr;
+    n_tangents = 0;
+    texcoords = nullptr;
+    n_texcoords = 0;
+    packed_normals = nullptr;
+    packed_tangents = nullptr;
+    packed_texcoords = nullptr;
 
     if(uncompressed_root){
         uncompressed_root->FreeRecursivelly();
@@ -40,6 +70,8 @@ void Scene::FreeBuffers(){
 void Scene::FreeMaterials(){
     materials.clear();
     materials_by_name.clear();
+    material_table.clear();
+    material_ids.clear();
 }
 
 void Scene::FreeTextures(){
@@ -49,17 +81,40 @@ void Scene::FreeTextures(){
 }
 
 void Scene::FreeCompressedTree(){
-    if(compressed_triangles) delete[] compressed_triangles;
+    if(!cache_mapping){
+        if(compressed_triangles) delete[] compressed_triangles;
+        if(compressed_array) free(compressed_array);
+        if(compressed_blocks) free(compressed_blocks);
+        if(bvh_nodes) free(bvh_nodes);
+        if(wide_bvh_nodes) free(wide_bvh_nodes);
+        if(mesh_bvh_nodes) free(mesh_bvh_nodes);
+        if(instance_bvh_nodes) free(instance_bvh_nodes);
+        if(instance_indices) delete[] instance_indices;
+    }
+    compressed_triangles = nullptr;
     compressed_triangles_size = 0;
-    if(compressed_array) delete[] compressed_array;
+    compressed_array = nullptr;
     compressed_array_size = 0;
+    compressed_blocks = nullptr;
+    bvh_nodes = nullptr;
+    bvh_nodes_size = 0;
+    wide_bvh_nodes = nullptr;
+    wide_bvh_nodes_size = 0;
+    mesh_bvh_nodes = nullptr;
+    mesh_bvh_nodes_size = 0;
+    instance_bvh_nodes = nullptr;
+    instance_bvh_nodes_size = 0;
+    instance_indices = nullptr;
+    instance_indices_size = 0;
 }
 
 void Scene::LoadAiSceneMaterials(const aiScene* scene, std::string, std::string texture_directory, bool override_materials){
     // Load materials
     for(unsigned int i = 0; i < scene->mNumMaterials; i++){
+        imported_materials.push_back(std::make_pair(Material::ImportAiMaterial(scene->mMaterials[i], texture_directory),
+                                                    override_materials));
         auto m = std::make_shared<Material>();
-        m->LoadFromAiMaterial(scene->mMaterials[i], *this, texture_directory);
+        m->LoadFromImported(imported_materials.back().first, *this);
         RegisterMaterial(m, override_materials);
     }
 }
@@ -146,8 +201,14 @@ void Scene::LoadAiMesh(const aiScene* scene, const aiMesh* mesh, glm::mat4 curre
         material = GetMaterialByName(force_mat);
     }
 
+    uint16_t material_id = GetMaterialID(material);
     bool light_source = material->emission.isNonZero();
     ArealLight al;
+    // Lights of a mesh are registered for each of its instances.
+    if(light_source && building_mesh){
+        meshes.back().emissive = true;
+        light_source = false;
+    }
 
     for(unsigned int v = 0; v < mesh->mNumVertices; v++){
         glm::vec3 vertex(mesh->mVertices[v].x, mesh->mVertices[v].y, mesh->mVertices[v].z);
@@ -163,12 +224,11 @@ void Scene::LoadAiMesh(const aiScene* scene, const aiMesh* mesh, glm::mat4 curre
         const aiFace& face = mesh->mFaces[f];
         if(face.mNumIndices < 3) continue; // Ignore degenerated faces
         if(face.mNumIndices == 3){
-            Triangle t(this,
-                       face.mIndices[0] + vertex_index_offset,
+            Triangle t(face.mIndices[0] + vertex_index_offset,
                        face.mIndices[1] + vertex_index_offset,
-                       face.mIndices[2] + vertex_index_offset,
-                       material.get());
+                       face.mIndices[2] + vertex_index_offset);
             triangles_buffer.push_back(t);
+            triangle_materials_buffer.push_back(material_id);
             int n = triangles_buffer.size() - 1;
             if(light_source){
                 al.triangles_with_areas.push_back(std::make_pair(0.0f, n));
@@ -212,8 +272,13 @@ void Scene::AddPrimitive(const primitive_data& primitive, glm::mat4 transform, s
     out::cout(4) << "-- Adding a primitive with " << primitive.size()/3 << " faces." << std::endl;
     unsigned int vertex_index_offset = vertices_buffer.size();
     std::shared_ptr<Material> mat = GetMaterialByName(material);
+    uint16_t material_id = GetMaterialID(mat);
     bool light_source = mat->emission.isNonZero();
     ArealLight al;
+    if(light_source && building_mesh){
+        meshes.back().emissive = true;
+        light_source = false;
+    }
 
     for(unsigned int i = 0; i < primitive.size(); i++){
         glm::vec3 vertex, normal, tangent; glm::vec2 texcoords;
@@ -228,12 +293,11 @@ void Scene::AddPrimitive(const primitive_data& primitive, glm::mat4 transform, s
         texcoords_buffer.push_back(texcoords);
     }
     for(unsigned int i = 0; i < primitive.size()/3; i++){
-        Triangle t(this,
-                   vertex_index_offset + 0 + i*3,
+        Triangle t(vertex_index_offset + 0 + i*3,
                    vertex_index_offset + 1 + i*3,
-                   vertex_index_offset + 2 + i*3,
-                   mat.get());
+                   vertex_index_offset + 2 + i*3);
         triangles_buffer.push_back(t);
+        triangle_materials_buffer.push_back(material_id);
         int n = triangles_buffer.size() - 1;
         if(light_source){
             al.triangles_with_areas.push_back(std::make_pair(0.0f, n));
@@ -249,6 +313,72 @@ void Scene::AddPrimitive(const primitive_data& primitive, glm::mat4 transform, s
     }
 }
 
+void Scene::BeginMesh(){
+    // Loaders append to triangles_buffer, so the mesh's triangles are kept there while it is loaded.
+    std::swap(triangles_buffer, mesh_triangles_buffer);
+    std::swap(triangle_materials_buffer, mesh_triangle_materials_buffer);
+    InstancedMesh mesh = InstancedMesh();
+    mesh.first_triangle = triangles_buffer.size();
+    meshes.push_back(mesh);
+    building_mesh = true;
+}
+
+unsigned int Scene::EndMesh(){
+    InstancedMesh& mesh = meshes.back();
+    mesh.triangles_n = triangles_buffer.size() - mesh.first_triangle;
+    std::swap(triangles_buffer, mesh_triangles_buffer);
+    std::swap(triangle_materials_buffer, mesh_triangle_materials_buffer);
+    building_mesh = false;
+    out::cout(4) << "-- Loaded instanced mesh " << meshes.size() - 1 << " with " << mesh.triangles_n << " faces." << std::endl;
+    return meshes.size() - 1;
+}
+
+void Scene::AddInstance(unsigned int mesh, glm::mat4 transform){
+    if(meshes[mesh].triangles_n == 0) return;
+    if(meshes[mesh].emissive){
+        FlattenInstance(meshes[mesh], transform);
+        return;
+    }
+    Instance instance;
+    instance.to_world = transform;
+    instance.to_object = glm::inverse(transform);
+    instance.normal_to_world = glm::transpose(glm::inverse(glm::mat3(transform)));
+    instance.mesh = mesh;
+    instances.push_back(instance);
+}
+
+void Scene::FlattenInstance(const InstancedMesh& mesh, glm::mat4 transform){
+    glm::mat3 normal_transform = glm::transpose(glm::inverse(glm::mat3(transform)));
+    // Consecutive emissive triangles with the same material form one areal light.
+    ArealLight al;
+    int light_material = -1;
+    for(unsigned int i = 0; i < mesh.triangles_n; i++){
+        const Triangle src = mesh_triangles_buffer[mesh.first_triangle + i];
+        uint16_t material_id = mesh_triangle_materials_buffer[mesh.first_triangle + i];
+        unsigned int vertex_index_offset = vertices_buffer.size();
+        for(unsigned int v : {src.va, src.vb, src.vc}){
+            glm::vec3 vertex = vertices_buffer[v], normal = normals_buffer[v], tangent = tangents_buffer[v];
+            glm::vec2 uv = texcoords_buffer[v];
+            vertices_buffer.push_back((transform * glm::vec4(vertex, 1.0f)).xyz());
+            normals_buffer.push_back(normal_transform * normal);
+            tangents_buffer.push_back(glm::mat3(transform) * tangent);
+            texcoords_buffer.push_back(uv);
+        }
+        triangles_buffer.push_back(Triangle(vertex_index_offset, vertex_index_offset + 1, vertex_index_offset + 2));
+        triangle_materials_buffer.push_back(material_id);
+        if(material_table[material_id]->emission.isNonZero()){
+            if(material_id != light_material && !al.triangles_with_areas.empty()){
+                areal_lights.push_back(std::make_pair(0.0f, al));
+                al = ArealLight();
+            }
+            light_material = material_id;
+            al.triangles_with_areas.push_back(std::make_pair(0.0f, triangles_buffer.size() - 1));
+        }
+    }
+    if(!al.triangles_with_areas.empty())
+        areal_lights.push_back(std::make_pair(0.0f, al));
+}
+
 std::shared_ptr<ReadableTexture> Scene::GetTexture(std::string path){
     if(path == "") return nullptr;
     auto it = textures.find(path);
@@ -291,14 +421,79 @@ std::shared_ptr<Material> Scene::GetMaterialByName(std::string name) const{
     return it->second;
 }
 
+uint16_t Scene::GetMaterialID(const std::shared_ptr<Material>& material){
+    auto it = material_ids.find(material.get());
+    if(it != material_ids.end()) return it->second;
+    if(material_table.size() > std::numeric_limits<uint16_t>::max())
+        throw std::runtime_error("Error: Scenes may use at most 65536 materials");
+    uint16_t id = material_table.size();
+    material_table.push_back(material);
+    material_ids[material.get()] = id;
+    return id;
+}
+
+// Shared state of a (parallel) kd-tree build.
+struct KdBuildContext{
+    KdBuildContext(unsigned int threads, unsigned int n_triangles, unsigned int max_depth, bool clip, float epsilon)
+        : pool(threads), side(threads, std::vector<unsigned char>(n_triangles)), max_depth(max_depth),
+          clip(clip), epsilon(epsilon) {}
+
+    ctpl::thread_pool pool;
+    // Per-thread scratch space, marks which children each triangle of the node being split belongs to.
+    std::vector<std::vector<unsigned char>> side;
+    unsigned int max_depth;
+    // Whether triangles straddling a split are clipped to the children's boxes.
+    bool clip;
+    float epsilon;
+
+    // Subtrees with fewer triangles are built by the same thread as their parent, as a task would not pay off.
+    static const unsigned int min_task_triangles = 512;
+
+    // Queues a subtree build on the pool.
+    void Spawn(UncompressedKdNode* node, KdEventLists events){
+        {
+            std::lock_guard<std::mutex> lk(mx);
+            pending++;
+        }
+        auto ev = std::make_shared<KdEventLists>(std::move(events));
+        pool.push([this, node, ev](int id){
+                node->Subdivide(*this, std::move(*ev), id);
+                std::lock_guard<std::mutex> lk(mx);
+                if(--pending == 0) cv.notify_all();
+            });
+    }
+    // Blocks until all spawned subtrees are complete.
+    void Wait(){
+        std::unique_lock<std::mutex> lk(mx);
+        cv.wait(lk, [this](){return pending == 0;});
+    }
+private:
+    std::mutex mx;
+    std::condition_variable cv;
+    unsigned int pending = 0;
+};
+
 void Scene::Commit(){
+    if(cache_mapping){
+        // Geometry and the kd-tree were loaded from the scene cache.
+        PrepareLights();
+        return;
+    }
+
     FreeBuffers();
 
+    // Triangles of instanced meshes follow the world ones.
+    n_world_triangles = triangles_buffer.size();
+    for(InstancedMesh& mesh : meshes) mesh.first_triangle += n_world_triangles;
+    triangles_buffer.insert(triangles_buffer.end(), mesh_triangles_buffer.begin(), mesh_triangles_buffer.end());
+    triangle_materials_buffer.insert(triangle_materials_buffer.end(), mesh_triangle_materials_buffer.begin(),
+                                     mesh_triangle_materials_buffer.end());
+    mesh_triangles_buffer = std::vector<Triangle>();
+    mesh_triangle_materials_buffer = std::vector<uint16_t>();
+
     vertices = new glm::vec3[vertices_buffer.size()];
     triangles = new Triangle[triangles_buffer.size()];
-    normals = new glm::vec3[normals_buffer.size()];
-    texcoords = new glm::vec2[texcoords_buffer.size()];
-    tangents = new glm::vec3[tangents_buffer.size()];
+    triangle_materials = new uint16_t[triangles_buffer.size()];
 
     n_vertices = vertices_buffer.size();
     n_triangles = triangles_buffer.size();
@@ -311,52 +506,35 @@ void Scene::Commit(){
         vertices[i] = glm::vec3(vertices_buffer[i].x, vertices_buffer[i].y, vertices_buffer[i].z);
     for(unsigned int i = 0; i < n_triangles; i++){
         triangles[i] = triangles_buffer[i];
-        triangles[i].CalculatePlane();
-    }
-    for(unsigned int i = 0; i < n_normals; i++)
-        normals[i] = glm::vec3(normals_buffer[i].x, normals_buffer[i].y, normals_buffer[i].z);
-    for(unsigned int i = 0; i < n_tangents; i++)
-        tangents[i] = glm::vec3(tangents_buffer[i].x, tangents_buffer[i].y, tangents_buffer[i].z);
-    for(unsigned int i = 0; i < n_texcoords; i++)
-        texcoords[i] = glm::vec2(texcoords_buffer[i].x, texcoords_buffer[i].y);
-
-    // It is safe now to calculate all light areas.
-    total_areal_power = 0.0f;
-    for(auto& q : areal_lights){
-        ArealLight& al = q.second;
-        for(auto& p : al.triangles_with_areas){
-            Triangle t = triangles[p.second];
-            float area = t.GetArea();
-            p.first = area;
-            al.total_area += area;
-        }
-        al.emission = triangles[al.triangles_with_areas[0].second].GetMaterial().emission;
-        // Sort descending
-        std::sort(al.triangles_with_areas.rbegin(), al.triangles_with_areas.rend());
-        float p = al.total_area * (al.emission.r + al.emission.g + al.emission.b);
-        al.power = p;
-        q.first = p;
-        total_areal_power += p;
+        triangles[i].CalculatePlane(vertices);
+        triangle_materials[i] = triangle_materials_buffer[i];
     }
-    total_point_power = 0.0f;
-    for(auto& l : pointlights){
-        total_point_power += l.intensity * 4.0f * glm::pi<float>();
+    if(compress_attributes){
+        packed_normals = new uint32_t[n_normals];
+        packed_tangents = new uint32_t[n_tangents];
+        packed_texcoords = new uint32_t[n_texcoords];
+        for(unsigned int i = 0; i < n_normals; i++)
+            packed_normals[i] = Packing::EncodeOctahedral(normals_buffer[i]);
+        for(unsigned int i = 0; i < n_tangents; i++)
+            packed_tangents[i] = Packing::EncodeOctahedral(tangents_buffer[i]);
+        for(unsigned int i = 0; i < n_texcoords; i++)
+            packed_texcoords[i] = Packing::EncodeHalf2(texcoords_buffer[i]);
+    }else{
+        normals = new glm::vec3[n_normals];
+        tangents = new glm::vec3[n_tangents];
+        texcoords = new glm::vec2[n_texcoords];
+        for(unsigned int i = 0; i < n_normals; i++)
+            normals[i] = glm::vec3(normals_buffer[i].x, normals_buffer[i].y, normals_buffer[i].z);
+        for(unsigned int i = 0; i < n_tangents; i++)
+            tangents[i] = glm::vec3(tangents_buffer[i].x, tangents_buffer[i].y, tangents_buffer[i].z);
+        for(unsigned int i = 0; i < n_texcoords; i++)
+            texcoords[i] = glm::vec2(texcoords_buffer[i].x, texcoords_buffer[i].y);
     }
 
-    out::cout(3) << "Total areal lights power: " << total_areal_power << "W" << std::endl;
-    out::cout(3) << "Total point lights power: " << total_point_power << "W" << std::endl;
-
-    out::cout(2) << "Commited " << n_vertices << " vertices, "
-                                << n_normals << " normals, "
-                                << n_triangles << " triangles, "
-                                << textures.size() <<  " textures, "
-                                << pointlights.size() << " pointlights and "
-                                << areal_lights.size() << " areal lights to the scene."
-                 << std::endl;
-
     // Clearing vectors this way forces memory to be freed.
     vertices_buffer  = std::vector<glm::vec3>();
     triangles_buffer = std::vector<Triangle>();
+    triangle_materials_buffer = std::vector<uint16_t>();
     normals_buffer   = std::vector<glm::vec3>();
     tangents_buffer  = std::vector<glm::vec3>();
     texcoords_buffer = std::vector<glm::vec2>();
@@ -368,7 +546,7 @@ void Scene::Commit(){
     auto bound_fill_func = [this](unsigned int axis, std::vector<float>& buf){
         for(unsigned int i = 0; i < n_triangles; i++){
             const Triangle& t = triangles[i];
-            auto p = std::minmax({t.GetVertexA()[axis], t.GetVertexB()[axis], t.GetVertexC()[axis]});
+            auto p = std::minmax({vertices[t.va][axis], vertices[t.vb][axis], vertices[t.vc][axis]});
             buf[2*i + 0] = p.first;
             buf[2*i + 1] = p.second;
         }
@@ -377,45 +555,96 @@ void Scene::Commit(){
     bound_fill_func(1,yevents);
     bound_fill_func(2,zevents);
 
-    // Global bounding box
-    auto p = std::minmax_element(xevents.begin(), xevents.end());
-    auto q = std::minmax_element(yevents.begin(), yevents.end());
-    auto r = std::minmax_element(zevents.begin(), zevents.end());
+    // Global bounding box, of world triangles and instances
+    glm::vec3 lo(std::numeric_limits<float>::infinity()), hi(-std::numeric_limits<float>::infinity());
+    for(unsigned int i = 0; i < n_world_triangles; i++){
+        lo = glm::min(lo, glm::vec3(xevents[2*i + 0], yevents[2*i + 0], zevents[2*i + 0]));
+        hi = glm::max(hi, glm::vec3(xevents[2*i + 1], yevents[2*i + 1], zevents[2*i + 1]));
+    }
+    for(InstancedMesh& mesh : meshes){
+        glm::vec3 mlo(std::numeric_limits<float>::infinity()), mhi(-std::numeric_limits<float>::infinity());
+        for(unsigned int i = mesh.first_triangle; i < mesh.first_triangle + mesh.triangles_n; i++){
+            mlo = glm::min(mlo, glm::vec3(xevents[2*i + 0], yevents[2*i + 0], zevents[2*i + 0]));
+            mhi = glm::max(mhi, glm::vec3(xevents[2*i + 1], yevents[2*i + 1], zevents[2*i + 1]));
+        }
+        for(unsigned int k = 0; k < 3; k++){
+            mesh.bb_min[k] = mlo[k];
+            mesh.bb_max[k] = mhi[k];
+        }
+    }
+    for(const Instance& instance : instances){
+        glm::vec3 ilo, ihi;
+        GetInstanceBounds(instance, ilo, ihi);
+        lo = glm::min(lo, ilo);
+        hi = glm::max(hi, ihi);
+    }
+    if(!(lo.x <= hi.x)) lo = hi = glm::vec3(0.0f);
 
-    float xsize = *p.second - *p.first;
-    float ysize = *q.second - *q.first;
-    float zsize = *r.second - *r.first;
-    float diameter = glm::sqrt(xsize*xsize + ysize*ysize + zsize*zsize);
+    glm::vec3 size = hi - lo;
+    float diameter = glm::length(size);
 
     epsilon = 0.00001f * diameter;
     out::cout(3) << "Using dynamic epsilon: " << epsilon << std::endl;
 
-    xBB = std::make_pair(*p.first - epsilon, *p.second + epsilon);
-    yBB = std::make_pair(*q.first - epsilon, *q.second + epsilon);
-    zBB = std::make_pair(*r.first - epsilon, *r.second + epsilon);
+    xBB = std::make_pair(lo.x - epsilon, hi.x + epsilon);
+    yBB = std::make_pair(lo.y - epsilon, hi.y + epsilon);
+    zBB = std::make_pair(lo.z - epsilon, hi.z + epsilon);
 
     out::cout(3) << "The scene is bounded by [" << xBB.first << ", " << xBB.second << "], " <<
                                          "[" << yBB.first << ", " << yBB.second << "], " <<
                                          "[" << zBB.first << ", " << zBB.second << "]."  << std::endl;
 
+    PrepareLights();
+
+    if(accel == AccelStructure::Bvh || accel == AccelStructure::WideBvh){
+        BuildBvh();
+        BuildInstances();
+        if(cache_file != "") SaveCache();
+        return;
+    }
+
     uncompressed_root = new UncompressedKdNode;
     uncompressed_root->parent_scene = this;
-    for(unsigned int i = 0; i < n_triangles; i++) uncompressed_root->triangle_indices.push_back(i);
     uncompressed_root->xBB = xBB;
     uncompressed_root->yBB = yBB;
     uncompressed_root->zBB = zBB;
 
     // Prepare kd-tree
-    int l = std::log2(n_triangles) + 8;
+    int l = std::log2(n_world_triangles) + 8;
     //l = 1;
-    out::cout(3) << "Building kD-tree with max depth " << l << "..." << std::endl;
-    uncompressed_root->Subdivide(l);
+    unsigned int concurrency = std::max(1u, std::thread::hardware_concurrency());
+    out::cout(3) << "Building kD-tree with max depth " << l << " using " << concurrency << " threads..." << std::endl;
+    auto build_start = std::chrono::high_resolution_clock::now();
+
+    // Events are sorted once here, nodes only split the sorted lists.
+    KdEventLists root_events;
+    const std::vector<float>* evch[3] = {&xevents, &yevents, &zevents};
+    for(unsigned int axis = 0; axis < 3; axis++){
+        std::vector<KdBBEvent>& events = root_events[axis];
+        events.resize(2 * n_world_triangles);
+        for(unsigned int i = 0; i < n_world_triangles; i++){
+            events[2*i + 0] = KdBBEvent{ (*evch[axis])[2*i + 0], i, KdBBEvent::BEGIN };
+            events[2*i + 1] = KdBBEvent{ (*evch[axis])[2*i + 1], i, KdBBEvent::END   };
+        }
+        std::sort(events.begin(), events.end());
+    }
+
+    {
+        KdBuildContext ctx(concurrency, n_world_triangles, l, kd_clip_triangles, epsilon);
+        ctx.Spawn(uncompressed_root, std::move(root_events));
+        ctx.Wait();
+    }
+
+    auto build_end = std::chrono::high_resolution_clock::now();
+    float build_time = std::chrono::duration<float>(build_end - build_start).count();
+    out::cout(3) << "kD-tree built in " << build_time << "s (" << (int)(n_world_triangles / std::max(build_time, 1e-6f)) << " triangles/s)" << std::endl;
 
     auto totals = uncompressed_root->GetTotals();
     out::cout(3) << "Total triangles in tree: " << std::get<0>(totals) << ", total leafs: " << std::get<1>(totals) << ", total nodes: " << std::get<2>(totals) << ", total dups: " << std::get<3>(totals) << std::endl;
-    out::cout(3) << "Average triangles per leaf: " << std::get<0>(totals)/(float)std::get<1>(totals) << std::endl;
+    out::cout(3) << "Average triangles per leaf: " << std::get<0>(totals)/(float)std::get<1>(totals) << ", largest leaf: " << std::get<4>(totals) << std::endl;
+    out::cout(3) << "Triangle references per triangle: " << std::get<0>(totals)/(float)n_world_triangles << (kd_clip_triangles ? " (clipped to node boxes)" : "") << std::endl;
 
-    out::cout(3) << "Total avg cost with no kd-tree: " << ISECT_COST * n_triangles << std::endl;
+    out::cout(3) << "Total avg cost with no kd-tree: " << ISECT_COST * n_world_triangles << std::endl;
     out::cout(3) << "Total avg cost with kd-tree: " << uncompressed_root->GetCost() << std::endl;
 
 #ifndef NO_COMPRESS
@@ -425,64 +654,186 @@ void Scene::Commit(){
     uncompressed_root->FreeRecursivelly();
     delete uncompressed_root;
     uncompressed_root = nullptr;
+
+    BuildInstances();
+    if(cache_file != "") SaveCache();
 #endif
 }
 
-void UncompressedKdNode::Subdivide(unsigned int max_depth){
-    if(depth >= max_depth) return; // Do not subdivide further.
+void Scene::PrepareLights(){
+    // It is safe now to calculate all light areas.
+    total_areal_power = 0.0f;
+    std::vector<float> weights;
+    emissive_triangles.clear();
+    for(unsigned int i = 0; i < areal_lights.size(); i++){
+        ArealLight& al = areal_lights[i].second;
+        weights.clear();
+        for(auto& p : al.triangles_with_areas){
+            float area = GetTriangleArea(p.second);
+            p.first = area;
+            al.total_area += area;
+            weights.push_back(area);
+            emissive_triangles[p.second] = i;
+        }
+        // Only degenerate triangles? Choose any.
+        if(al.total_area <= 0.0f) weights.assign(weights.size(), 1.0f);
+        al.triangle_choice.Build(weights);
+        al.emission = GetMaterial(al.triangles_with_areas[0].second).emission;
+        float p = al.total_area * (al.emission.r + al.emission.g + al.emission.b);
+        al.power = p;
+        areal_lights[i].first = p;
+        total_areal_power += p;
+    }
+    weights.clear();
+    for(const auto& q : areal_lights) weights.push_back(q.first);
+    if(total_areal_power > 0.0f) areal_light_choice.Build(weights);
+
+    total_point_power = 0.0f;
+    weights.clear();
+    for(auto& l : pointlights){
+        float p = l.intensity * 4.0f * glm::pi<float>();
+        total_point_power += p;
+        weights.push_back(p);
+    }
+    if(total_point_power > 0.0f) pointlight_choice.Build(weights);
+    PrepareEnvironment();
+    if(light_tree) BuildLightTree();
 
-    unsigned int n = triangle_indices.size();
-    if(n < 2) return; // Do not subdivide further.
+    out::cout(3) << "Total areal lights power: " << total_areal_power << "W" << std::endl;
+    out::cout(3) << "Total point lights power: " << total_point_power << "W" << std::endl;
+    if(environment_power > 0.0f)
+        out::cout(3) << "Environment power: " << environment_power << "W" << std::endl;
+
+    out::cout(2) << "Commited " << n_vertices << " vertices, "
+                                << n_normals << " normals, "
+                                << n_triangles << " triangles, "
+                                << textures.size() <<  " textures, "
+                                << pointlights.size() << " pointlights and "
+                                << areal_lights.size() << " areal lights to the scene."
+                 << std::endl;
+    size_t attribute_bytes = packed_normals ? (n_normals + n_tangents + n_texcoords) * sizeof(uint32_t)
+        : (n_normals + n_tangents) * sizeof(glm::vec3) + n_texcoords * sizeof(glm::vec2);
+    out::cout(2) << "Geometry uses " << n_vertices * sizeof(glm::vec3) / 1024 << "kiB for vertices, "
+                                     << attribute_bytes / 1024 << "kiB for "
+                                     << (packed_normals ? "compressed" : "full precision") << " vertex attributes and "
+                                     << n_triangles * (sizeof(Triangle) + sizeof(uint16_t)) / 1024 << "kiB for triangles."
+                 << std::endl;
+}
+
+// Bounds of the part of a triangle within a kd-tree node.
+struct KdClippedBounds{
+    unsigned int triangleID;
+    float lo[3], hi[3];
+};
+
+// Computes the bounds of the part of the triangle that lies within the node's box, enlarged by epsilon. The triangle
+// is clipped by each of the box's planes in turn (Sutherland-Hodgman). Returns false if nothing remains.
+static bool ClipTriangleBounds(const Scene& scene, unsigned int tri, const UncompressedKdNode& node, float epsilon,
+                               KdClippedBounds& out){
+    const std::pair<float,float>* bb[3] = {&node.xBB, &node.yBB, &node.zBB};
+    // Each plane adds at most one vertex.
+    glm::vec3 poly[9], tmp[9];
+    poly[0] = scene.GetVertexA(tri);
+    poly[1] = scene.GetVertexB(tri);
+    poly[2] = scene.GetVertexC(tri);
+    unsigned int n = 3;
+    for(unsigned int axis = 0; axis < 3; axis++){
+        for(int upper = 0; upper < 2; upper++){
+            float plane = upper ? bb[axis]->second + epsilon : bb[axis]->first - epsilon;
+            // Positive inside the box.
+            auto dist = [&](const glm::vec3& p){ return upper ? plane - p[axis] : p[axis] - plane; };
+            unsigned int m = 0;
+            for(unsigned int i = 0; i < n; i++){
+                const glm::vec3& a = poly[i];
+                const glm::vec3& b = poly[(i + 1) % n];
+                float da = dist(a), db = dist(b);
+                if(da >= 0.0f) tmp[m++] = a;
+                if((da >= 0.0f) != (db >= 0.0f)){
+                    glm::vec3 p = a + (b - a) * (da / (da - db));
+                    p[axis] = plane;
+                    tmp[m++] = p;
+                }
+            }
+            n = m;
+            if(n == 0) return false;
+            std::copy(tmp, tmp + n, poly);
+        }
+    }
+    for(unsigned int axis = 0; axis < 3; axis++){
+        float lo = poly[0][axis], hi = poly[0][axis];
+        for(unsigned int i = 1; i < n; i++){
+            lo = std::min(lo, poly[i][axis]);
+            hi = std::max(hi, poly[i][axis]);
+        }
+        out.lo[axis] = glm::clamp(lo, bb[axis]->first, bb[axis]->second);
+        out.hi[axis] = glm::clamp(hi, bb[axis]->first, bb[axis]->second);
+    }
+    return true;
+}
+
+// Adds events of clipped triangles along an axis to a sorted event list, keeping it sorted.
+static void MergeClippedEvents(std::vector<KdBBEvent>& events, const std::vector<KdClippedBounds>& clipped, unsigned int axis){
+    if(clipped.empty()) return;
+    size_t mid = events.size();
+    for(const KdClippedBounds& c : clipped){
+        events.push_back(KdBBEvent{ c.lo[axis], c.triangleID, KdBBEvent::BEGIN });
+        events.push_back(KdBBEvent{ c.hi[axis], c.triangleID, KdBBEvent::END   });
+    }
+    std::sort(events.begin() + mid, events.end());
+    std::inplace_merge(events.begin(), events.begin() + mid, events.end());
+}
+
+void UncompressedKdNode::Subdivide(KdBuildContext& ctx, KdEventLists events, int thread_id){
+    // The number of triangles in this node.
+    unsigned int n = events[0].size()/2;
+
+    auto make_leaf = [&](){
+        triangle_indices.clear();
+        triangle_indices.reserve(n);
+        for(const KdBBEvent& e : events[0])
+            if(e.type == KdBBEvent::BEGIN) triangle_indices.push_back(e.triangleID);
+    };
+
+    if(depth >= ctx.max_depth || // Do not subdivide further.
+       n < 2){
+        make_leaf();
+        return;
+    }
 
     //std::cerr << "--- Subdividing " << n << " faces" << std::endl;
 
     // Choose the axis for subdivision.
-    // TODO: Do it faster
     float sizes[3] = {xBB.second - xBB.first, yBB.second - yBB.first, zBB.second - zBB.first};
     unsigned int axis = std::max_element(sizes, sizes+3) - sizes;
 
     //std::cerr << "Using axis " << axis << std::endl;
-    const std::vector<float>* evch[3] = {&parent_scene->xevents, &parent_scene->yevents, &parent_scene->zevents};
-
-    unsigned int retries = 0;
- retry: // Return point for retrying with a different axis
-
-    const std::vector<float>& all_events = *evch[axis];
-
-    // Prepare BB events.
-    struct BBEvent{
-        float pos;
-        int triangleID;
-        enum {BEGIN, END} type;
-    };
-    std::vector<BBEvent> events(2*n);
-    for(unsigned int i = 0; i < n; i++){
-        int t = triangle_indices[i];
-        //std::cerr << "Adding events for triangle no " << t << std::endl;
-        events[2*i + 0] = BBEvent{ all_events[2*t + 0], t, BBEvent::BEGIN };
-        events[2*i + 1] = BBEvent{ all_events[2*t + 1], t, BBEvent::END   };
-    }
-    std::sort(events.begin(), events.end(), [](const BBEvent& a, const BBEvent& b){
-            if(a.pos == b.pos) return a.type < b.type;
-            return a.pos < b.pos;
-            });
 
     // SAH, inspired by the pbrt book.
     const std::pair<float,float>* axbds[3] = {&xBB,&yBB,&zBB};
-    const std::pair<float,float>& axis_bounds = *axbds[axis];
     const float BBsize[3] = {xBB.second - xBB.first, yBB.second - yBB.first, zBB.second - zBB.first};
+    float invTotalSA = 1.f / (2.f * (BBsize[0]*BBsize[1] + BBsize[0]*BBsize[2] + BBsize[1]*BBsize[2]));
+    float nosplit_cost = ISECT_COST * n; // The estimated traversal costs of this node if we choose not to split it
 
     int best_offset = -1;
     float best_cost = std::numeric_limits<float>::infinity();
     float best_pos  = std::numeric_limits<float>::infinity();
-    float nosplit_cost = ISECT_COST * n; // The estimated traversal costs of this node if we choose not to split it
+
+    unsigned int retries = 0;
+ retry: // Return point for retrying with a different axis
+
+    // Events are presorted, so a single linear sweep finds the best split along this axis.
+    const std::vector<KdBBEvent>& axis_events = events[axis];
+    const std::pair<float,float>& axis_bounds = *axbds[axis];
+
+    best_offset = -1;
+    best_cost = std::numeric_limits<float>::infinity();
+    best_pos  = std::numeric_limits<float>::infinity();
     unsigned int axis2 = (axis + 1) % 3, axis3 = (axis + 2) % 3;
-    float invTotalSA = 1.f / (2.f * (BBsize[0]*BBsize[1] + BBsize[0]*BBsize[2] + BBsize[1]*BBsize[2]));
     int n_before = 0, n_after = n;
     for(unsigned int i = 0; i < 2*n; i++){
-        if(events[i].type == BBEvent::END)
+        if(axis_events[i].type == KdBBEvent::END)
             n_after--;
-        float pos = events[i].pos;
+        float pos = axis_events[i].pos;
         // Ignore splits at positions outside current bounding box
         if(pos > axis_bounds.first && pos < axis_bounds.second){
             // Hopefully CSE cleans this up
@@ -508,7 +859,7 @@ void UncompressedKdNode::Subdivide(unsigned int max_depth){
                 prob1 = p_after;
             }
         }
-        if(events[i].type == BBEvent::BEGIN)
+        if(axis_events[i].type == KdBBEvent::BEGIN)
             n_before++;
     }
 
@@ -523,6 +874,7 @@ void UncompressedKdNode::Subdivide(unsigned int max_depth){
             goto retry;
             }
         //std::cerr << "Not splitting, best cost = " << best_cost << ", nosplit cost = " << nosplit_cost << std::endl;
+        make_leaf();
         return;
     }
 
@@ -547,17 +899,17 @@ void UncompressedKdNode::Subdivide(unsigned int max_depth){
     split_axis = axis;
     split_pos = best_pos;
 
+    // Classify triangles: bit 0 - goes to ch0, bit 1 - goes to ch1.
+    std::vector<unsigned char>& side = ctx.side[thread_id];
+    for (unsigned int i = 0; i < 2*n; ++i)
+        if (axis_events[i].type == KdBBEvent::BEGIN)
+            side[axis_events[i].triangleID] = 0;
     for (unsigned int i = 0; i < (unsigned int)best_offset; ++i)
-        if (events[i].type == BBEvent::BEGIN)
-            ch0->triangle_indices.push_back(events[i].triangleID);
+        if (axis_events[i].type == KdBBEvent::BEGIN)
+            side[axis_events[i].triangleID] |= 1;
     for (unsigned int i = best_offset + 1; i < 2*n; ++i)
-        if (events[i].type == BBEvent::END)
-            ch1->triangle_indices.push_back(events[i].triangleID);
-
-    //std::cerr << "After split " << ch0->triangle_indices.size() << " " << ch1->triangle_indices.size() << std::endl;
-
-    // Remove triangles from this node
-    triangle_indices = std::vector<unsigned int>(triangle_indices);
+        if (axis_events[i].type == KdBBEvent::END)
+            side[axis_events[i].triangleID] |= 2;
 
     // Prepare new BBs for children
     ch0->xBB = (axis == 0) ? std::make_pair(xBB.first,best_pos) : xBB;
@@ -567,9 +919,56 @@ void UncompressedKdNode::Subdivide(unsigned int max_depth){
     ch1->yBB = (axis == 1) ? std::make_pair(best_pos,yBB.second) : yBB;
     ch1->zBB = (axis == 2) ? std::make_pair(best_pos,zBB.second) : zBB;
 
-    // Recursivelly subdivide
-    ch0->Subdivide(max_depth);
-    ch1->Subdivide(max_depth);
+    // Triangles straddling the split get new bounds, clipped to each child's box. These are often much smaller than
+    // the triangle's own bounds, so that it straddles fewer splits further down. Clipped triangles are marked with
+    // bit 2, their old events are replaced with new ones.
+    std::vector<KdClippedBounds> clipped0, clipped1;
+    if(ctx.clip){
+        for (unsigned int i = 0; i < 2*n; ++i){
+            const KdBBEvent& e = axis_events[i];
+            if (e.type != KdBBEvent::BEGIN || side[e.triangleID] != 3) continue;
+            KdClippedBounds b0, b1;
+            bool in0 = ClipTriangleBounds(*parent_scene, e.triangleID, *ch0, ctx.epsilon, b0);
+            bool in1 = ClipTriangleBounds(*parent_scene, e.triangleID, *ch1, ctx.epsilon, b1);
+            if(!in0 && !in1){
+                // Rounding, the triangle has to be somewhere. Keep its own events in both children.
+                continue;
+            }
+            b0.triangleID = b1.triangleID = e.triangleID;
+            if(in0) clipped0.push_back(b0);
+            if(in1) clipped1.push_back(b1);
+            side[e.triangleID] = 4 | (in0 ? 1 : 0) | (in1 ? 2 : 0);
+        }
+    }
+    for (unsigned int i = 0; i < 2*n; ++i)
+        if (axis_events[i].type == KdBBEvent::BEGIN && (side[axis_events[i].triangleID] & 3) == 3)
+            dups++;
+
+    // Splitting the sorted lists preserves their order, so children never need to sort again. Only events of
+    // clipped triangles are sorted, and merged in.
+    KdEventLists ev0, ev1;
+    for(unsigned int a = 0; a < 3; a++){
+        for(const KdBBEvent& e : events[a]){
+            unsigned char s = side[e.triangleID];
+            if(s & 4) continue;
+            if(s & 1) ev0[a].push_back(e);
+            if(s & 2) ev1[a].push_back(e);
+        }
+        events[a] = std::vector<KdBBEvent>();
+        if(ctx.clip){
+            MergeClippedEvents(ev0[a], clipped0, a);
+            MergeClippedEvents(ev1[a], clipped1, a);
+        }
+    }
+
+    //std::cerr << "After split " << ev0[0].size()/2 << " " << ev1[0].size()/2 << std::endl;
+
+    // Recursivelly subdivide. Large subtrees are handed over to other threads.
+    if(ev1[0].size()/2 >= KdBuildContext::min_task_triangles)
+        ctx.Spawn(ch1, std::move(ev1));
+    else
+        ch1->Subdivide(ctx, std::move(ev1), thread_id);
+    ch0->Subdivide(ctx, std::move(ev0), thread_id);
 
 }
 void UncompressedKdNode::FreeRecursivelly(){
@@ -581,9 +980,9 @@ void UncompressedKdNode::FreeRecursivelly(){
     }
 }
 
-std::tuple<int, int, int, int> UncompressedKdNode::GetTotals() const{
+std::tuple<int, int, int, int, int> UncompressedKdNode::GetTotals() const{
     if(type == 0){ // leaf
-        return std::make_tuple(triangle_indices.size(), 1, 1, dups);
+        return std::make_tuple(triangle_indices.size(), 1, 1, dups, triangle_indices.size());
     }else{
         auto p0 = ch0->GetTotals();
         auto p1 = ch1->GetTotals();
@@ -591,7 +990,8 @@ std::tuple<int, int, int, int> UncompressedKdNode::GetTotals() const{
         int total_leafs = std::get<1>(p0) + std::get<1>(p1);
         int total_nodes = std::get<2>(p0) + std::get<2>(p1) + 1;
         int total_dups = std::get<3>(p0) + std::get<3>(p1) + dups;
-        return std::make_tuple(total_triangles, total_leafs, total_nodes, total_dups);
+        int largest_leaf = std::max(std::get<4>(p0), std::get<4>(p1));
+        return std::make_tuple(total_triangles, total_leafs, total_nodes, total_dups, largest_leaf);
     }
 }
 
@@ -603,57 +1003,157 @@ float UncompressedKdNode::GetCost() const{
     }
 }
 
+namespace{
+
+// Node order of the compressed kd-tree. Slots hold the root, then pairs of siblings; nullptr marks padding.
+struct KdLayout{
+    std::vector<const UncompressedKdNode*> slots;
+    std::unordered_map<const UncompressedKdNode*, unsigned int> first_child;
+    std::unordered_map<const UncompressedKdNode*, unsigned int> pairs_below;
+    unsigned int block_pairs;
+};
+
+unsigned int CountPairs(const UncompressedKdNode* node, KdLayout& layout){
+    if(node->type == UncompressedKdNode::LEAF) return 0;
+    unsigned int n = 1 + CountPairs(node->ch0, layout) + CountPairs(node->ch1, layout);
+    layout.pairs_below[node] = n;
+    return n;
+}
+
+float NodeArea(const UncompressedKdNode* node){
+    float x = node->xBB.second - node->xBB.first;
+    float y = node->yBB.second - node->yBB.first;
+    float z = node->zBB.second - node->zBB.first;
+    return x*y + y*z + z*x;
+}
+
+// Places the child pairs of the top of node's subtree in one block, opening nodes with the largest surface area
+// (the likeliest to be visited) first. The nodes left unopened root the following treelets, which are placed depth
+// first, so that every subtree also ends up contiguous.
+void LayoutTreelet(const UncompressedKdNode* node, KdLayout& layout){
+    unsigned int used = (layout.slots.size() / 2) % layout.block_pairs;
+    unsigned int capacity = std::min(layout.block_pairs - used, layout.pairs_below[node]);
+    // Start a new block rather than squeezing a large subtree into a small remainder.
+    if(capacity < layout.pairs_below[node] && 2 * used > layout.block_pairs){
+        while((layout.slots.size() / 2) % layout.block_pairs != 0) layout.slots.push_back(nullptr);
+        capacity = std::min(layout.block_pairs, layout.pairs_below[node]);
+    }
+
+    std::vector<const UncompressedKdNode*> frontier{node};
+    for(unsigned int i = 0; i < capacity && !frontier.empty(); i++){
+        auto best = std::max_element(frontier.begin(), frontier.end(),
+            [](const UncompressedKdNode* a, const UncompressedKdNode* b){return NodeArea(a) < NodeArea(b);});
+        const UncompressedKdNode* n = *best;
+        frontier.erase(best);
+
+        layout.first_child[n] = layout.slots.size();
+        layout.slots.push_back(n->ch0);
+        layout.slots.push_back(n->ch1);
+        if(n->ch0->type == UncompressedKdNode::INTERNAL) frontier.push_back(n->ch0);
+        if(n->ch1->type == UncompressedKdNode::INTERNAL) frontier.push_back(n->ch1);
+    }
+    for(const UncompressedKdNode* n : frontier)
+        LayoutTreelet(n, layout);
+}
+
+} // namespace
+
 void Scene::Compress(){
     if(uncompressed_root == nullptr) return;
 
     FreeCompressedTree();
 
     auto totals = uncompressed_root->GetTotals();
-    compressed_array_size = std::get<2>(totals);
-    compressed_triangles_size = std::get<0>(totals);
-
-    compressed_array = new CompressedKdNode[compressed_array_size];
-    compressed_triangles = new unsigned int[compressed_triangles_size];
-
-    unsigned int array_pos = 0, triangle_pos = 0;
-    CompressRec(uncompressed_root, array_pos, triangle_pos);
+    // Leaf ranges are padded to KD_LEAF_ALIGN, reserve space for the worst case.
+    unsigned int triangles_space = std::get<0>(totals) + std::get<1>(totals) * (KD_LEAF_ALIGN - 1);
+
+    // The root and an unused slot take the place of a pair, so that pairs never straddle a block.
+    KdLayout layout;
+    layout.block_pairs = std::max<unsigned int>(1, KD_TREELET_BYTES / (2 * sizeof(CompressedKdNode)));
+    layout.slots = {uncompressed_root, nullptr};
+    if(uncompressed_root->type == UncompressedKdNode::INTERNAL){
+        CountPairs(uncompressed_root, layout);
+        LayoutTreelet(uncompressed_root, layout);
+    }
+    compressed_array_size = layout.slots.size();
+
+    // Like the new[] below, a failed allocation throws.
+    void* mem = nullptr;
+    if(posix_memalign(&mem, KD_TREELET_BYTES, compressed_array_size * sizeof(CompressedKdNode)) != 0)
+        throw std::bad_alloc();
+    compressed_array = (CompressedKdNode*)mem;
+    compressed_triangles = new unsigned int[triangles_space];
+
+    unsigned int triangle_pos = 0, padding = 0;
+    for(unsigned int i = 0; i < compressed_array_size; i++){
+        const UncompressedKdNode* node = layout.slots[i];
+        if(node == nullptr){
+            compressed_array[i] = CompressedKdNode(0u, 0u);
+            padding++;
+        }else if(node->type == UncompressedKdNode::LEAF){
+            // Leaf ranges are stored in the order of the leaves in the array
+            compressed_array[i] = CompressedKdNode(node->triangle_indices.size(), triangle_pos);
+            for(unsigned int t : node->triangle_indices)
+                compressed_triangles[triangle_pos++] = t;
+            // Pad to a whole number of triangle blocks
+            while(triangle_pos % KD_LEAF_ALIGN != 0)
+                compressed_triangles[triangle_pos++] = -1;
+        }else{
+            compressed_array[i] = CompressedKdNode(node->split_axis, node->split_pos);
+            compressed_array[i].SetFirstChild(layout.first_child[node]);
+        }
+    }
+    compressed_triangles_size = triangle_pos;
 
     // Asserts
-    if(array_pos != compressed_array_size){
-        std::cout << "Compression failed, array_pos = " << array_pos << ", array_size = " << compressed_array_size << std::endl;
+    if(compressed_array_size - padding != (unsigned int)std::get<2>(totals)){
+        std::cout << "Compression failed, placed " << compressed_array_size - padding << " nodes out of " << std::get<2>(totals) << std::endl;
         return;
     }
-    if(triangle_pos != compressed_triangles_size){
-        std::cout << "Compression failed, triangle_pos = " << triangle_pos << ", triangles_size = " << compressed_triangles_size << std::endl;
+    if(triangle_pos > triangles_space){
+        std::cout << "Compression failed, triangle_pos = " << triangle_pos << ", triangles_space = " << triangles_space << std::endl;
         return;
     }
+
+    BuildTriangleBlocks();
+
     out::cout(3) << "Compression appears successful!" << std::endl;
     out::cout(3) << "Uncompressed node size: " << sizeof(UncompressedKdNode) << "B " << std::endl;
     out::cout(3) << "Compressed node size: " << sizeof(CompressedKdNode) << "B " << std::endl;
-    out::cout(3) << "Total compressed Kd tree size: " << sizeof(CompressedKdNode)*compressed_array_size/1024 << "kiB " << std::endl;
+    out::cout(3) << "Total compressed Kd tree size: " << sizeof(CompressedKdNode)*compressed_array_size/1024 << "kiB (" << padding - 1 << " padding slots in " << KD_TREELET_BYTES << "B treelets)" << std::endl;
 
 }
 
-void Scene::CompressRec(const UncompressedKdNode *node, unsigned int &array_pos, unsigned int &triangle_pos){
-    if(node->type == UncompressedKdNode::LEAF){
-        // Leaf node
-        compressed_array[array_pos] = CompressedKdNode(node->triangle_indices.size(), triangle_pos);
-        array_pos++;
-        // Fill in triangles
-        for(unsigned int t : node->triangle_indices)
-            compressed_triangles[triangle_pos++] = t;
-    }else{
-        // Internal node
-        unsigned int my_pos = array_pos;
-        compressed_array[array_pos] = CompressedKdNode(node->split_axis, node->split_pos);
-        array_pos++;
-        // Left child
-        CompressRec(node->ch0, array_pos, triangle_pos);
-        // Store right child pos to parent
-        compressed_array[my_pos].SetOtherChild(array_pos);
-        // Right child
-        CompressRec(node->ch1, array_pos, triangle_pos);
+void Scene::BuildTriangleBlocks(){
+#ifndef NO_SIMD_LEAVES
+    unsigned int n_blocks = compressed_triangles_size / SIMD_WIDTH;
+    // Blocks hold vector types, which need stricter alignment than new[] guarantees. Like new, a failed allocation
+    // throws.
+    void* mem = nullptr;
+    if(posix_memalign(&mem, sizeof(vfloat), std::max(1u, n_blocks) * sizeof(TriangleBlock)) != 0)
+        throw std::bad_alloc();
+    compressed_blocks = static_cast<TriangleBlock*>(mem);
+
+    for(unsigned int b = 0; b < n_blocks; b++){
+        TriangleBlock& block = compressed_blocks[b];
+        for(unsigned int l = 0; l < SIMD_WIDTH; l++){
+            unsigned int i = compressed_triangles[b * SIMD_WIDTH + l];
+            glm::vec3 v0(0.0f), v1(0.0f), v2(0.0f);
+            if(i != (unsigned int)-1){
+                v0 = GetVertexA(i);
+                v1 = GetVertexB(i);
+                v2 = GetVertexC(i);
+            }
+            for(unsigned int k = 0; k < 3; k++){
+                block.v0[k][l] = v0[k];
+                block.v1[k][l] = v1[k];
+                block.v2[k][l] = v2[k];
+            }
+            block.index[l] = i;
+        }
     }
+    out::cout(3) << "Packed leaf triangles into " << n_blocks << " blocks of " << SIMD_WIDTH << " (" << sizeof(TriangleBlock)*n_blocks/1024 << "kiB)" << std::endl;
+#endif // NO_SIMD_LEAVES
 }
 
 void Scene::MakeThinglassSet(std::vector<std::string> phrases){
@@ -667,97 +1167,187 @@ void Scene::MakeThinglassSet(std::vector<std::string> phrases){
     }
 }
 
-bool Scene::Visibility(glm::vec3 a, glm::vec3 b) __restrict__ const {
-    Ray r(a, b, epsilon * 20.0f);
-    return !FindIntersectKd(r).triangle;
-}
-bool Scene::VisibilityWithThinglass(glm::vec3 a, glm::vec3 b, ThinglassIsections& out) __restrict__ const {
-    Ray r(a, b, epsilon * 20.0f);
-    auto i = FindIntersectKdOtherThanWithThinglass(r,nullptr);
-    if(i.triangle != nullptr) return false;
-    out = i.thinglass;
-    return true;
+
+float Scene::GetTriangleArea(unsigned int t) const{
+    glm::vec3 a = GetVertexA(t);
+    glm::vec3 b = GetVertexB(t);
+    glm::vec3 c = GetVertexC(t);
+    glm::vec3 q = a-b;
+    glm::vec3 r = c-b;
+    return 0.5f * glm::length(glm::cross(q,r));
 }
 
+// Explaned at http://mathworld.wolfram.com/TrianglePointPicking.html
+glm::vec3 Scene::GetRandomPoint(unsigned int t, glm::vec2 sample, glm::vec3& normal) const{
+    glm::vec2 r = sample;
+    glm::vec3 a = GetVertexA(t);
+    glm::vec3 c = GetVertexB(t);
+    glm::vec3 b = GetVertexC(t);
+    glm::vec3 Va = a-c;
+    glm::vec3 Vb = b-c;
+    if(r.x + r.y > 1.0f){
+        r.x = 1.0f - r.x;
+        r.y = 1.0f - r.y;
+    }
+    normal = r.x * GetNormalA(t) + (1.0f - r.x - r.y) * GetNormalB(t) + r.y * GetNormalC(t);
+    // Normals of some models are broken, see PathTracer::GeneratePath. The face normal is always there.
+    if(!(glm::length(normal) > 0.0f)) normal = glm::cross(Va, Vb);
+    normal = glm::normalize(normal);
+    return c + r.x*Va + r.y*Vb;
+}
 
 void Scene::AddPointLight(Light l){
     pointlights.push_back(l);
 }
-Light Scene::GetRandomLight(glm::vec2 choice_sample, float light_sample, glm::vec2 triangle_sample, bool debug) const{
-    float total_power = total_point_power + total_areal_power;
+Light Scene::GetRandomLight(glm::vec2 choice_sample, glm::vec2 light_sample, glm::vec2 triangle_sample, bool debug) const{
+    float total_power = total_point_power + total_areal_power + environment_power;
     if(total_power <= 0.0f){
         // Sigh. Return just anything for compatibility.
         return Light(Light::Type::FULL_SPHERE);
     }
     float q = choice_sample.x * total_power;
-    if(q < total_point_power){
+    // Rounding may leave q just above the environment's power when there is nothing else to choose.
+    if(q < environment_power || total_point_power + total_areal_power <= 0.0f){
+        return GetEnvironmentLight(light_sample, triangle_sample);
+    }
+    q -= environment_power;
+    if(q < total_point_power || total_areal_power <= 0.0f){
         // Choose pointlight
-        for(unsigned int i = 0; i < pointlights.size(); i++){
-            q -= pointlights[i].intensity * 4.0f * glm::pi<float>();
-            if(q <= 0.0f){
-                Light res = pointlights[i];
-                // TODO: Fix relative light intensities, as we area importance sampling.
-                // res.intensity = 1.0f;
-                return res;
-            }
-        }
-        out::cout(4) << "Internal error: GetRandomLight out of bounds for point lights." << std::endl;
-        // Sigh. Return just anything for compatibility.
-        return Light(Light::Type::FULL_SPHERE);
+        unsigned int i = pointlight_choice.Sample(q / total_point_power, choice_sample.y);
+        Light res = pointlights[i];
+        res.intensity /= pointlight_choice.Probability(i) * total_point_power / total_power;
+        return res;
     }else{
         // Choose areal light
-        q = choice_sample.y * total_areal_power;
-
-        for(unsigned int i = 0; i < areal_lights.size(); i++){
-            q -= areal_lights[i].first;
-            if(q <= 0.0f){
-                const ArealLight& al = areal_lights[i].second;
-                // Choose a random triangle.
-                return al.GetRandomLight(*this, light_sample, triangle_sample, debug);
-            }
-        }
-        out::cout(4) << "Internal error: GetRandomLight out of bounds for areal lights." << std::endl;
-        // Sigh. Return just anything for compatibility.
-        return Light(Light::Type::FULL_SPHERE);
+        unsigned int i = areal_light_choice.Sample((q - total_point_power) / total_areal_power, choice_sample.y);
+        const ArealLight& al = areal_lights[i].second;
+        // Choose a random triangle.
+        Light res = al.GetRandomLight(*this, light_sample, triangle_sample, debug);
+        // Triangles are chosen proportionally to their area, so all points of the light are equally likely.
+        res.pdf = al.power / total_power / al.total_area;
+        res.intensity /= res.pdf;
+        return res;
     }
 }
 
-Light Scene::ArealLight::GetRandomLight(const Scene& parent, float light_sample, glm::vec2 triangle_sample, bool debug) const{
-    float p = light_sample * total_area;
-    for(unsigned int j = 0; j < triangles_with_areas.size(); j++){
-        p -= triangles_with_areas[j].first;
-        if(p <= 0.0f){
-            const Triangle& t = parent.triangles[triangles_with_areas[j].second];
-            IFDEBUG std::cout << "[SAMPLER] Choosing areal light triangle " << triangles_with_areas[j].second << std::endl;
-            glm::vec3 p = t.GetRandomPoint(triangle_sample);
-            Light res(Light::Type::HEMISPHERE);
-            res.pos = p;
-            res.color = emission;
-            res.intensity = 1.0f;
-            // TODO: interpolated normal at p
-            res.normal = t.GetNormalA();
-            return res;
+Light Scene::ArealLight::GetRandomLight(const Scene& parent, glm::vec2 light_sample, glm::vec2 triangle_sample, bool debug) const{
+    unsigned int t = triangles_with_areas[triangle_choice.Sample(light_sample.x, light_sample.y)].second;
+    IFDEBUG std::cout << "[SAMPLER] Choosing areal light triangle " << t << std::endl;
+    Light res(Light::Type::HEMISPHERE);
+    res.pos = parent.GetRandomPoint(t, triangle_sample, res.normal);
+    res.color = emission;
+    res.intensity = 1.0f;
+    return res;
+}
+
+
+void Scene::PrepareEnvironment(){
+    environment_power = 0.0f;
+    environment_probability = 0.0f;
+    if(skybox_mode != Scene::SkyboxMode::Envmap || !skybox_texture) return;
+    unsigned int w = skybox_texture->GetWidth(), h = skybox_texture->GetHeight();
+    // Rows are at constant inclination, see GetSkyboxRay. Their texels' solid angle shrinks towards the poles.
+    std::vector<float> radiance(w * h), weights(w * h);
+    for(unsigned int y = 0; y < h; y++)
+        for(unsigned int x = 0; x < w; x++){
+            Color c = skybox_texture->GetPixel(x, y);
+            radiance[y * w + x] = glm::max(0.0f, c.r + c.g + c.b);
+        }
+    float total = 0.0f;
+    for(unsigned int y = 0; y < h; y++){
+        float solid_angle = glm::cos(((y + 0.5f) / h - 0.5f) * glm::pi<float>()) *
+                            glm::pi<float>() / h * 2.0f * glm::pi<float>() / w;
+        for(unsigned int x = 0; x < w; x++){
+            // Lookups interpolate between neighbouring texels, so a texel has to be chosen whenever any of them is
+            // bright. Otherwise light interpolated into a dark texel would never be sampled.
+            float r = 0.0f;
+            for(int dy = -1; dy <= 1; dy++)
+                for(int dx = -1; dx <= 1; dx++){
+                    int ny = glm::clamp(int(y) + dy, 0, int(h) - 1);
+                    int nx = (int(x) + dx + int(w)) % int(w);
+                    r = glm::max(r, radiance[ny * w + nx]);
+                }
+            weights[y * w + x] = r * solid_angle;
+            total += radiance[y * w + x] * solid_angle;
         }
     }
-    out::cout(4) << "Internal error: GetRandomLight out of bounds for triangle areas." << std::endl;
-    // Sigh. Return just anything for compatibility.
-    return Light(Light::Type::FULL_SPHERE);
+    if(total <= 0.0f) return;
+    environment_choice.Build(weights);
+    // Powers of other lights are only compared with each other. This one is the light crossing a sphere around
+    // the scene, in the units of areal lights' power (area times radiance).
+    glm::vec3 size(xBB.second - xBB.first, yBB.second - yBB.first, zBB.second - zBB.first);
+    float radius = 0.5f * glm::length(size);
+    environment_power = glm::pi<float>() * radius * radius * total * skybox_intensity;
+    environment_probability = environment_power / (environment_power + total_point_power + total_areal_power);
 }
 
+Light Scene::GetEnvironmentLight(glm::vec2 texel_sample, glm::vec2 sample) const{
+    unsigned int w = skybox_texture->GetWidth(), h = skybox_texture->GetHeight();
+    unsigned int i = environment_choice.Sample(texel_sample.x, texel_sample.y);
+    // A point within the texel, and its direction. The inverse of the mapping in GetSkyboxRay, which is given the
+    // direction opposite to the ray leaving the scene, so this is the direction the light travels in.
+    glm::vec2 uv((i % w + sample.x) / w, (i / w + sample.y) / h);
+    float alpha = (uv.y - 0.5f) * glm::pi<float>();
+    float beta = (uv.x - 0.5f) * 2.0f * glm::pi<float>() - skybox_rotate * 0.0174533f;
+    glm::vec3 direction(-glm::cos(alpha) * glm::sin(beta), glm::sin(alpha), glm::cos(alpha) * glm::cos(beta));
+    // Probability density per solid angle.
+    float pdf = environment_probability * environment_choice.Probability(i) * w * h /
+                (2.0f * glm::pi<float>() * glm::pi<float>() * glm::cos(alpha));
+    glm::vec3 size(xBB.second - xBB.first, yBB.second - yBB.first, zBB.second - zBB.first);
+    Light res(Light::Type::DIRECTIONAL);
+    res.normal = direction;
+    res.color = Radiance(skybox_texture->GetPixelInterpolated(uv)) * Spectrum(skybox_intensity);
+    res.pdf = pdf;
+    res.intensity = (pdf > 0.0f) ? 1.0f / pdf : 0.0f;
+    res.size = 2.0f * glm::length(size);
+    return res;
+}
+
+float Scene::GetEnvironmentPdf(glm::vec2 coords) const{
+    if(environment_probability <= 0.0f) return 0.0f;
+    unsigned int w = skybox_texture->GetWidth(), h = skybox_texture->GetHeight();
+    unsigned int x = glm::min((unsigned int)(glm::fract(coords.x) * w), w - 1);
+    unsigned int y = glm::min((unsigned int)(coords.y * h), h - 1);
+    // The cosine of the inclination, see GetEnvironmentLight.
+    float cos_alpha = glm::sin(coords.y * glm::pi<float>());
+    if(cos_alpha <= 0.0f) return 0.0f;
+    return environment_probability * environment_choice.Probability(y * w + x) * w * h /
+           (2.0f * glm::pi<float>() * glm::pi<float>() * cos_alpha);
+}
+
+float Scene::GetLightPdf(unsigned int triangle, glm::vec3 pos, glm::vec3 normal) const{
+    if(HasLightTree()){
+        auto it = light_tree_leaves.find(triangle);
+        if(it == light_tree_leaves.end()) return 0.0f;
+        return (1.0f - environment_probability) * LightTreeProbability(it->second, pos, normal) /
+               GetTriangleArea(triangle);
+    }
+    auto it = emissive_triangles.find(triangle);
+    if(it == emissive_triangles.end()) return 0.0f;
+    float total_power = total_point_power + total_areal_power + environment_power;
+    const ArealLight& al = areal_lights[it->second].second;
+    if(al.power <= 0.0f) return 0.0f;
+    return al.power / total_power / al.total_area;
+}
+
+glm::vec2 Scene::GetSkyboxCoords(glm::vec3 direction) const{
+    if(skybox_mode == Scene::SkyboxMode::SimpleRadiance) return glm::vec2(0.0f);
+    // TODO: Respect scene (or maybe skybox's) up direction
+    float alpha = glm::asin(glm::clamp(direction.y, -1.0f, 1.0f));
+    float beta = -glm::atan(direction.x, direction.z);
+    qassert_false(std::isnan(alpha));
+    beta += skybox_rotate * 0.0174533f;
+    // Converting to range 0-1
+    float x = beta/(2.0f*glm::pi<float>()) + 0.5f;
+    float y = alpha/glm::pi<float>() + 0.5f;
+    return glm::vec2(x,y);
+}
 
-Radiance Scene::GetSkyboxRay(glm::vec3 direction, bool) const{
+Radiance Scene::GetSkyboxRadiance(glm::vec2 coords) const{
     if(skybox_mode == Scene::SkyboxMode::SimpleRadiance){
         return Radiance(skybox_color) * Spectrum(skybox_intensity);
     }else{
-        // TODO: Respect scene (or maybe skybox's) up direction
-        float alpha = glm::asin(direction.y);
-        float beta = -glm::atan(direction.x, direction.z);
-        qassert_false(std::isnan(alpha));
-        beta += skybox_rotate * 0.0174533f;
-        // Converting to range 0-1
-        float x = beta/(2.0f*glm::pi<float>()) + 0.5f;
-        float y = alpha/glm::pi<float>() + 0.5f;
-        Color c = skybox_texture->GetPixelInterpolated(glm::vec2(x,y));
+        Color c = skybox_texture->GetPixelInterpolated(coords);
         return Radiance(c) * Spectrum(skybox_intensity);
     }
 }
@@ -2,21 +2,53 @@
 #define __SCENE_HPP__
 
 #include <vector>
+#include <array>
 #include <set>
 #include <unordered_map>
 
 #include "glm.hpp"
+#include "alias_table.hpp"
 #include "primitives.hpp"
 #include "texture.hpp"
+#include "simd.hpp"
+#include "packing.hpp"
 
 struct UncompressedKdNode;
 struct CompressedKdNode;
+struct TriangleBlock;
+struct BvhNode;
+struct WideBvhNode;
+struct InstancedMesh;
+struct LeafRay;
 
 class aiScene;
 class aiNode;
 class aiMesh;
 class aiMaterial;
 
+// A node of the light tree. Bounds the positions, the directions of emission, and the total weight of the emitters
+// below it. They emit only within pi/2 of the directions in the cone around axis with cosine of half-angle cos_o
+// (Conty Estevez, Kulla: "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018). Nodes are stored
+// depth-first, so the first child of an internal node directly follows it.
+struct LightTreeNode{
+    glm::vec3 bb_min, bb_max;
+    glm::vec3 axis;
+    float cos_o;
+    // The sum of emitters' power.
+    float weight;
+    // For internal nodes, the index of the second child. For leaves, the index of the emitter.
+    uint32_t offset;
+    bool leaf;
+};
+
+// An emitter of the light tree: a point light, or a triangle of an areal light.
+struct LightTreeEmitter{
+    // An index into Scene::areal_lights, or into Scene::pointlights if triangle is LIGHT_TREE_POINT_LIGHT.
+    uint32_t light;
+    uint32_t triangle;
+};
+#define LIGHT_TREE_POINT_LIGHT 0xffffffffu
+
 class Scene{
 public:
     Scene() {};
@@ -34,6 +66,14 @@ public:
 
     void AddPrimitive(const primitive_data& primitive, glm::mat4 transform, std::string material, glm::mat3 texture_transform);
 
+    // Instancing. Geometry loaded between BeginMesh() and EndMesh() is not placed in the scene, it becomes a mesh,
+    // which AddInstance() places any number of times with a transform. Each mesh is stored once, in object space,
+    // with its own BVH, and a BVH over the instances is traversed after the scene's structure. Meshes with light
+    // sources are copied into the scene for each instance instead, as lights are sampled in world space.
+    void BeginMesh();
+    unsigned int EndMesh();
+    void AddInstance(unsigned int mesh, glm::mat4 transform);
+
     // Makes a set of thin glass material references that match any of given substrings.
     void MakeThinglassSet(std::vector<std::string>);
 
@@ -42,6 +82,34 @@ public:
     // Compresses the kd-tree. Called automatically by Commit()
     void Compress();
 
+    // If the file holds a scene cache written with the same key and acceleration structure, maps the committed
+    // geometry and the structure from it, re-registers materials imported from model files, and returns true.
+    // Commit() then only has to prepare lights. Materials defined in the config have to be registered, and the
+    // acceleration structure selected, before.
+    bool LoadCache(std::string path, uint64_t key);
+    // Makes Commit() write a scene cache with the given key to the file, once the acceleration structure is built.
+    void SetCacheFile(std::string path, uint64_t key);
+
+    // Selects the acceleration structure built by Commit(), the kd-tree by default. Despite their names, all
+    // FindIntersectKd* queries use whichever structure was built.
+    void SetAccelStructure(AccelStructure a) {accel = a;}
+    AccelStructure GetAccelStructure() const {return accel;}
+    // Makes the kd-tree builder clip triangles that straddle a split to each child's box, instead of using their
+    // whole bounding boxes. Children get tighter bounds, and triangles that only graze a child are not put in it.
+    void SetKdClipTriangles(bool c) {kd_clip_triangles = c;}
+    // Makes kd-tree queries keep only the last KD_SHORT_STACK_SIZE far children they still have to visit, instead of
+    // all of them. When these run out before the ray leaves the scene, the traversal restarts from the root, at the
+    // distance where the last visited leaf ends. Rays that stop early (shadow rays, any hit queries) rarely restart.
+    void SetKdShortStack(bool s) {kd_short_stack = s;}
+    bool GetKdShortStack() const {return kd_short_stack;}
+    // Makes Commit() store normals and tangents octahedral-encoded in 32 bits, and texture coordinates as half floats,
+    // instead of full floats. They are decoded by the shading accessors below. Positions are always kept in full
+    // precision, as intersection and structure builds read them.
+    void SetCompressAttributes(bool c) {compress_attributes = c;}
+    // Makes Commit() build a light tree over point lights and emissive triangles, see SampleLightTree().
+    void SetLightTree(bool t) {light_tree = t;}
+    bool HasLightTree() const {return !light_tree_nodes.empty();}
+
     // Prints the entire buffer to stdout.
     void Dump() const;
 
@@ -51,21 +119,37 @@ public:
     // Searches for any interection (not necessarily nearest). Slightly faster than FindIntersectKd.
     const Triangle* FindIntersectKdAny(const Ray& r)
         __restrict__ const __attribute__((hot));
-    // Searches for the nearest intersection, but ignores all intersections with the specified ignored triangle.
-    Intersection    FindIntersectKdOtherThan(const Ray& r, const Triangle* ignored)
+    // Searches for the nearest intersection, but ignores all intersections with the specified ignored triangle. An
+    // instanced triangle is only ignored in the given instance.
+    Intersection    FindIntersectKdOtherThan(const Ray& r, const Triangle* ignored, const Instance* ignored_instance = nullptr)
         __restrict__ const __attribute__((hot));
     // Searches for the nearest intersection, but ignores both the specified ignored triangle, as well as all triangles
-    //  that use material specified in thinglass set. However, such materials are gathered into a list (ordered) in the
-    //  returned value. Useful for simulating thin colored glass.
-    Intersection    FindIntersectKdOtherThanWithThinglass(const Ray& r, const Triangle* ignored)
+    //  that use material specified in thinglass set. However, such materials are gathered into thinglass (ordered),
+    //  which is cleared first, and which the returned value points to. Useful for simulating thin colored glass.
+    Intersection    FindIntersectKdOtherThanWithThinglass(const Ray& r, const Triangle* ignored,
+                                                          ThinglassIsections& thinglass,
+                                                          const Instance* ignored_instance = nullptr)
         __restrict__ const __attribute__((hot));
 
-    // Returns true IFF the two points are visible from each other.
-    // Incorporates no cache of any kind.
-    bool Visibility(glm::vec3 a, glm::vec3 b) __restrict__ const __attribute__((hot));
-    bool VisibilityWithThinglass(glm::vec3 a, glm::vec3 b,
-                                 /*out*/ ThinglassIsections&)
+    // Searches for the nearest intersection for each of n rays, with the same results as FindIntersectKd. The rays
+    // are traversed in SIMD packets, which is much faster when they are coherent (e.g. camera rays for a single
+    // pixel). Packets with diverging directions fall back to single-ray traversal.
+    void IntersectStream(const Ray* rays, Intersection* results, size_t n)
+        __restrict__ const __attribute__((hot));
+
+    // Shadow ray queries. Return true if any triangle blocks the segment between a and b. They stop at the first
+    // blocking triangle found, testing the one remembered in cache (if given) first, and allocate nothing. With
+    // pass_thinglass, triangles with thinglass materials never block the segment. Thinglass does not filter light
+    // (see PathTracer::ApplyThinglass), so this is all shadow rays need to know about it.
+    bool Occluded(glm::vec3 a, glm::vec3 b, OcclusionCache* cache = nullptr, bool pass_thinglass = false)
         __restrict__ const __attribute__((hot));
+    // The same, for n segments from a common point to each query's target. They are tested one after another, each
+    // first against the triangle that blocked the previous one, which segments from one point often share.
+    void OccludedFrom(glm::vec3 from, ShadowQuery* queries, unsigned int n, OcclusionCache* cache = nullptr,
+                      bool pass_thinglass = false)
+        __restrict__ const __attribute__((hot));
+    // Returns true IFF the two points are visible from each other.
+    bool Visibility(glm::vec3 a, glm::vec3 b) __restrict__ const {return !Occluded(a, b);}
 
     // Loads a texture from file, or returns a (scene-locally) cached version
     std::shared_ptr<ReadableTexture> GetTexture(std::string path);
@@ -77,33 +161,89 @@ public:
     unsigned int n_vertices  = 0;
     Triangle*      triangles = nullptr;
     unsigned int n_triangles = 0;
+    // Material IDs of triangles, indices into material_table. Only read for shading and on thinglass hits.
+    uint16_t* triangle_materials = nullptr;
+    // Triangles before this one are in world space, the rest belong to instanced meshes.
+    unsigned int n_world_triangles = 0;
     glm::vec3*     normals   = nullptr;
     unsigned int n_normals   = 0;
     glm::vec3*     tangents  = nullptr;
     unsigned int n_tangents  = 0;
     glm::vec2*     texcoords = nullptr;
     unsigned int n_texcoords = 0;
+    // With compressed attributes, these replace the three arrays above, see Packing.
+    uint32_t* packed_normals   = nullptr;
+    uint32_t* packed_tangents  = nullptr;
+    uint32_t* packed_texcoords = nullptr;
+
+    // Triangle attributes used for shading, by index in triangles.
+    unsigned int GetTriangleIndex(const Triangle* t) const {return t - triangles;}
+    const Material& GetMaterial(unsigned int t) const {return *material_table[triangle_materials[t]];}
+    glm::vec3 GetVertexA(unsigned int t) const {return vertices[triangles[t].va];}
+    glm::vec3 GetVertexB(unsigned int t) const {return vertices[triangles[t].vb];}
+    glm::vec3 GetVertexC(unsigned int t) const {return vertices[triangles[t].vc];}
+    glm::vec3 GetNormalA(unsigned int t) const {return GetNormal(triangles[t].va);}
+    glm::vec3 GetNormalB(unsigned int t) const {return GetNormal(triangles[t].vb);}
+    glm::vec3 GetNormalC(unsigned int t) const {return GetNormal(triangles[t].vc);}
+    glm::vec3 GetTangentA(unsigned int t) const {return GetTangent(triangles[t].va);}
+    glm::vec3 GetTangentB(unsigned int t) const {return GetTangent(triangles[t].vb);}
+    glm::vec3 GetTangentC(unsigned int t) const {return GetTangent(triangles[t].vc);}
+    glm::vec2 GetTexCoordsA(unsigned int t) const {return n_texcoords <= triangles[t].va ? glm::vec2(0.0f) : GetTexCoords(triangles[t].va);}
+    glm::vec2 GetTexCoordsB(unsigned int t) const {return n_texcoords <= triangles[t].vb ? glm::vec2(0.0f) : GetTexCoords(triangles[t].vb);}
+    glm::vec2 GetTexCoordsC(unsigned int t) const {return n_texcoords <= triangles[t].vc ? glm::vec2(0.0f) : GetTexCoords(triangles[t].vc);}
+    float GetTriangleArea(unsigned int t) const;
+    // A point uniformly distributed over the triangle, and the normal interpolated at it.
+    glm::vec3 GetRandomPoint(unsigned int t, glm::vec2 sample, /*out*/ glm::vec3& normal) const;
+    glm::vec3 GetRandomPoint(unsigned int t, glm::vec2 sample) const{
+        glm::vec3 normal;
+        return GetRandomPoint(t, sample, normal);
+    }
 
     // Point lights
     std::vector<Light> pointlights;
     void AddPointLight(Light);
     // Areal lights
     struct ArealLight{
-        // TODO: Rember to sort this (descending order)
         std::vector<std::pair<float,unsigned int>> triangles_with_areas;
         mutable float total_area = 0.0f;
+        // Chooses triangles proportionally to their area.
+        AliasTable triangle_choice;
 
         Radiance emission;
         float power = 0.0f;
 
-        Light GetRandomLight(const Scene& parent, float light_sample, glm::vec2 triangle_sample, bool debug) const;
+        Light GetRandomLight(const Scene& parent, glm::vec2 light_sample, glm::vec2 triangle_sample, bool debug) const;
     };
     float total_areal_power;
     float total_point_power;
     std::vector<std::pair<float,ArealLight>> areal_lights;
-
-
-    Light GetRandomLight(glm::vec2 choice_sample, float light_sample, glm::vec2 triangle_sample, bool debug) const;
+    // Choose lights of each kind proportionally to their power.
+    AliasTable pointlight_choice, areal_light_choice;
+    // The environment map as a light. Its texels are chosen proportionally to their radiance times solid angle.
+    AliasTable environment_choice;
+    float environment_power = 0.0f;
+    // The probability of GetRandomLight choosing the environment.
+    float environment_probability = 0.0f;
+    // A directional light from a point of the environment map, chosen with the samples.
+    Light GetEnvironmentLight(glm::vec2 texel_sample, glm::vec2 sample) const;
+
+
+    // Chooses a light proportionally to its power, and a point on it. The light's intensity is divided by the
+    // probability of that choice, so that it stands for all lights, and its pdf is set.
+    Light GetRandomLight(glm::vec2 choice_sample, glm::vec2 light_sample, glm::vec2 triangle_sample, bool debug) const;
+    // Chooses a point light or an emissive triangle proportionally to an estimate of how much it illuminates a point
+    // with the given normal, and samples it like GetRandomLight does. The environment is never chosen here, the
+    // light's intensity and pdf account for GetRandomLight choosing it instead. Returns false if no light can
+    // illuminate the point. Requires the light tree to be built.
+    bool SampleLightTree(glm::vec3 pos, glm::vec3 normal, float choice_sample, glm::vec2 triangle_sample,
+                         /*out*/ Light& light) const;
+    // The pdf a light sample for the point at pos, with the given normal, has when it chooses a point of the triangle
+    // (see Light::pdf). Samples come from SampleLightTree if there is a light tree, from GetRandomLight otherwise.
+    // Zero if the triangle does not belong to an areal light.
+    float GetLightPdf(unsigned int triangle, glm::vec3 pos, glm::vec3 normal) const;
+    // The pdf of GetRandomLight choosing the environment light at the given skybox coordinates (see
+    // GetSkyboxCoords), per solid angle.
+    float GetEnvironmentPdf(glm::vec2 coords) const;
 
 
     // Indexed by triangles.
@@ -130,7 +270,11 @@ public:
         skybox_intensity = intensity;
         skybox_rotate = rotate;
     }
-    Radiance GetSkyboxRay(glm::vec3 direction, bool debug=false) const;
+    // The environment map coordinates of the direction, in the same convention as GetSkyboxRay.
+    glm::vec2 GetSkyboxCoords(glm::vec3 direction) const;
+    // The sky radiance at coordinates returned by GetSkyboxCoords.
+    Radiance GetSkyboxRadiance(glm::vec2 coords) const;
+    Radiance GetSkyboxRay(glm::vec3 direction) const {return GetSkyboxRadiance(GetSkyboxCoords(direction));}
 
     std::set<std::shared_ptr<const Material>> thinglass;
 
@@ -139,21 +283,121 @@ private:
 
     UncompressedKdNode* uncompressed_root = nullptr;
 
+    // Kd-tree nodes clustered into treelets, see KD_TREELET_BYTES. The root is at index 0, pairs of siblings start
+    // at index 2, and leaf ranges in compressed_triangles follow the order of the leaves in this array.
     CompressedKdNode* compressed_array = nullptr;
     unsigned int compressed_array_size = 0;
     unsigned int* compressed_triangles = nullptr;
     unsigned int compressed_triangles_size = 0;
+    // Leaf triangles, packed SIMD_WIDTH per block. Each leaf's range in compressed_triangles starts at a multiple
+    // of SIMD_WIDTH, so its first block is GetFirstTrianglePos() / SIMD_WIDTH.
+    TriangleBlock* compressed_blocks = nullptr;
+
+    void BuildTriangleBlocks();
+
+    AccelStructure accel = AccelStructure::Kd;
+    bool kd_clip_triangles = false;
+    bool compress_attributes = false;
+    bool kd_short_stack = false;
+    bool light_tree = false;
+    // The BVH, if selected instead of the kd-tree. Its leaves refer to compressed_triangles and compressed_blocks in
+    // the same way kd-tree leaves do.
+    BvhNode* bvh_nodes = nullptr;
+    unsigned int bvh_nodes_size = 0;
+    // The wide BVH, if selected. Its leaves are the leaves of the binary BVH it was collapsed from.
+    WideBvhNode* wide_bvh_nodes = nullptr;
+    unsigned int wide_bvh_nodes_size = 0;
+    // Builds the BVH over triangle bounds in x/y/zevents, and collapses it into the wide BVH if that is selected.
+    void BuildBvh();
+
+    // Instanced meshes and their instances, see BeginMesh(). Mesh BVHs are stored one after another in
+    // mesh_bvh_nodes, and their leaves follow the scene structure's leaves in compressed_triangles.
+    std::vector<InstancedMesh> meshes;
+    std::vector<Instance> instances;
+    BvhNode* mesh_bvh_nodes = nullptr;
+    unsigned int mesh_bvh_nodes_size = 0;
+    // The BVH over instances' world space boxes. Its leaves list instances, starting at offset in instance_indices.
+    BvhNode* instance_bvh_nodes = nullptr;
+    unsigned int instance_bvh_nodes_size = 0;
+    unsigned int* instance_indices = nullptr;
+    unsigned int instance_indices_size = 0;
+    bool building_mesh = false;
+    // Builds mesh and instance BVHs, once the scene structure is built.
+    void BuildInstances();
+    // Copies a mesh into the scene, placed with the transform.
+    void FlattenInstance(const InstancedMesh& mesh, glm::mat4 transform);
+    // The world space box around an instance's mesh box.
+    void GetInstanceBounds(const Instance& instance, glm::vec3& lo, glm::vec3& hi) const;
+
+    // Tests a leaf's triangles, starting at tri_start in compressed_triangles, for intersections with t in [lo, hi].
+    // Shared by both structures, with the same policies as TraverseKd. Returns true if res was updated.
+    template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+    bool IntersectLeaf(const LeafRay& lr, uint32_t tri_start, unsigned int n, float lo, float hi, Intersection& res)
+        __restrict__ const __attribute__((hot));
+
+    // Clips the ray's [near, far] to the scene's bounding box. Returns false if the ray misses it.
+    bool ClipToBox(const Ray& r, float& t0, float& t1) __restrict__ const;
+    // The kd-tree traversal shared by all FindIntersectKd* variants. Policies:
+    //  AnyHit - return the first accepted intersection instead of the nearest one,
+    //  IgnoreTriangle - skip the triangle passed as `ignored`,
+    //  Thinglass - gather thinglass triangles into *res.thinglass instead of hitting them. Together with AnyHit, they
+    //              are only skipped, and nothing is gathered.
+    template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+    void TraverseKd(const Ray& r, const Triangle* ignored, Intersection& res)
+        __restrict__ const __attribute__((hot));
+    // The same, using a short stack, see SetKdShortStack().
+    template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+    void TraverseKdShortStack(const Ray& r, const Triangle* ignored, Intersection& res)
+        __restrict__ const __attribute__((hot));
+    // The BVH counterpart of TraverseKd.
+    template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+    void TraverseBvh(const Ray& r, const Triangle* ignored, Intersection& res)
+        __restrict__ const __attribute__((hot));
+    // The wide BVH counterpart of TraverseKd. Tests all children of a node with a single SIMD slab test.
+    template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+    void TraverseWideBvh(const Ray& r, const Triangle* ignored, Intersection& res)
+        __restrict__ const __attribute__((hot));
+    // Traverses the instances, after the scene structure, for a closer hit than the one in res.
+    template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+    void TraverseInstances(const Ray& r, const Triangle* ignored, const Instance* ignored_instance, Intersection& res)
+        __restrict__ const __attribute__((hot));
+    // Dispatches to the selected structure, and to the instances.
+    template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+    void Traverse(const Ray& r, const Triangle* ignored, const Instance* ignored_instance, Intersection& res)
+        __restrict__ const __attribute__((hot));
+    // The shadow ray query, on a prepared ray.
+    template <bool PassThinglass>
+    bool OccludedRay(const Ray& r, OcclusionCache* cache) __restrict__ const __attribute__((hot));
+    // Traverses up to SIMD_WIDTH rays, whose directions have the same signs, together.
+    void TraversePacketKd(const Ray* rays, Intersection* results, unsigned int n)
+        __restrict__ const __attribute__((hot));
 
-    void CompressRec(const UncompressedKdNode* node, unsigned int& array_pos, unsigned int& triangle_pos);
+    // Vertex attributes, by vertex index.
+    glm::vec3 GetNormal(unsigned int v) const {return packed_normals ? Packing::DecodeOctahedral(packed_normals[v]) : normals[v];}
+    glm::vec3 GetTangent(unsigned int v) const {return packed_tangents ? Packing::DecodeOctahedral(packed_tangents[v]) : tangents[v];}
+    glm::vec2 GetTexCoords(unsigned int v) const {return packed_texcoords ? Packing::DecodeHalf2(packed_texcoords[v]) : texcoords[v];}
 
     mutable std::vector<glm::vec3> vertices_buffer;
     mutable std::vector<Triangle> triangles_buffer;
+    mutable std::vector<uint16_t> triangle_materials_buffer;
+    // Triangles of instanced meshes. Swapped with the buffers above while a mesh is loaded.
+    mutable std::vector<Triangle> mesh_triangles_buffer;
+    mutable std::vector<uint16_t> mesh_triangle_materials_buffer;
     mutable std::vector<glm::vec3> normals_buffer;
     mutable std::vector<glm::vec3> tangents_buffer;
     mutable std::vector<glm::vec2> texcoords_buffer;
 
     std::vector<std::shared_ptr<Material>> materials; //TODO: This vector is redundant, the map below is enough
+    // Materials loaded from model files, in the order they were registered, with their override flag. Kept so that
+    // they can be registered again from a scene cache.
+    std::vector<std::pair<ImportedMaterial, bool>> imported_materials;
     std::unordered_map<std::string, std::shared_ptr<Material>> materials_by_name;
+    // Materials used by triangles, indexed by material ID. Holds the materials, as overriding one removes it from
+    // the containers above.
+    std::vector<std::shared_ptr<Material>> material_table;
+    std::unordered_map<const Material*, uint16_t> material_ids;
+    // Returns the ID of the material, adding it to material_table if it has none yet.
+    uint16_t GetMaterialID(const std::shared_ptr<Material>& material);
     // TODO: Material* default_material;
 
     // This map is the owner of all file-based textures in this scene
@@ -171,17 +415,140 @@ private:
     float skybox_intensity;
     float skybox_rotate;
 
+    // Computes areal light areas and light powers. Requires the scene's bounding box.
+    void PrepareLights();
+    // Builds environment_choice, and estimates the environment's power.
+    void PrepareEnvironment();
+    // The light tree, if enabled, root first. Leaves are single emitters.
+    std::vector<LightTreeNode> light_tree_nodes;
+    std::vector<LightTreeEmitter> light_tree_emitters;
+    // The leaf node of each emissive triangle in the light tree.
+    std::unordered_map<unsigned int, unsigned int> light_tree_leaves;
+    // The probability of SampleLightTree choosing the leaf node.
+    float LightTreeProbability(unsigned int leaf, glm::vec3 pos, glm::vec3 normal) const;
+    // The areal light of each emissive triangle, an index into areal_lights.
+    std::unordered_map<unsigned int, unsigned int> emissive_triangles;
+    // Builds the light tree over lights prepared by PrepareLights.
+    void BuildLightTree();
+
+    std::string cache_file;
+    uint64_t cache_key = 0;
+    // When loaded from a scene cache, geometry and kd-tree arrays point into this mapping.
+    void* cache_mapping = nullptr;
+    size_t cache_mapping_size = 0;
+    void SaveCache() const;
+
     void FreeBuffers();
     void FreeTextures();
     void FreeMaterials();
     void FreeCompressedTree();
+    void FreeCache();
+};
+
+
+// Uncomment to intersect kd-tree leaves one triangle at a time with Triangle::TestIntersection, instead of using
+// the SIMD kernel over triangle blocks.
+// #define NO_SIMD_LEAVES
+
+#ifndef NO_SIMD_LEAVES
+  #define KD_LEAF_ALIGN SIMD_WIDTH
+#else
+  #define KD_LEAF_ALIGN 1
+#endif
+
+// Size of the blocks kd-tree nodes are clustered into. Sibling nodes are stored in pairs, and the pairs of a subtree's
+// top levels fill one block, so that a ray usually descends several levels within it. 64 is a cache line; page size
+// (4096) trades some of that for fewer TLB misses on very large trees.
+#define KD_TREELET_BYTES 64
+
+// Entries of the short stack used by Scene::TraverseKdShortStack. A power of two.
+#define KD_SHORT_STACK_SIZE 4
+
+// SIMD_WIDTH triangles, one per lane, with their vertices as they are in Scene::vertices. Vertices, rather than
+// edges, are kept so that the watertight test (see RayShear) computes the same edge function for two triangles
+// sharing an edge. Unused lanes have all vertices at the origin, so they never report a hit, and index -1.
+struct TriangleBlock{
+    vfloat v0[3];
+    vfloat v1[3];
+    vfloat v2[3];
+    vmask index;
 };
 
+// A BVH node. Nodes are stored depth-first, so the first child of an internal node directly follows it. 32 bytes, so
+// that two nodes share a cache line.
+struct BvhNode{
+    float bb_min[3];
+    // For internal nodes, the index of the second child. For leaves, the position of the first triangle in
+    // compressed_triangles, a multiple of KD_LEAF_ALIGN.
+    uint32_t offset;
+    float bb_max[3];
+    uint16_t triangles_n;
+    // The axis along which the children were split, 3 for leaves.
+    uint16_t axis;
+    inline bool IsLeaf() const {return axis == 3;}
+};
+
+// Binned SAH costs of the BVH builder. Leaves are priced per triangle block, as that is how they are tested.
+#define BVH_BINS 16
+#define BVH_NODE_COST 1.0f
+#define BVH_BLOCK_COST 1.0f
+// Larger leaves are split even if the SAH does not favor it.
+#define BVH_MAX_LEAF 16
+// Nodes deeper than this are split at the object median, which bounds the depth of the tree.
+#define BVH_MAX_SAH_DEPTH 48
+#define BVH_STACK_SIZE 128
+
+// A mesh placed by instances. Its triangles are [first_triangle, first_triangle + triangles_n) in the scene's triangle
+// array, in object space. Its BVH starts at root in the scene's mesh_bvh_nodes, child offsets are relative to it.
+struct InstancedMesh{
+    uint32_t first_triangle;
+    uint32_t triangles_n;
+    uint32_t root;
+    // Whether any of its triangles emit light, which prevents instancing it.
+    uint32_t emissive;
+    float bb_min[3];
+    float bb_max[3];
+};
+
+// A node of the wide BVH. Child boxes are stored one per lane, so that a ray is tested against all of them at once.
+// Unused children have empty boxes (min +inf, max -inf), which no ray enters.
+struct WideBvhNode{
+    vfloat bb_min[3];
+    vfloat bb_max[3];
+    // For internal children, the index of their node. For leaves, WIDE_BVH_LEAF | the position of their first
+    // triangle in compressed_triangles.
+    uint32_t child[SIMD_WIDTH];
+    uint16_t triangles_n[SIMD_WIDTH];
+    // The order in which children are visited, near to far, 4 bits per child. Indexed by the octant of the ray
+    // direction, where bit i is set if the direction is negative along axis i.
+    uint32_t order[8];
+};
+#define WIDE_BVH_LEAF 0x80000000u
+// The wide tree is never deeper than the binary one, and each node visited pushes at most SIMD_WIDTH - 1 entries
+// more than it pops.
+#define WIDE_BVH_STACK_SIZE ((SIMD_WIDTH - 1) * BVH_STACK_SIZE + 1)
 
 #define EMPTY_BONUS 0.5f
 #define ISECT_COST 80.0f
 #define TRAV_COST 2.0f
 
+// A triangle's bounding box begin or end along one axis.
+struct KdBBEvent{
+    float pos;
+    unsigned int triangleID;
+    enum {BEGIN, END} type;
+    // Sorted by position, begins before ends. Ties are broken by triangle ID so that the order is deterministic.
+    inline bool operator<(const KdBBEvent& o) const{
+        if(pos != o.pos) return pos < o.pos;
+        if(type != o.type) return type < o.type;
+        return triangleID < o.triangleID;
+    }
+};
+// Events for all triangles in a node, kept sorted separately for each axis.
+typedef std::array<std::vector<KdBBEvent>, 3> KdEventLists;
+
+struct KdBuildContext;
+
 struct UncompressedKdNode{
     const Scene* parent_scene;
     enum {LEAF, INTERNAL} type = LEAF;
@@ -191,15 +558,18 @@ struct UncompressedKdNode{
     std::pair<float,float> zBB;
     std::vector<unsigned int> triangle_indices;
 
-    void Subdivide(unsigned int max_depth);
+    // Builds the subtree from presorted events. Child subtrees may be handed over to ctx's thread pool, the caller
+    // has to wait for the context to finish. thread_id selects the worker's scratch space in ctx.
+    void Subdivide(KdBuildContext& ctx, KdEventLists events, int thread_id);
     UncompressedKdNode* ch0 = nullptr;
     UncompressedKdNode* ch1 = nullptr;
 
     float prob0, prob1;
 
+    // Triangles this node passed to both children.
     int dups = 0;
-    // Total triangles / leaf nodes / total nodes / total dups
-    std::tuple<int, int, int, int> GetTotals() const;
+    // Total triangles / leaf nodes / total nodes / total dups / largest leaf
+    std::tuple<int, int, int, int, int> GetTotals() const;
 
     void FreeRecursivelly();
 
@@ -215,7 +585,7 @@ struct CompressedKdNode{
     inline float GetSplitPlane() const {return split_plane;}
     inline uint32_t GetTrianglesN() const {return triangles_num >> 2;}
     inline uint32_t GetFirstTrianglePos() const {return triangles_start;}
-    inline uint32_t GetOtherChildIndex() const {return other_child >> 2;}
+    inline uint32_t GetFirstChildIndex() const {return first_child >> 2;}
 
     // Default constructor;
     CompressedKdNode() {}
@@ -230,9 +600,9 @@ struct CompressedKdNode{
         triangles_num = (num << 2) | 0x03;
         triangles_start = start;
     }
-    // Once the other child is placed, it's position has to be set in parent node
-    inline void SetOtherChild(unsigned int pos){
-        other_child = (other_child & 0x03) | (pos << 2);
+    // Once the children are placed, their position has to be set in parent node
+    inline void SetFirstChild(unsigned int pos){
+        first_child = (first_child & 0x03) | (pos << 2);
     }
 
 private:
@@ -241,10 +611,10 @@ private:
         uint32_t triangles_start; // For leaf nodes
     };
     union{
-         // For internal nodes (shifted right 2 bits). One child is
-         // just after this stuct in memory layout, other is at this
-         // location.
-        uint32_t other_child;
+         // For internal nodes (shifted right 2 bits). The children are
+         // a pair of adjacent nodes, the one below the split plane is
+         // at this location.
+        uint32_t first_child;
          // For leaf nodes (shifter right 2 bits).
         uint32_t triangles_num;
         // For any kind of node, 2 LSB.
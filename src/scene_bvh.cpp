@@ -0,0 +1,412 @@
+#include "scene.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <new>
+
+#include "out.hpp"
+
+namespace{
+
+struct BvhBox{
+    glm::vec3 lo = glm::vec3( std::numeric_limits<float>::infinity());
+    glm::vec3 hi = glm::vec3(-std::numeric_limits<float>::infinity());
+    void Extend(const BvhBox& o){
+        lo = glm::min(lo, o.lo);
+        hi = glm::max(hi, o.hi);
+    }
+    void Extend(glm::vec3 p){
+        lo = glm::min(lo, p);
+        hi = glm::max(hi, p);
+    }
+    // Half of the surface area, which is all the SAH needs. Only valid for non-empty boxes.
+    float HalfArea() const{
+        glm::vec3 d = hi - lo;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+};
+
+struct BvhItem{
+    BvhBox box;
+    glm::vec3 centroid;
+    unsigned int index;
+};
+
+struct BvhBuilder{
+    std::vector<BvhItem> items;
+    std::vector<BvhNode> nodes;
+    std::vector<unsigned int> leaf_triangles;
+    // Node boxes are enlarged by this much, so that rounding never makes a ray miss a box around its hit.
+    float pad = 0.0f;
+    // Leaves are padded to, and priced per, groups of this many items.
+    unsigned int leaf_align = KD_LEAF_ALIGN;
+    unsigned int leaves = 0;
+    unsigned int max_depth = 0;
+
+    // Builds the subtree over items [begin, end), reordering them.
+    void Build(unsigned int begin, unsigned int end, unsigned int depth);
+    void MakeLeaf(unsigned int node, unsigned int begin, unsigned int end);
+
+    unsigned int Blocks(unsigned int n) const {return (n + leaf_align - 1) / leaf_align;}
+    static int Bin(float centroid, float cmin, float scale){
+        return std::min(BVH_BINS - 1, (int)((centroid - cmin) * scale));
+    }
+};
+
+void BvhBuilder::MakeLeaf(unsigned int node, unsigned int begin, unsigned int end){
+    nodes[node].offset = leaf_triangles.size();
+    nodes[node].triangles_n = end - begin;
+    nodes[node].axis = 3;
+    for(unsigned int i = begin; i < end; i++)
+        leaf_triangles.push_back(items[i].index);
+    // Pad to a whole number of triangle blocks
+    while(leaf_triangles.size() % leaf_align != 0)
+        leaf_triangles.push_back(-1);
+    leaves++;
+}
+
+void BvhBuilder::Build(unsigned int begin, unsigned int end, unsigned int depth){
+    unsigned int node = nodes.size();
+    nodes.push_back(BvhNode());
+    max_depth = std::max(max_depth, depth);
+
+    BvhBox box, centroids;
+    for(unsigned int i = begin; i < end; i++){
+        box.Extend(items[i].box);
+        centroids.Extend(items[i].centroid);
+    }
+    for(unsigned int k = 0; k < 3; k++){
+        nodes[node].bb_min[k] = box.lo[k] - pad;
+        nodes[node].bb_max[k] = box.hi[k] + pad;
+    }
+
+    unsigned int n = end - begin;
+    if(n <= 1){
+        MakeLeaf(node, begin, end);
+        return;
+    }
+
+    // Find the cheapest split between bins of centroids, along any axis.
+    float best_cost = std::numeric_limits<float>::infinity();
+    int best_axis = -1;
+    int best_bin = 0;
+    if(depth < BVH_MAX_SAH_DEPTH){
+        for(int axis = 0; axis < 3; axis++){
+            float cmin = centroids.lo[axis], extent = centroids.hi[axis] - cmin;
+            if(!(extent > 0.0f)) continue;
+            float scale = BVH_BINS / extent;
+
+            BvhBox bins[BVH_BINS];
+            unsigned int counts[BVH_BINS] = {0};
+            for(unsigned int i = begin; i < end; i++){
+                int b = Bin(items[i].centroid[axis], cmin, scale);
+                counts[b]++;
+                bins[b].Extend(items[i].box);
+            }
+
+            // Area and count of everything right of each bin boundary.
+            float right_area[BVH_BINS];
+            unsigned int right_count[BVH_BINS];
+            BvhBox acc;
+            unsigned int c = 0;
+            for(int b = BVH_BINS - 1; b > 0; b--){
+                acc.Extend(bins[b]);
+                c += counts[b];
+                right_area[b] = c ? acc.HalfArea() : 0.0f;
+                right_count[b] = c;
+            }
+            acc = BvhBox();
+            c = 0;
+            for(int b = 0; b < BVH_BINS - 1; b++){
+                acc.Extend(bins[b]);
+                c += counts[b];
+                // The split between bins b and b + 1.
+                if(c == 0 || right_count[b + 1] == 0) continue;
+                float cost = acc.HalfArea() * Blocks(c) + right_area[b + 1] * Blocks(right_count[b + 1]);
+                if(cost < best_cost){
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+        float area = std::max(box.HalfArea(), std::numeric_limits<float>::min());
+        best_cost = BVH_NODE_COST + BVH_BLOCK_COST * best_cost / area;
+    }
+
+    unsigned int mid;
+    int axis;
+    if(best_axis >= 0 && (best_cost < BVH_BLOCK_COST * Blocks(n) || n > BVH_MAX_LEAF)){
+        axis = best_axis;
+        float cmin = centroids.lo[axis], scale = BVH_BINS / (centroids.hi[axis] - cmin);
+        auto it = std::partition(items.begin() + begin, items.begin() + end, [&](const BvhItem& item){
+                return Bin(item.centroid[axis], cmin, scale) <= best_bin;
+            });
+        mid = it - items.begin();
+    }else if(n > BVH_MAX_LEAF){
+        // There is no usable SAH split (centroids coincide, or the node is too deep), split at the object median
+        // along the longest axis instead.
+        glm::vec3 extent = centroids.hi - centroids.lo;
+        axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+        mid = begin + n / 2;
+        std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                         [axis](const BvhItem& a, const BvhItem& b){ return a.centroid[axis] < b.centroid[axis]; });
+    }else{
+        MakeLeaf(node, begin, end);
+        return;
+    }
+
+    nodes[node].axis = axis;
+    nodes[node].triangles_n = 0;
+    Build(begin, mid, depth + 1);
+    nodes[node].offset = nodes.size();
+    Build(mid, end, depth + 1);
+}
+
+// Collapses the binary BVH into a wide one, by repeatedly replacing the child with the largest surface area by its
+// own two children, until a node has SIMD_WIDTH children.
+struct WideBvhCollapser{
+    const std::vector<BvhNode>& nodes;
+    // Binary nodes which became the children of each wide node, in the order wide nodes are created.
+    std::vector<std::array<uint32_t, SIMD_WIDTH>> children;
+    std::vector<unsigned int> children_n;
+    std::vector<std::array<uint32_t, 8>> orders;
+    // The wide node created for each internal binary node.
+    std::vector<uint32_t> wide_index;
+
+    explicit WideBvhCollapser(const std::vector<BvhNode>& n) : nodes(n), wide_index(n.size(), 0) {}
+
+    float HalfArea(uint32_t b) const{
+        const BvhNode& node = nodes[b];
+        glm::vec3 d(node.bb_max[0] - node.bb_min[0], node.bb_max[1] - node.bb_min[1], node.bb_max[2] - node.bb_min[2]);
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    void Collapse(uint32_t b);
+    // Appends the children found below binary node b to order, in the order a ray with the given octant would
+    // visit them in the binary tree.
+    void Order(uint32_t b, unsigned int octant, const uint32_t* slots, unsigned int n, uint32_t& order, unsigned int& k) const;
+};
+
+void WideBvhCollapser::Collapse(uint32_t b){
+    uint32_t slots[SIMD_WIDTH];
+    unsigned int n = 0;
+    if(nodes[b].IsLeaf()){
+        // Only possible at the root.
+        slots[n++] = b;
+    }else{
+        slots[n++] = b + 1;
+        slots[n++] = nodes[b].offset;
+    }
+    while(n < SIMD_WIDTH){
+        int best = -1;
+        float best_area = -1.0f;
+        for(unsigned int i = 0; i < n; i++){
+            if(nodes[slots[i]].IsLeaf()) continue;
+            float area = HalfArea(slots[i]);
+            if(area > best_area){
+                best = i;
+                best_area = area;
+            }
+        }
+        if(best < 0) break;
+        uint32_t opened = slots[best];
+        slots[best] = opened + 1;
+        slots[n++] = nodes[opened].offset;
+    }
+
+    std::array<uint32_t, 8> order;
+    for(unsigned int octant = 0; octant < 8; octant++){
+        order[octant] = 0;
+        unsigned int k = 0;
+        Order(b, octant, slots, n, order[octant], k);
+        // Unused children go last.
+        for(unsigned int i = n; i < SIMD_WIDTH; i++, k++)
+            order[octant] |= i << (4 * k);
+    }
+
+    wide_index[b] = children.size();
+    children.push_back(std::array<uint32_t, SIMD_WIDTH>());
+    std::copy(slots, slots + n, children.back().begin());
+    children_n.push_back(n);
+    orders.push_back(order);
+
+    for(unsigned int i = 0; i < n; i++)
+        if(!nodes[slots[i]].IsLeaf()) Collapse(slots[i]);
+}
+
+void WideBvhCollapser::Order(uint32_t b, unsigned int octant, const uint32_t* slots, unsigned int n,
+                             uint32_t& order, unsigned int& k) const{
+    for(unsigned int i = 0; i < n; i++){
+        if(slots[i] == b){
+            order |= i << (4 * k);
+            k++;
+            return;
+        }
+    }
+    // The node was opened, so it is internal.
+    uint32_t first = b + 1, second = nodes[b].offset;
+    if((octant >> nodes[b].axis) & 1) std::swap(first, second);
+    Order(first,  octant, slots, n, order, k);
+    Order(second, octant, slots, n, order, k);
+}
+
+} // namespace
+
+void Scene::BuildBvh(){
+    FreeCompressedTree();
+
+    out::cout(3) << "Building BVH with " << BVH_BINS << " SAH bins..." << std::endl;
+    auto build_start = std::chrono::high_resolution_clock::now();
+
+    BvhBuilder builder;
+    builder.pad = epsilon;
+    builder.items.resize(n_world_triangles);
+    for(unsigned int i = 0; i < n_world_triangles; i++){
+        BvhItem& item = builder.items[i];
+        item.box.lo = glm::vec3(xevents[2*i + 0], yevents[2*i + 0], zevents[2*i + 0]);
+        item.box.hi = glm::vec3(xevents[2*i + 1], yevents[2*i + 1], zevents[2*i + 1]);
+        item.centroid = (item.box.lo + item.box.hi) * 0.5f;
+        item.index = i;
+    }
+    builder.nodes.reserve(2 * n_world_triangles);
+    builder.Build(0, n_world_triangles, 0);
+
+    // Nodes are aligned to a cache line, so that no node straddles two. Like new, a failed allocation throws.
+    void* mem = nullptr;
+    if(accel == AccelStructure::WideBvh){
+        WideBvhCollapser collapser(builder.nodes);
+        collapser.Collapse(0);
+        if(posix_memalign(&mem, 64, collapser.children.size() * sizeof(WideBvhNode)) != 0) throw std::bad_alloc();
+        wide_bvh_nodes = static_cast<WideBvhNode*>(mem);
+        wide_bvh_nodes_size = collapser.children.size();
+        const float inf = std::numeric_limits<float>::infinity();
+        unsigned int children_total = 0;
+        for(unsigned int w = 0; w < wide_bvh_nodes_size; w++){
+            WideBvhNode& wide = wide_bvh_nodes[w];
+            for(unsigned int i = 0; i < SIMD_WIDTH; i++){
+                bool used = i < collapser.children_n[w];
+                const BvhNode& node = builder.nodes[used ? collapser.children[w][i] : 0];
+                for(unsigned int k = 0; k < 3; k++){
+                    wide.bb_min[k][i] = used ? node.bb_min[k] :  inf;
+                    wide.bb_max[k][i] = used ? node.bb_max[k] : -inf;
+                }
+                wide.child[i] = !used ? 0 :
+                    node.IsLeaf() ? (WIDE_BVH_LEAF | node.offset) : collapser.wide_index[collapser.children[w][i]];
+                wide.triangles_n[i] = (used && node.IsLeaf()) ? node.triangles_n : 0;
+            }
+            std::copy(collapser.orders[w].begin(), collapser.orders[w].end(), wide.order);
+            children_total += collapser.children_n[w];
+        }
+        out::cout(3) << "Collapsed " << builder.nodes.size() << " BVH nodes into " << wide_bvh_nodes_size << " nodes "
+                     << "with " << (float)children_total / wide_bvh_nodes_size << " children on average" << std::endl;
+    }else{
+        if(posix_memalign(&mem, 64, builder.nodes.size() * sizeof(BvhNode)) != 0) throw std::bad_alloc();
+        bvh_nodes = static_cast<BvhNode*>(mem);
+        bvh_nodes_size = builder.nodes.size();
+        std::copy(builder.nodes.begin(), builder.nodes.end(), bvh_nodes);
+    }
+
+    compressed_triangles_size = builder.leaf_triangles.size();
+    compressed_triangles = new unsigned int[std::max(1u, compressed_triangles_size)];
+    std::copy(builder.leaf_triangles.begin(), builder.leaf_triangles.end(), compressed_triangles);
+
+    BuildTriangleBlocks();
+
+    auto build_end = std::chrono::high_resolution_clock::now();
+    float build_time = std::chrono::duration<float>(build_end - build_start).count();
+    out::cout(3) << "BVH built in " << build_time << "s (" << (int)(n_world_triangles / std::max(build_time, 1e-6f)) << " triangles/s)" << std::endl;
+    out::cout(3) << "Total nodes: " << builder.nodes.size() << ", total leafs: " << builder.leaves << ", max depth: " << builder.max_depth << std::endl;
+    out::cout(3) << "Total BVH size: " << (sizeof(BvhNode)*bvh_nodes_size + sizeof(WideBvhNode)*wide_bvh_nodes_size)/1024 << "kiB " << std::endl;
+}
+
+void Scene::GetInstanceBounds(const Instance& instance, glm::vec3& lo, glm::vec3& hi) const{
+    const InstancedMesh& mesh = meshes[instance.mesh];
+    lo = glm::vec3( std::numeric_limits<float>::infinity());
+    hi = glm::vec3(-std::numeric_limits<float>::infinity());
+    if(mesh.triangles_n == 0) return;
+    for(unsigned int corner = 0; corner < 8; corner++){
+        glm::vec3 p((corner & 1) ? mesh.bb_max[0] : mesh.bb_min[0],
+                    (corner & 2) ? mesh.bb_max[1] : mesh.bb_min[1],
+                    (corner & 4) ? mesh.bb_max[2] : mesh.bb_min[2]);
+        p = (instance.to_world * glm::vec4(p, 1.0f)).xyz();
+        lo = glm::min(lo, p);
+        hi = glm::max(hi, p);
+    }
+}
+
+void Scene::BuildInstances(){
+    if(instances.empty()) return;
+
+    out::cout(3) << "Building BVHs for " << meshes.size() << " instanced meshes and " << instances.size() << " instances..." << std::endl;
+    auto build_start = std::chrono::high_resolution_clock::now();
+
+    // Mesh leaves are appended to the scene structure's leaves, so that they share the triangle blocks.
+    std::vector<unsigned int> leaf_triangles(compressed_triangles, compressed_triangles + compressed_triangles_size);
+    std::vector<BvhNode> nodes;
+    for(InstancedMesh& mesh : meshes){
+        BvhBuilder builder;
+        // Object space can be scaled very differently from the world, pad boxes relative to the mesh's own size.
+        glm::vec3 size(mesh.bb_max[0] - mesh.bb_min[0], mesh.bb_max[1] - mesh.bb_min[1], mesh.bb_max[2] - mesh.bb_min[2]);
+        builder.pad = mesh.triangles_n ? 0.00001f * glm::length(size) : 0.0f;
+        builder.items.resize(mesh.triangles_n);
+        for(unsigned int i = 0; i < mesh.triangles_n; i++){
+            unsigned int t = mesh.first_triangle + i;
+            BvhItem& item = builder.items[i];
+            item.box.lo = glm::vec3(xevents[2*t + 0], yevents[2*t + 0], zevents[2*t + 0]);
+            item.box.hi = glm::vec3(xevents[2*t + 1], yevents[2*t + 1], zevents[2*t + 1]);
+            item.centroid = (item.box.lo + item.box.hi) * 0.5f;
+            item.index = t;
+        }
+        // Leaf offsets come out as positions in the shared array.
+        builder.leaf_triangles = std::move(leaf_triangles);
+        builder.Build(0, mesh.triangles_n, 0);
+        leaf_triangles = std::move(builder.leaf_triangles);
+        mesh.root = nodes.size();
+        nodes.insert(nodes.end(), builder.nodes.begin(), builder.nodes.end());
+    }
+
+    BvhBuilder top;
+    top.pad = epsilon;
+    top.leaf_align = 1;
+    top.items.resize(instances.size());
+    for(unsigned int i = 0; i < instances.size(); i++){
+        BvhItem& item = top.items[i];
+        GetInstanceBounds(instances[i], item.box.lo, item.box.hi);
+        item.centroid = (item.box.lo + item.box.hi) * 0.5f;
+        item.index = i;
+    }
+    top.Build(0, instances.size(), 0);
+
+    void* mem = nullptr;
+    if(posix_memalign(&mem, 64, std::max<size_t>(1, nodes.size()) * sizeof(BvhNode)) != 0) throw std::bad_alloc();
+    mesh_bvh_nodes = static_cast<BvhNode*>(mem);
+    mesh_bvh_nodes_size = nodes.size();
+    std::copy(nodes.begin(), nodes.end(), mesh_bvh_nodes);
+    if(posix_memalign(&mem, 64, top.nodes.size() * sizeof(BvhNode)) != 0) throw std::bad_alloc();
+    instance_bvh_nodes = static_cast<BvhNode*>(mem);
+    instance_bvh_nodes_size = top.nodes.size();
+    std::copy(top.nodes.begin(), top.nodes.end(), instance_bvh_nodes);
+    instance_indices_size = top.leaf_triangles.size();
+    instance_indices = new unsigned int[instance_indices_size];
+    std::copy(top.leaf_triangles.begin(), top.leaf_triangles.end(), instance_indices);
+
+    delete[] compressed_triangles;
+    compressed_triangles_size = leaf_triangles.size();
+    compressed_triangles = new unsigned int[compressed_triangles_size];
+    std::copy(leaf_triangles.begin(), leaf_triangles.end(), compressed_triangles);
+    if(compressed_blocks) free(compressed_blocks);
+    compressed_blocks = nullptr;
+    BuildTriangleBlocks();
+
+    auto build_end = std::chrono::high_resolution_clock::now();
+    float build_time = std::chrono::duration<float>(build_end - build_start).count();
+    unsigned int instanced_triangles = 0;
+    for(const Instance& instance : instances) instanced_triangles += meshes[instance.mesh].triangles_n;
+    out::cout(3) << "Instance BVHs built in " << build_time << "s, " << mesh_bvh_nodes_size << " mesh nodes, "
+                 << instance_bvh_nodes_size << " instance nodes" << std::endl;
+    out::cout(2) << "Placed " << instances.size() << " instances of " << meshes.size() << " meshes, with "
+                 << n_triangles - n_world_triangles << " unique triangles standing for " << instanced_triangles << std::endl;
+}
@@ -0,0 +1,417 @@
+#include "scene.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "out.hpp"
+#include "bxdf/bxdf.hpp"
+
+// The scene cache is a single file: a header, followed by sections. Every section starts at an offset aligned to
+// SCENE_CACHE_ALIGN, so that once the file is mapped, arrays can be used in place, including the SIMD triangle
+// blocks. Nothing is modified after mapping, and the mapping is private, so that nothing could ever reach the file.
+
+// Bump whenever the layout of the file, or of any structure stored in it, changes.
+#define SCENE_CACHE_VERSION 9
+#define SCENE_CACHE_ALIGN 64
+
+namespace{
+
+enum CacheSectionID{
+    CACHE_VERTICES,
+    // Packed, if the header says attributes are compressed.
+    CACHE_NORMALS,
+    CACHE_TANGENTS,
+    CACHE_TEXCOORDS,
+    CACHE_TRIANGLES,
+    // Material IDs, indices into the material name table.
+    CACHE_TRIANGLE_MATERIALS,
+    CACHE_KD_NODES,
+    CACHE_KD_TRIANGLES,
+    CACHE_KD_BLOCKS,
+    // Empty unless the BVH is used instead of the kd-tree. The kd sections then hold its leaf triangles.
+    CACHE_BVH_NODES,
+    // Empty unless the wide BVH is used.
+    CACHE_WIDE_BVH_NODES,
+    // Instancing, empty if the scene has no instances.
+    CACHE_MESHES,
+    CACHE_INSTANCES,
+    CACHE_MESH_BVH_NODES,
+    CACHE_INSTANCE_BVH_NODES,
+    CACHE_INSTANCE_INDICES,
+    // Material name table, followed by imported materials.
+    CACHE_MATERIALS,
+    // Triangle indices of each areal light.
+    CACHE_LIGHTS,
+    CACHE_SECTIONS_N
+};
+
+struct CacheSection{
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct CacheHeader{
+    char magic[8];
+    uint32_t version;
+    // Layout details which depend on build options.
+    uint32_t simd_width;
+    uint32_t leaf_align;
+    uint32_t triangle_size;
+    uint32_t accel;
+    uint32_t kd_clip_triangles;
+    uint32_t compressed_attributes;
+    uint32_t world_triangles;
+    uint64_t key;
+    float epsilon;
+    float bb[6];
+    CacheSection sections[CACHE_SECTIONS_N];
+};
+
+const char cache_magic[8] = {'R','G','K','S','C','N','\n','\0'};
+
+// Serializes variable-size data (strings, lists) into a section.
+struct BlobWriter{
+    std::vector<char> data;
+    void Put(const void* p, size_t size){
+        data.insert(data.end(), (const char*)p, (const char*)p + size);
+    }
+    template <typename T>
+    void Put(const T& x) {Put(&x, sizeof(T));}
+    void PutString(const std::string& s){
+        Put((uint32_t)s.size());
+        Put(s.data(), s.size());
+    }
+};
+
+struct BlobReader{
+    BlobReader(const char* p, size_t size) : p(p), end(p + size) {}
+    const char* p;
+    const char* end;
+    // Set once anything is read past the end.
+    bool failed = false;
+    void Get(void* out, size_t size){
+        if(failed || (size_t)(end - p) < size){
+            failed = true;
+            return;
+        }
+        memcpy(out, p, size);
+        p += size;
+    }
+    template <typename T>
+    T Get(){
+        T x = T();
+        Get(&x, sizeof(T));
+        return x;
+    }
+    std::string GetString(){
+        uint32_t n = Get<uint32_t>();
+        if(failed || (size_t)(end - p) < n){
+            failed = true;
+            return "";
+        }
+        std::string s(p, n);
+        p += n;
+        return s;
+    }
+};
+
+void PutImportedMaterial(BlobWriter& w, const ImportedMaterial& m){
+    w.PutString(m.name);
+    w.Put(m.diffuse);
+    w.Put(m.specular);
+    w.Put(m.emission);
+    w.PutString(m.diffuse_texture);
+    w.PutString(m.specular_texture);
+    w.PutString(m.bump_texture);
+    w.Put(m.shininess);
+}
+
+ImportedMaterial GetImportedMaterial(BlobReader& r){
+    ImportedMaterial m;
+    m.name = r.GetString();
+    m.diffuse = r.Get<Color>();
+    m.specular = r.Get<Color>();
+    m.emission = r.Get<Radiance>();
+    m.diffuse_texture = r.GetString();
+    m.specular_texture = r.GetString();
+    m.bump_texture = r.GetString();
+    m.shininess = r.Get<float>();
+    return m;
+}
+
+} // namespace
+
+void Scene::SetCacheFile(std::string path, uint64_t key){
+    cache_file = path;
+    cache_key = key;
+}
+
+void Scene::SaveCache() const{
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = SCENE_CACHE_VERSION;
+    header.simd_width = SIMD_WIDTH;
+    header.leaf_align = KD_LEAF_ALIGN;
+    header.triangle_size = sizeof(Triangle);
+    header.accel = (uint32_t)accel;
+    header.kd_clip_triangles = kd_clip_triangles;
+    header.compressed_attributes = compress_attributes;
+    header.world_triangles = n_world_triangles;
+    header.key = cache_key;
+    header.epsilon = epsilon;
+    header.bb[0] = xBB.first; header.bb[1] = xBB.second;
+    header.bb[2] = yBB.first; header.bb[3] = yBB.second;
+    header.bb[4] = zBB.first; header.bb[5] = zBB.second;
+
+    // Materials are referenced by name, as they are recreated on load. Material IDs are stored as they are, the
+    // table of names restores their meaning.
+    BlobWriter materials_blob;
+    materials_blob.Put((uint32_t)material_table.size());
+    for(const auto& m : material_table) materials_blob.PutString(m->name);
+    materials_blob.Put((uint32_t)imported_materials.size());
+    for(const auto& p : imported_materials){
+        PutImportedMaterial(materials_blob, p.first);
+        materials_blob.Put((uint8_t)p.second);
+    }
+
+    BlobWriter lights_blob;
+    lights_blob.Put((uint32_t)areal_lights.size());
+    for(const auto& q : areal_lights){
+        lights_blob.Put((uint32_t)q.second.triangles_with_areas.size());
+        for(const auto& p : q.second.triangles_with_areas) lights_blob.Put((uint32_t)p.second);
+    }
+
+#ifndef NO_SIMD_LEAVES
+    size_t n_blocks = compressed_triangles_size / SIMD_WIDTH;
+#else
+    size_t n_blocks = 0;
+#endif
+
+    const void* section_data[CACHE_SECTIONS_N] = {
+        vertices,
+        compress_attributes ? (const void*)packed_normals : normals,
+        compress_attributes ? (const void*)packed_tangents : tangents,
+        compress_attributes ? (const void*)packed_texcoords : texcoords,
+        triangles, triangle_materials,
+        compressed_array, compressed_triangles, compressed_blocks, bvh_nodes, wide_bvh_nodes,
+        meshes.data(), instances.data(), mesh_bvh_nodes, instance_bvh_nodes, instance_indices,
+        materials_blob.data.data(), lights_blob.data.data()
+    };
+    size_t section_size[CACHE_SECTIONS_N] = {
+        n_vertices * sizeof(glm::vec3),
+        n_normals * (compress_attributes ? sizeof(uint32_t) : sizeof(glm::vec3)),
+        n_tangents * (compress_attributes ? sizeof(uint32_t) : sizeof(glm::vec3)),
+        n_texcoords * (compress_attributes ? sizeof(uint32_t) : sizeof(glm::vec2)),
+        n_triangles * sizeof(Triangle), n_triangles * sizeof(uint16_t),
+        compressed_array_size * sizeof(CompressedKdNode), compressed_triangles_size * sizeof(unsigned int),
+        n_blocks * sizeof(TriangleBlock), bvh_nodes_size * sizeof(BvhNode),
+        wide_bvh_nodes_size * sizeof(WideBvhNode),
+        meshes.size() * sizeof(InstancedMesh), instances.size() * sizeof(Instance),
+        mesh_bvh_nodes_size * sizeof(BvhNode), instance_bvh_nodes_size * sizeof(BvhNode),
+        instance_indices_size * sizeof(unsigned int),
+        materials_blob.data.size(), lights_blob.data.size()
+    };
+    uint64_t pos = sizeof(CacheHeader);
+    for(unsigned int i = 0; i < CACHE_SECTIONS_N; i++){
+        pos = (pos + SCENE_CACHE_ALIGN - 1) / SCENE_CACHE_ALIGN * SCENE_CACHE_ALIGN;
+        header.sections[i].offset = pos;
+        header.sections[i].size = section_size[i];
+        pos += section_size[i];
+    }
+
+    // Written under a temporary name and renamed, so that concurrent runs never map a partially written file.
+    std::string tmp_path = cache_file + ".tmp" + std::to_string(getpid());
+    std::ofstream file(tmp_path, std::ios::binary);
+    if(!file){
+        out::cout(2) << "WARNING: Unable to write scene cache \"" << cache_file << "\"" << std::endl;
+        return;
+    }
+    file.write((const char*)&header, sizeof(header));
+    const char zeros[SCENE_CACHE_ALIGN] = {0};
+    for(unsigned int i = 0; i < CACHE_SECTIONS_N; i++){
+        file.write(zeros, header.sections[i].offset - file.tellp());
+        if(section_size[i] > 0) file.write((const char*)section_data[i], section_size[i]);
+    }
+    file.close();
+    if(!file || rename(tmp_path.c_str(), cache_file.c_str()) != 0){
+        out::cout(2) << "WARNING: Unable to write scene cache \"" << cache_file << "\"" << std::endl;
+        unlink(tmp_path.c_str());
+        return;
+    }
+    out::cout(3) << "Wrote scene cache \"" << cache_file << "\" (" << pos/1024 << "kiB)" << std::endl;
+}
+
+bool Scene::LoadCache(std::string path, uint64_t key){
+    cache_file = path;
+    cache_key = key;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)){
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) return false;
+    const char* base = (const char*)mapping;
+
+    auto reject = [&](std::string reason){
+        out::cout(2) << "Scene cache \"" << path << "\" " << reason << ", rebuilding it." << std::endl;
+        munmap(mapping, size);
+        return false;
+    };
+
+    const CacheHeader& header = *(const CacheHeader*)base;
+    if(memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 ||
+       header.version != SCENE_CACHE_VERSION ||
+       header.simd_width != SIMD_WIDTH ||
+       header.leaf_align != KD_LEAF_ALIGN ||
+       header.triangle_size != sizeof(Triangle))
+        return reject("was written by a different build");
+    if(header.key != key || header.accel != (uint32_t)accel || header.kd_clip_triangles != kd_clip_triangles ||
+       header.compressed_attributes != compress_attributes)
+        return reject("is out of date");
+    for(unsigned int i = 0; i < CACHE_SECTIONS_N; i++){
+        const CacheSection& s = header.sections[i];
+        if(s.offset % SCENE_CACHE_ALIGN != 0 || s.offset > size || s.size > size - s.offset)
+            return reject("is damaged");
+    }
+    auto section = [&](CacheSectionID id){ return (void*)(base + header.sections[id].offset); };
+    auto count = [&](CacheSectionID id, size_t elem){ return (unsigned int)(header.sections[id].size / elem); };
+
+    // Re-register imported materials in their original order, so that names resolve as they did originally.
+    BlobReader materials_blob((const char*)section(CACHE_MATERIALS), header.sections[CACHE_MATERIALS].size);
+    std::vector<std::string> material_names(materials_blob.Get<uint32_t>());
+    for(std::string& name : material_names) name = materials_blob.GetString();
+    std::vector<std::pair<ImportedMaterial, bool>> imported(materials_blob.Get<uint32_t>());
+    for(auto& p : imported){
+        p.first = GetImportedMaterial(materials_blob);
+        p.second = materials_blob.Get<uint8_t>();
+    }
+    BlobReader lights_blob((const char*)section(CACHE_LIGHTS), header.sections[CACHE_LIGHTS].size);
+    std::vector<std::vector<uint32_t>> lights(lights_blob.Get<uint32_t>());
+    for(auto& l : lights){
+        l.resize(lights_blob.Get<uint32_t>());
+        for(uint32_t& i : l) i = lights_blob.Get<uint32_t>();
+    }
+    if(materials_blob.failed || lights_blob.failed)
+        return reject("is damaged");
+    unsigned int triangles_n = count(CACHE_TRIANGLES, sizeof(Triangle));
+    const uint16_t* cached_materials = (const uint16_t*)section(CACHE_TRIANGLE_MATERIALS);
+    if(count(CACHE_TRIANGLE_MATERIALS, sizeof(uint16_t)) != triangles_n)
+        return reject("is damaged");
+    for(unsigned int i = 0; i < triangles_n; i++)
+        if(cached_materials[i] >= material_names.size()) return reject("is damaged");
+    for(const auto& l : lights)
+        for(uint32_t i : l)
+            if(i >= triangles_n) return reject("is damaged");
+    const InstancedMesh* cached_meshes = (const InstancedMesh*)section(CACHE_MESHES);
+    unsigned int meshes_n = count(CACHE_MESHES, sizeof(InstancedMesh));
+    const Instance* cached_instances = (const Instance*)section(CACHE_INSTANCES);
+    unsigned int instances_n = count(CACHE_INSTANCES, sizeof(Instance));
+    if(header.world_triangles > triangles_n)
+        return reject("is damaged");
+    for(unsigned int i = 0; i < meshes_n; i++)
+        if(cached_meshes[i].first_triangle + cached_meshes[i].triangles_n > triangles_n) return reject("is damaged");
+    for(unsigned int i = 0; i < instances_n; i++)
+        if(cached_instances[i].mesh >= meshes_n) return reject("is damaged");
+
+    for(const auto& p : imported){
+        auto m = std::make_shared<Material>();
+        m->LoadFromImported(p.first, *this);
+        RegisterMaterial(m, p.second);
+        imported_materials.push_back(p);
+    }
+    for(const std::string& name : material_names){
+        if(materials_by_name.find(name) == materials_by_name.end()){
+            imported_materials.clear();
+            return reject("uses a material that is no longer defined (\"" + name + "\")");
+        }
+    }
+    material_table.clear();
+    material_ids.clear();
+    for(const std::string& name : material_names){
+        material_ids[GetMaterialByName(name).get()] = material_table.size();
+        material_table.push_back(GetMaterialByName(name));
+    }
+
+    FreeBuffers();
+    FreeCompressedTree();
+    cache_mapping = mapping;
+    cache_mapping_size = size;
+
+    vertices  = (glm::vec3*)section(CACHE_VERTICES);
+    n_vertices = count(CACHE_VERTICES, sizeof(glm::vec3));
+    if(compress_attributes){
+        packed_normals   = (uint32_t*)section(CACHE_NORMALS);
+        n_normals = count(CACHE_NORMALS, sizeof(uint32_t));
+        packed_tangents  = (uint32_t*)section(CACHE_TANGENTS);
+        n_tangents = count(CACHE_TANGENTS, sizeof(uint32_t));
+        packed_texcoords = (uint32_t*)section(CACHE_TEXCOORDS);
+        n_texcoords = count(CACHE_TEXCOORDS, sizeof(uint32_t));
+    }else{
+        normals   = (glm::vec3*)section(CACHE_NORMALS);
+        n_normals = count(CACHE_NORMALS, sizeof(glm::vec3));
+        tangents  = (glm::vec3*)section(CACHE_TANGENTS);
+        n_tangents = count(CACHE_TANGENTS, sizeof(glm::vec3));
+        texcoords = (glm::vec2*)section(CACHE_TEXCOORDS);
+        n_texcoords = count(CACHE_TEXCOORDS, sizeof(glm::vec2));
+    }
+    triangles = (Triangle*)section(CACHE_TRIANGLES);
+    n_triangles = count(CACHE_TRIANGLES, sizeof(Triangle));
+    triangle_materials = (uint16_t*)section(CACHE_TRIANGLE_MATERIALS);
+    compressed_array = (CompressedKdNode*)section(CACHE_KD_NODES);
+    compressed_array_size = count(CACHE_KD_NODES, sizeof(CompressedKdNode));
+    compressed_triangles = (unsigned int*)section(CACHE_KD_TRIANGLES);
+    compressed_triangles_size = count(CACHE_KD_TRIANGLES, sizeof(unsigned int));
+#ifndef NO_SIMD_LEAVES
+    compressed_blocks = (TriangleBlock*)section(CACHE_KD_BLOCKS);
+#endif
+    bvh_nodes = (BvhNode*)section(CACHE_BVH_NODES);
+    bvh_nodes_size = count(CACHE_BVH_NODES, sizeof(BvhNode));
+    wide_bvh_nodes = (WideBvhNode*)section(CACHE_WIDE_BVH_NODES);
+    wide_bvh_nodes_size = count(CACHE_WIDE_BVH_NODES, sizeof(WideBvhNode));
+    n_world_triangles = header.world_triangles;
+    meshes.assign(cached_meshes, cached_meshes + meshes_n);
+    instances.assign(cached_instances, cached_instances + instances_n);
+    mesh_bvh_nodes = (BvhNode*)section(CACHE_MESH_BVH_NODES);
+    mesh_bvh_nodes_size = count(CACHE_MESH_BVH_NODES, sizeof(BvhNode));
+    instance_bvh_nodes = (BvhNode*)section(CACHE_INSTANCE_BVH_NODES);
+    instance_bvh_nodes_size = count(CACHE_INSTANCE_BVH_NODES, sizeof(BvhNode));
+    instance_indices = (unsigned int*)section(CACHE_INSTANCE_INDICES);
+    instance_indices_size = count(CACHE_INSTANCE_INDICES, sizeof(unsigned int));
+
+    areal_lights.clear();
+    for(const auto& l : lights){
+        ArealLight al;
+        for(uint32_t i : l) al.triangles_with_areas.push_back(std::make_pair(0.0f, i));
+        areal_lights.push_back(std::make_pair(0.0f, al));
+    }
+
+    epsilon = header.epsilon;
+    xBB = std::make_pair(header.bb[0], header.bb[1]);
+    yBB = std::make_pair(header.bb[2], header.bb[3]);
+    zBB = std::make_pair(header.bb[4], header.bb[5]);
+
+    const char* accel_name = accel == AccelStructure::WideBvh ? "wide BVH" : accel == AccelStructure::Bvh ? "BVH" : "kD-tree";
+    out::cout(2) << "Loaded " << n_triangles << " triangles and the " << accel_name
+                 << " from scene cache \"" << path << "\"" << std::endl;
+    return true;
+}
+
+void Scene::FreeCache(){
+    if(!cache_mapping) return;
+    munmap(cache_mapping, cache_mapping_size);
+    cache_mapping = nullptr;
+    cache_mapping_size = 0;
+}
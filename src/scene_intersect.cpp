@@ -1,19 +1,159 @@
 #include "scene.hpp"
 #include "bxdf/bxdf.hpp"
+#include "simd.hpp"
+
+// A ray, prepared for testing against leaf triangles.
+struct LeafRay{
+    LeafRay(const Ray& r, const Triangle* ignored, const Triangle* triangles) : r(r), ignored(ignored), shear(r){
+#ifndef NO_SIMD_LEAVES
+        for(int i = 0; i < 3; i++)
+            org[i] = vfloat_set1(r.origin[i]);
+        sx = vfloat_set1(shear.sx);
+        sy = vfloat_set1(shear.sy);
+        sz = vfloat_set1(shear.sz);
+        ignored_index = vmask_set1i(ignored ? (int32_t)(ignored - triangles) : -2);
+#else
+        (void)triangles;
+#endif
+    }
+    const Ray& r;
+    const Triangle* ignored;
+    const RayShear shear;
+#ifndef NO_SIMD_LEAVES
+    vfloat org[3];
+    vfloat sx, sy, sz;
+    vmask ignored_index;
+#endif
+};
+
+#ifndef NO_SIMD_LEAVES
+// The watertight test of Triangle::TestIntersection, for a single ray against all triangles in a block. Returns the
+// mask of lanes that were hit, t and the barycentric coordinates of vertices B and C are valid in these lanes.
+static inline vmask IntersectBlock(const TriangleBlock& __restrict__ blk, const LeafRay& __restrict__ lr,
+                                   vfloat& t, vfloat& u, vfloat& v){
+    const int kx = lr.shear.kx, ky = lr.shear.ky, kz = lr.shear.kz;
+    const vfloat az = blk.v0[kz] - lr.org[kz], bz = blk.v1[kz] - lr.org[kz], cz = blk.v2[kz] - lr.org[kz];
+    const vfloat ax = blk.v0[kx] - lr.org[kx] - lr.sx * az, ay = blk.v0[ky] - lr.org[ky] - lr.sy * az;
+    const vfloat bx = blk.v1[kx] - lr.org[kx] - lr.sx * bz, by = blk.v1[ky] - lr.org[ky] - lr.sy * bz;
+    const vfloat cx = blk.v2[kx] - lr.org[kx] - lr.sx * cz, cy = blk.v2[ky] - lr.org[ky] - lr.sy * cz;
+    const vfloat U = cx * by - cy * bx;
+    const vfloat V = ax * cy - ay * cx;
+    const vfloat W = bx * ay - by * ax;
+    const vfloat det = U + V + W;
+    const vfloat inv = 1.0f / det;
+    t = (U * az + V * bz + W * cz) * lr.sz * inv;
+    u = V * inv;
+    v = W * inv;
+    // Unused lanes, and rays in a triangle's plane, have det == 0. NaNs, from degenerate triangles, fail the sign
+    // tests.
+    const vfloat zero = vfloat_set1(0.0f);
+    return (((U >= zero) & (V >= zero) & (W >= zero)) | ((U <= zero) & (V <= zero) & (W <= zero))) & (det != zero);
+}
+#endif // NO_SIMD_LEAVES
+
+template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+inline bool Scene::IntersectLeaf(const LeafRay& __restrict__ lr, uint32_t tri_start, unsigned int n, float lo, float hi,
+                                 Intersection& res) __restrict__ const{
+    bool hit = false;
+#ifndef NO_SIMD_LEAVES
+    const vfloat vlo = vfloat_set1(lo), vhi = vfloat_set1(hi);
+    const TriangleBlock* blk = compressed_blocks + tri_start / SIMD_WIDTH;
+    const TriangleBlock* blk_end = blk + (n + SIMD_WIDTH - 1) / SIMD_WIDTH;
+    for(; blk != blk_end; blk++){
+        vfloat t, a, b;
+        vmask m = IntersectBlock(*blk, lr, t, a, b);
+
+        // Skip the triangle if it matches ignore condition
+        if(IgnoreTriangle) m &= (blk->index != lr.ignored_index);
+        if(!vany(m)) continue;
+
+        // Skip triangles with materials in thinglass set, but add them to the intersection
+        if(Thinglass){
+            for(unsigned int l = 0; l < SIMD_WIDTH; l++){
+                if(!m[l]) continue;
+                if(GetMaterial(blk->index[l]).is_thinglass){
+                    if(!AnyHit) res.thinglass->push_back(std::make_pair(&triangles[blk->index[l]],t[l]));
+                    m[l] = 0;
+                }
+            }
+        }
+        m &= (t >= vlo) & (t <= vhi);
+        if(AnyHit){
+            // Ignore whether this is the nearest intersection, we are looking for ANY.
+            for(unsigned int l = 0; l < SIMD_WIDTH; l++){
+                if(m[l]){
+                    res.triangle = &triangles[blk->index[l]];
+                    return true;
+                }
+            }
+            continue;
+        }
+        m &= (t < vfloat_set1(res.t));
+        if(!vany(m)) continue;
+        // New closest intersect!
+        unsigned int best = SIMD_WIDTH;
+        for(unsigned int l = 0; l < SIMD_WIDTH; l++)
+            if(m[l] && (best == SIMD_WIDTH || t[l] < t[best])) best = l;
+        res.triangle = &triangles[blk->index[best]];
+        res.t = t[best];
+        res.a = 1.0f - a[best] - b[best];
+        res.b = a[best];
+        res.c = b[best];
+        hit = true;
+    }
+#else
+    for(unsigned int p = 0; p < n; p++){
+        // For each triangle ...
+        unsigned int i = compressed_triangles[tri_start + p];
+        const Triangle& tri = triangles[i];
+        float t, a, b;
+
+        // Skip the triangle if it matches ignore condition
+        if(IgnoreTriangle && &tri == lr.ignored) continue;
+
+        //  ... test for an intersection
+        if(tri.TestIntersection(lr.r, lr.shear, vertices, t, a, b)){
+
+            // Skip the triangle, if the material is in thinglass set
+            if(Thinglass && GetMaterial(i).is_thinglass){
+                // Add this triangle data to intersection.
+                if(!AnyHit) res.thinglass->push_back(std::make_pair(&tri,t));
+                // Skip.
+                continue;
+            }
+            if(t < lo || t > hi){
+                continue;
+            }
+            if(AnyHit){
+                // Ignore whether this is the nearest intersection, we are looking for ANY.
+                res.triangle = &tri;
+                return true;
+            }
+            if(t < res.t){
+                // New closest intersect!
+                res.triangle = &tri;
+                res.t = t;
 
-Intersection Scene::FindIntersectKd(const Ray& __restrict__ r) __restrict__ const{
+                float c = 1.0f - a - b;
+                res.a = c;
+                res.b = a;
+                res.c = b;
 
-    Intersection res;
-    res.triangle = nullptr;
-    res.t = std::numeric_limits<float>::infinity();
+                hit = true;
+            }
+        }
+    }
+#endif // NO_SIMD_LEAVES
 
 
-    // First, check whether the ray intersects with our BB at all.
+    return hit;
+}
 
+inline bool Scene::ClipToBox(const Ray& __restrict__ r, float& t0, float& t1) __restrict__ const{
     const  std::pair<float,float>* __restrict  bb[3] = {&xBB,&yBB,&zBB};
 
     // Inspired by pbrt's bbox intersection
-    float t0 = r.near, t1 = r.far;
+    t0 = r.near, t1 = r.far;
     for (int i = 0; i < 3; ++i) {
         float invRayDir = 1.f / r.direction[i];
         float tNear = ((*bb[i]).first  - r.origin[i]) * invRayDir;
@@ -21,8 +161,22 @@ Intersection Scene::FindIntersectKd(const Ray& __restrict__ r) __restrict__ cons
         if (tNear > tFar) std::swap(tNear, tFar);
         t0 = tNear > t0 ? tNear : t0;
         t1 = tFar  < t1 ? tFar  : t1;
-        if (t0 > t1) return res; // No intersection.
+        if (t0 > t1) return false; // No intersection.
     }
+    return true;
+}
+
+// All kd-tree queries share this single traversal loop. The template parameters are compile-time policies, so each
+// public FindIntersectKd* variant below gets its own specialized copy, without any runtime branching on the policy.
+template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+void Scene::TraverseKd(const Ray& __restrict__ r, const Triangle* ignored, Intersection& res) __restrict__ const{
+
+    res.triangle = nullptr;
+    res.t = std::numeric_limits<float>::infinity();
+
+    // First, check whether the ray intersects with our BB at all.
+    float t0, t1;
+    if(!ClipToBox(r, t0, t1)) return;
 
     struct NodeToDo{
         const CompressedKdNode* node;
@@ -32,6 +186,8 @@ Intersection Scene::FindIntersectKd(const Ray& __restrict__ r) __restrict__ cons
 
     glm::vec3 invDir(1.f/r.direction.x, 1.f/r.direction.y, 1.f/r.direction.z);
 
+    const LeafRay lr(r, ignored, triangles);
+
     NodeToDo todo[200];
     int todo_size = 1;
     todo[0] = NodeToDo{compressed_array, t0, t1};
@@ -47,38 +203,10 @@ Intersection Scene::FindIntersectKd(const Ray& __restrict__ r) __restrict__ cons
 
         if(node->IsLeaf()){ // leaf node
 
-            bool hit = false;
             // Search for intersections with triangles inside this node
-            unsigned int n = node->GetTrianglesN();
-            uint32_t tri_start = node->GetFirstTrianglePos();
-            for(unsigned int p = 0; p < n; p++){
-                // For each triangle ...
-                unsigned int i = compressed_triangles[tri_start + p];
-                const Triangle& tri = triangles[i];
-                float t, a, b;
-                //  ... test for an intersection
-                if(tri.TestIntersection(r, t, a, b)){
-                    if(t < tmin - epsilon || t > tmax + epsilon){
-                        continue;
-                    }
-                    if(t < res.t){
-                        // New closest intersect!
-                        res.triangle = &tri;
-                        res.t = t;
-
-                        float c = 1.0f - a - b;
-                        res.a = c;
-                        res.b = a;
-                        res.c = b;
-
-                        hit = true;
-                    }
-                }
-            }
-
-            if(hit){
-                return res;
-            }
+            if(IntersectLeaf<AnyHit, IgnoreTriangle, Thinglass>(lr, node->GetFirstTrianglePos(), node->GetTrianglesN(),
+                                                                tmin - epsilon, tmax + epsilon, res))
+                return;
 
         }else{ // internal node
 
@@ -90,12 +218,13 @@ Intersection Scene::FindIntersectKd(const Ray& __restrict__ r) __restrict__ cons
             const CompressedKdNode *firstChild, *secondChild;
             int belowFirst = (r.origin[axis] <  node->GetSplitPlane()) ||
                              (r.origin[axis] == node->GetSplitPlane() && r.direction[axis] <= 0);
+            const CompressedKdNode* children = compressed_array + node->GetFirstChildIndex();
             if (belowFirst) {
-                firstChild = node + 1;
-                secondChild = compressed_array + node->GetOtherChildIndex();
+                firstChild = children;
+                secondChild = children + 1;
             }else{
-                firstChild = compressed_array + node->GetOtherChildIndex();
-                secondChild = node + 1;
+                firstChild = children + 1;
+                secondChild = children;
             }
 
             // Advance to next child node, possibly enqueue other child
@@ -112,344 +241,492 @@ Intersection Scene::FindIntersectKd(const Ray& __restrict__ r) __restrict__ cons
     }
 
     // No hit found at all.
-    return res;
 }
 
-const Triangle* Scene::FindIntersectKdAny(const Ray& __restrict__ r) __restrict__ const{
+template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+void Scene::TraverseKdShortStack(const Ray& __restrict__ r, const Triangle* ignored, Intersection& res) __restrict__ const{
 
-    // First, check whether the ray intersects with our BB at all.
+    res.triangle = nullptr;
+    res.t = std::numeric_limits<float>::infinity();
 
-    const  std::pair<float,float>* __restrict  bb[3] = {&xBB,&yBB,&zBB};
-
-    // Inspired by pbrt's bbox intersection
-    float t0 = r.near, t1 = r.far;
-    for (int i = 0; i < 3; ++i) {
-        float invRayDir = 1.f / r.direction[i];
-        float tNear = ((*bb[i]).first  - r.origin[i]) * invRayDir;
-        float tFar  = ((*bb[i]).second - r.origin[i]) * invRayDir;
-        if (tNear > tFar) std::swap(tNear, tFar);
-        t0 = tNear > t0 ? tNear : t0;
-        t1 = tFar  < t1 ? tFar  : t1;
-        if (t0 > t1) return nullptr; // No intersection.
-    }
+    float t0, t1;
+    if(!ClipToBox(r, t0, t1)) return;
 
     struct NodeToDo{
         const CompressedKdNode* node;
         float tmin, tmax;
     };
 
-
     glm::vec3 invDir(1.f/r.direction.x, 1.f/r.direction.y, 1.f/r.direction.z);
 
-    NodeToDo todo[200];
-    int todo_size = 1;
-    todo[0] = NodeToDo{compressed_array, t0, t1};
-
-    while(todo_size > 0){
-        todo_size--;
-        const CompressedKdNode* node = todo[todo_size].node;
-        float tmin = todo[todo_size].tmin;
-        float tmax = todo[todo_size].tmax;
-
-        // Abort if we got too far.
-        if(r.far < tmin) break;
-
-        if(node->IsLeaf()){ // leaf node
-            // Search for intersections with triangles inside this node
-            unsigned int n = node->GetTrianglesN();
-            uint32_t tri_start = node->GetFirstTrianglePos();
-            for(unsigned int p = 0; p < n; p++){
-                // For each triangle ...
-                unsigned int i = compressed_triangles[tri_start + p];
-                const Triangle& tri = triangles[i];
-                float t, a, b;
-                //  ... test for an intersection
-                if(tri.TestIntersection(r, t, a, b)){
-                    if(t < tmin - epsilon || t > tmax + epsilon){
-                        continue;
-                    }
-                    // Ignore whether this is the nearest intersection, we are looking for ANY.
-                    return &tri;
-                }
-            }
-
-        }else{ // internal node
-            // Compute parametric distance along ray to split plane
+    const LeafRay lr(r, ignored, triangles);
+
+    // Far children still to visit. A ring buffer, pushing onto a full one drops the oldest entry, which is the
+    // farthest along the ray.
+    NodeToDo todo[KD_SHORT_STACK_SIZE];
+    unsigned int todo_top = 0, todo_size = 0;
+
+    const CompressedKdNode* node = compressed_array;
+    float tmin = t0, tmax = t1;
+    // After a restart, tmin is where the last visited leaf ends. A split plane at exactly tmin then only leads to the
+    // far child, so that the leaf is not visited again.
+    bool restarted = false;
+    while(true){
+        // Descend to a leaf, along the near children.
+        while(!node->IsLeaf()){
             int axis = node->GetSplitAxis();
             float tplane = (node->GetSplitPlane() - r.origin[axis]) * invDir[axis];
 
-            // Get node children pointers for ray
-            const CompressedKdNode *firstChild, *secondChild;
             int belowFirst = (r.origin[axis] <  node->GetSplitPlane()) ||
                              (r.origin[axis] == node->GetSplitPlane() && r.direction[axis] <= 0);
-            if (belowFirst) {
-                firstChild = node + 1;
-                secondChild = compressed_array + node->GetOtherChildIndex();
-            }else{
-                firstChild = compressed_array + node->GetOtherChildIndex();
-                secondChild = node + 1;
-            }
-
-            // Advance to next child node, possibly enqueue other child
-            if (tplane > tmax || tplane <= 0)
-                todo[todo_size++] = NodeToDo{firstChild, tmin, tmax};
-            else if (tplane < tmin)
-                todo[todo_size++] = NodeToDo{secondChild, tmin, tmax};
+            const CompressedKdNode* children = compressed_array + node->GetFirstChildIndex();
+            const CompressedKdNode* firstChild  = belowFirst ? children : children + 1;
+            const CompressedKdNode* secondChild = belowFirst ? children + 1 : children;
+
+            // A ray lying in the split plane has a NaN tplane. It is sent to the near child only, a NaN must not
+            // reach tmin or tmax, as restarts rely on them growing along the ray.
+            if (!(tplane <= tmax) || tplane <= 0)
+                node = firstChild;
+            else if (tplane < tmin || (restarted && tplane == tmin))
+                node = secondChild;
             else {
-                // Enqueue _secondChild_ in todo list
-                todo[todo_size++] = NodeToDo{secondChild, tplane, tmax};
-                todo[todo_size++] = NodeToDo{firstChild,  tmin, tplane};
+                todo[todo_top++ % KD_SHORT_STACK_SIZE] = NodeToDo{secondChild, tplane, tmax};
+                todo_size = std::min(todo_size + 1, (unsigned int)KD_SHORT_STACK_SIZE);
+                node = firstChild;
+                tmax = tplane;
             }
         }
+
+        if(IntersectLeaf<AnyHit, IgnoreTriangle, Thinglass>(lr, node->GetFirstTrianglePos(), node->GetTrianglesN(),
+                                                            tmin - epsilon, tmax + epsilon, res))
+            return;
+
+        if(todo_size > 0){
+            todo_size--;
+            const NodeToDo& next = todo[--todo_top % KD_SHORT_STACK_SIZE];
+            node = next.node;
+            tmin = next.tmin;
+            tmax = next.tmax;
+        }else{
+            // Entries were dropped, or the ray has left the scene. Written so that a NaN t1 ends the traversal.
+            if(!(tmax < t1)) return;
+            node = compressed_array;
+            tmin = tmax;
+            tmax = t1;
+            restarted = true;
+        }
     }
+}
 
-    // No hit found at all.
-    return nullptr;
+// Leaves of BVHs are not visited in order along the ray, as kd-tree leaves are.
+static void SortThinglass(ThinglassIsections& thinglass){
+    std::sort(thinglass.begin(), thinglass.end(),
+              [](const std::tuple<const Triangle*,float>& a, const std::tuple<const Triangle*,float>& b){
+                  return std::get<1>(a) < std::get<1>(b);
+              });
 }
 
+// Walks a BVH from nodes[0]. Nodes are tested with the slab test, ordered by the ray's direction along the node's
+// split axis. leaf(node, tfar) is called for each leaf the ray enters before tfar, it may shorten tfar, so that nodes
+// beyond the nearest hit found so far are skipped, and returns true to stop the walk.
+template <typename LeafFunc>
+static inline void WalkBvh(const BvhNode* __restrict__ nodes, const Ray& __restrict__ r, float tfar, LeafFunc leaf){
+    const glm::vec3 invDir(1.f/r.direction.x, 1.f/r.direction.y, 1.f/r.direction.z);
+    const bool negative[3] = {r.direction.x < 0.0f, r.direction.y < 0.0f, r.direction.z < 0.0f};
+
+    uint32_t todo[BVH_STACK_SIZE];
+    int todo_size = 0;
+    uint32_t current = 0;
+    while(true){
+        const BvhNode& node = nodes[current];
+        float t0 = r.near, t1 = tfar;
+        for(int i = 0; i < 3; i++){
+            float tNear = (node.bb_min[i] - r.origin[i]) * invDir[i];
+            float tFar  = (node.bb_max[i] - r.origin[i]) * invDir[i];
+            if(negative[i]) std::swap(tNear, tFar);
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar  < t1 ? tFar  : t1;
+        }
+        if(t0 <= t1){
+            if(node.IsLeaf()){
+                if(leaf(node, tfar)) return;
+            }else{
+                // Visit the child on the near side of the split first.
+                if(negative[node.axis]){
+                    todo[todo_size++] = current + 1;
+                    current = node.offset;
+                }else{
+                    todo[todo_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if(todo_size == 0) break;
+        current = todo[--todo_size];
+    }
+}
 
-Intersection Scene::FindIntersectKdOtherThan(const Ray& __restrict__ r, const Triangle* ignore) __restrict__ const{
+template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+void Scene::TraverseBvh(const Ray& __restrict__ r, const Triangle* ignored, Intersection& res) __restrict__ const{
 
-    Intersection res;
     res.triangle = nullptr;
     res.t = std::numeric_limits<float>::infinity();
 
+    const LeafRay lr(r, ignored, triangles);
+    WalkBvh(bvh_nodes, r, r.far, [&](const BvhNode& node, float& tfar){
+            if(!IntersectLeaf<AnyHit, IgnoreTriangle, Thinglass>(lr, node.offset, node.triangles_n,
+                                                                 r.near - epsilon, r.far + epsilon, res))
+                return false;
+            tfar = res.t;
+            return AnyHit;
+        });
 
-    // First, check whether the ray intersects with our BB at all.
+    if(Thinglass && !AnyHit) SortThinglass(*res.thinglass);
+}
 
-    const  std::pair<float,float>* __restrict  bb[3] = {&xBB,&yBB,&zBB};
+template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+void Scene::TraverseWideBvh(const Ray& __restrict__ r, const Triangle* ignored, Intersection& res) __restrict__ const{
 
-    // Inspired by pbrt's bbox intersection
-    float t0 = r.near, t1 = r.far;
-    for (int i = 0; i < 3; ++i) {
-        float invRayDir = 1.f / r.direction[i];
-        float tNear = ((*bb[i]).first  - r.origin[i]) * invRayDir;
-        float tFar  = ((*bb[i]).second - r.origin[i]) * invRayDir;
-        if (tNear > tFar) std::swap(tNear, tFar);
-        t0 = tNear > t0 ? tNear : t0;
-        t1 = tFar  < t1 ? tFar  : t1;
-        if (t0 > t1) return res; // No intersection.
-    }
+    res.triangle = nullptr;
+    res.t = std::numeric_limits<float>::infinity();
 
-    struct NodeToDo{
-        const CompressedKdNode* node;
-        float tmin, tmax;
+    const LeafRay lr(r, ignored, triangles);
+    const vfloat org[3] = {vfloat_set1(r.origin.x), vfloat_set1(r.origin.y), vfloat_set1(r.origin.z)};
+    const vfloat inv[3] = {vfloat_set1(1.f/r.direction.x), vfloat_set1(1.f/r.direction.y), vfloat_set1(1.f/r.direction.z)};
+    const bool negative[3] = {r.direction.x < 0.0f, r.direction.y < 0.0f, r.direction.z < 0.0f};
+    const unsigned int octant = negative[0] | (negative[1] << 1) | (negative[2] << 2);
+    const vfloat vnear = vfloat_set1(r.near);
+    float tfar = r.far;
+
+    // Children are pushed with the distance at which the ray enters them, so that ones behind a hit found after they
+    // were pushed can be skipped.
+    struct WideToDo{
+        uint32_t child;
+        uint32_t triangles_n;
+        float tnear;
     };
-
-
-    glm::vec3 invDir(1.f/r.direction.x, 1.f/r.direction.y, 1.f/r.direction.z);
-
-    NodeToDo todo[200];
+    WideToDo todo[WIDE_BVH_STACK_SIZE];
     int todo_size = 1;
-    todo[0] = NodeToDo{compressed_array, t0, t1};
-
+    todo[0] = WideToDo{0, 0, r.near};
     while(todo_size > 0){
-        todo_size--;
-        const CompressedKdNode* node = todo[todo_size].node;
-        float tmin = todo[todo_size].tmin;
-        float tmax = todo[todo_size].tmax;
-
-        // Abort if we got too far.
-        if(r.far < tmin) break;
+        const WideToDo e = todo[--todo_size];
+        if(e.tnear > tfar) continue;
+
+        if(e.child & WIDE_BVH_LEAF){
+            if(IntersectLeaf<AnyHit, IgnoreTriangle, Thinglass>(lr, e.child & ~WIDE_BVH_LEAF, e.triangles_n,
+                                                                r.near - epsilon, r.far + epsilon, res)){
+                if(AnyHit) return;
+                tfar = res.t;
+            }
+            continue;
+        }
 
-        if(node->IsLeaf()){ // leaf node
+        const WideBvhNode& node = wide_bvh_nodes[e.child];
+        vfloat t0 = vnear, t1 = vfloat_set1(tfar);
+        for(int i = 0; i < 3; i++){
+            // The direction's sign tells which of the two planes is entered first, for all children.
+            vfloat tNear = ((negative[i] ? node.bb_max[i] : node.bb_min[i]) - org[i]) * inv[i];
+            vfloat tFar  = ((negative[i] ? node.bb_min[i] : node.bb_max[i]) - org[i]) * inv[i];
+            t0 = vmax(tNear, t0);
+            t1 = vmin(tFar, t1);
+        }
+        vmask hit = t0 <= t1;
+        if(!vany(hit)) continue;
+
+        // Push from far to near, so that the nearest child is visited next.
+        uint32_t order = node.order[octant];
+        for(int k = SIMD_WIDTH - 1; k >= 0; k--){
+            unsigned int c = (order >> (4 * k)) & 0xf;
+            if(hit[c]) todo[todo_size++] = WideToDo{node.child[c], node.triangles_n[c], t0[c]};
+        }
+    }
 
-            bool hit = false;
-            // Search for intersections with triangles inside this node
-            unsigned int n = node->GetTrianglesN();
-            uint32_t tri_start = node->GetFirstTrianglePos();
-            for(unsigned int p = 0; p < n; p++){
-                // For each triangle ...
-                unsigned int i = compressed_triangles[tri_start + p];
-                const Triangle& tri = triangles[i];
-                float t, a, b;
-
-                // Skip the triangle if it matches ignore condition
-                if(&tri == ignore) continue;
-
-                //  ... test for an intersection
-                if(tri.TestIntersection(r, t, a, b)){
-                    if(t < tmin - epsilon || t > tmax + epsilon){
-                        continue;
-                    }
-                    if(t < res.t){
-                        // New closest intersect!
-                        res.triangle = &tri;
-                        res.t = t;
-
-                        float c = 1.0f - a - b;
-                        res.a = c;
-                        res.b = a;
-                        res.c = b;
+    if(Thinglass && !AnyHit) SortThinglass(*res.thinglass);
+}
 
+// Instances are found with the BVH over their boxes. Each one the ray reaches transforms the ray into its object
+// space, and walks its mesh's BVH with it. The mesh BVHs use the same leaves as the scene structure.
+template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+void Scene::TraverseInstances(const Ray& __restrict__ r, const Triangle* ignored, const Instance* ignored_instance,
+                              Intersection& res) __restrict__ const{
+    WalkBvh(instance_bvh_nodes, r, std::min(r.far, res.t), [&](const BvhNode& node, float& tfar){
+            for(unsigned int i = node.offset; i < node.offset + node.triangles_n; i++){
+                const Instance& instance = instances[instance_indices[i]];
+                const Ray object_ray = instance.ToObject(r);
+                // The ignored triangle is only ignored in its own instance.
+                const LeafRay lr(object_ray, (IgnoreTriangle && &instance == ignored_instance) ? ignored : nullptr, triangles);
+                bool hit = false;
+                WalkBvh(mesh_bvh_nodes + meshes[instance.mesh].root, object_ray, tfar, [&](const BvhNode& leaf, float& mesh_tfar){
+                        if(!IntersectLeaf<AnyHit, IgnoreTriangle, Thinglass>(lr, leaf.offset, leaf.triangles_n,
+                                                                             r.near - epsilon, r.far + epsilon, res))
+                            return false;
                         hit = true;
-                    }
+                        mesh_tfar = res.t;
+                        return AnyHit;
+                    });
+                if(hit){
+                    res.instance = &instance;
+                    if(AnyHit) return true;
+                    tfar = res.t;
                 }
             }
+            return false;
+        });
 
-            if(hit){
-                return res;
-            }
-
-        }else{ // internal node
+    if(Thinglass && !AnyHit) SortThinglass(*res.thinglass);
+}
 
-            // Compute parametric distance along ray to split plane
-            int axis = node->GetSplitAxis();
-            float tplane = (node->GetSplitPlane() - r.origin[axis]) * invDir[axis];
+template <bool AnyHit, bool IgnoreTriangle, bool Thinglass>
+inline void Scene::Traverse(const Ray& __restrict__ r, const Triangle* ignored, const Instance* ignored_instance,
+                            Intersection& res) __restrict__ const{
+    if(accel == AccelStructure::WideBvh) TraverseWideBvh<AnyHit, IgnoreTriangle, Thinglass>(r, ignored, res);
+    else if(accel == AccelStructure::Bvh) TraverseBvh<AnyHit, IgnoreTriangle, Thinglass>(r, ignored, res);
+    else if(kd_short_stack) TraverseKdShortStack<AnyHit, IgnoreTriangle, Thinglass>(r, ignored, res);
+    else TraverseKd<AnyHit, IgnoreTriangle, Thinglass>(r, ignored, res);
+    res.instance = nullptr;
+    if(instances.empty() || (AnyHit && res.triangle)) return;
+    TraverseInstances<AnyHit, IgnoreTriangle, Thinglass>(r, ignored, ignored_instance, res);
+}
 
-            // Get node children pointers for ray
-            const CompressedKdNode *firstChild, *secondChild;
-            int belowFirst = (r.origin[axis] <  node->GetSplitPlane()) ||
-                             (r.origin[axis] == node->GetSplitPlane() && r.direction[axis] <= 0);
-            if (belowFirst) {
-                firstChild = node + 1;
-                secondChild = compressed_array + node->GetOtherChildIndex();
-            }else{
-                firstChild = compressed_array + node->GetOtherChildIndex();
-                secondChild = node + 1;
-            }
+Intersection Scene::FindIntersectKd(const Ray& __restrict__ r) __restrict__ const{
+    Intersection res;
+    Traverse<false, false, false>(r, nullptr, nullptr, res);
+    return res;
+}
 
-            // Advance to next child node, possibly enqueue other child
-            if (tplane > tmax || tplane <= 0)
-                todo[todo_size++] = NodeToDo{firstChild, tmin, tmax};
-            else if (tplane < tmin)
-                todo[todo_size++] = NodeToDo{secondChild, tmin, tmax};
-            else {
-                // Enqueue _secondChild_ in todo list
-                todo[todo_size++] = NodeToDo{secondChild, tplane, tmax};
-                todo[todo_size++] = NodeToDo{firstChild,  tmin, tplane};
-            }
-        }
-    }
+const Triangle* Scene::FindIntersectKdAny(const Ray& __restrict__ r) __restrict__ const{
+    Intersection res;
+    Traverse<true, false, false>(r, nullptr, nullptr, res);
+    return res.triangle;
+}
 
-    // No hit found at all.
+Intersection Scene::FindIntersectKdOtherThan(const Ray& __restrict__ r, const Triangle* ignored,
+                                             const Instance* ignored_instance) __restrict__ const{
+    Intersection res;
+    Traverse<false, true, false>(r, ignored, ignored_instance, res);
     return res;
 }
 
+Intersection Scene::FindIntersectKdOtherThanWithThinglass(const Ray& r, const Triangle* ignored,
+                                                          ThinglassIsections& thinglass,
+                                                          const Instance* ignored_instance) __restrict__ const{
+    Intersection res;
+    thinglass.clear();
+    res.thinglass = &thinglass;
+    Traverse<false, true, true>(r, ignored, ignored_instance, res);
+    return res;
+}
 
-Intersection Scene::FindIntersectKdOtherThanWithThinglass(const Ray& r, const Triangle* ignored) __restrict__ const{
-
+template <bool PassThinglass>
+bool Scene::OccludedRay(const Ray& __restrict__ r, OcclusionCache* cache) __restrict__ const{
+    if(cache && cache->last_occluder){
+        const Triangle* tri = cache->last_occluder;
+        const Ray cr = cache->last_instance ? cache->last_instance->ToObject(r) : r;
+        float t, a, b;
+        if(!(PassThinglass && GetMaterial(GetTriangleIndex(tri)).is_thinglass) &&
+           tri->TestIntersection(cr, RayShear(cr), vertices, t, a, b) && t >= r.near && t <= r.far) return true;
+    }
     Intersection res;
-    res.triangle = nullptr;
-    res.t = std::numeric_limits<float>::infinity();
+    Traverse<true, false, PassThinglass>(r, nullptr, nullptr, res);
+    if(cache && res.triangle){
+        cache->last_occluder = res.triangle;
+        cache->last_instance = res.instance;
+    }
+    return res.triangle != nullptr;
+}
 
+bool Scene::Occluded(glm::vec3 a, glm::vec3 b, OcclusionCache* cache, bool pass_thinglass) __restrict__ const{
+    Ray r(a, b, epsilon * 20.0f);
+    return pass_thinglass ? OccludedRay<true>(r, cache) : OccludedRay<false>(r, cache);
+}
 
-    // First, check whether the ray intersects with our BB at all.
+void Scene::OccludedFrom(glm::vec3 from, ShadowQuery* queries, unsigned int n, OcclusionCache* cache,
+                         bool pass_thinglass) __restrict__ const{
+    for(unsigned int i = 0; i < n; i++){
+        Ray r(from, queries[i].to, epsilon * 20.0f);
+        queries[i].occluded = pass_thinglass ? OccludedRay<true>(r, cache) : OccludedRay<false>(r, cache);
+    }
+}
 
-    const  std::pair<float,float>* __restrict  bb[3] = {&xBB,&yBB,&zBB};
+// Packets can only be traversed together if all rays visit the children of each node in the same order, which is
+// the case when their directions have the same signs.
+static bool PacketIsCoherent(const Ray* rays, unsigned int n){
+    for(int axis = 0; axis < 3; axis++){
+        bool positive = rays[0].direction[axis] > 0.0f;
+        for(unsigned int j = 0; j < n; j++){
+            float d = rays[j].direction[axis];
+            if(d == 0.0f || !std::isfinite(1.0f / d) || (d > 0.0f) != positive) return false;
+        }
+    }
+    return true;
+}
 
-    // Inspired by pbrt's bbox intersection
-    float t0 = r.near, t1 = r.far;
-    for (int i = 0; i < 3; ++i) {
-        float invRayDir = 1.f / r.direction[i];
-        float tNear = ((*bb[i]).first  - r.origin[i]) * invRayDir;
-        float tFar  = ((*bb[i]).second - r.origin[i]) * invRayDir;
-        if (tNear > tFar) std::swap(tNear, tFar);
-        t0 = tNear > t0 ? tNear : t0;
-        t1 = tFar  < t1 ? tFar  : t1;
-        if (t0 > t1) return res; // No intersection.
+void Scene::IntersectStream(const Ray* rays, Intersection* results, size_t n) __restrict__ const{
+    for(size_t i = 0; i < n; i += SIMD_WIDTH){
+        unsigned int k = std::min<size_t>(SIMD_WIDTH, n - i);
+        // Packet traversal is only implemented for the kd-tree.
+        if(accel == AccelStructure::Kd && k > 1 && PacketIsCoherent(rays + i, k)){
+            TraversePacketKd(rays + i, results + i, k);
+            if(!instances.empty())
+                for(unsigned int j = 0; j < k; j++)
+                    TraverseInstances<false, false, false>(rays[i + j], nullptr, nullptr, results[i + j]);
+        }else{
+            // Diverging rays are not worth traversing together.
+            for(unsigned int j = 0; j < k; j++)
+                results[i + j] = FindIntersectKd(rays[i + j]);
+        }
     }
+}
 
-    struct NodeToDo{
-        const CompressedKdNode* node;
-        float tmin, tmax;
-    };
+// The same traversal as TraverseKd, but for SIMD_WIDTH rays at once. Each ray keeps its own [tmin, tmax] range in its
+// lane, lanes whose range is empty are masked off. A node is visited if any lane is still interested in it. Leaves
+// are tested one triangle at a time against all lanes.
+void Scene::TraversePacketKd(const Ray* rays, Intersection* results, unsigned int n) __restrict__ const{
+    const float inf = std::numeric_limits<float>::infinity();
+
+    float tmin_l[SIMD_WIDTH], tmax_l[SIMD_WIDTH];
+    float org_l[3][SIMD_WIDTH], dir_l[3][SIMD_WIDTH], inv_l[3][SIMD_WIDTH];
+    const std::pair<float,float>* __restrict bb[3] = {&xBB,&yBB,&zBB};
+    for(unsigned int j = 0; j < SIMD_WIDTH; j++){
+        // Unused lanes replicate the first ray, with an empty range.
+        const Ray& r = rays[j < n ? j : 0];
+        for(int i = 0; i < 3; i++){
+            org_l[i][j] = r.origin[i];
+            dir_l[i][j] = r.direction[i];
+            inv_l[i][j] = 1.f / r.direction[i];
+        }
+        // Clip the ray with the scene's BB.
+        float t0 = r.near, t1 = r.far;
+        for(int i = 0; i < 3; ++i) {
+            float tNear = ((*bb[i]).first  - r.origin[i]) * inv_l[i][j];
+            float tFar  = ((*bb[i]).second - r.origin[i]) * inv_l[i][j];
+            if (tNear > tFar) std::swap(tNear, tFar);
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar  < t1 ? tFar  : t1;
+        }
+        if(j >= n || t0 > t1){
+            t0 = inf;
+            t1 = -inf;
+        }
+        tmin_l[j] = t0;
+        tmax_l[j] = t1;
+    }
 
+    vfloat org[3] = {vfloat_load(org_l[0]), vfloat_load(org_l[1]), vfloat_load(org_l[2])};
+    vfloat dir[3] = {vfloat_load(dir_l[0]), vfloat_load(dir_l[1]), vfloat_load(dir_l[2])};
+    vfloat inv[3] = {vfloat_load(inv_l[0]), vfloat_load(inv_l[1]), vfloat_load(inv_l[2])};
+    bool positive[3] = {rays[0].direction.x > 0.0f, rays[0].direction.y > 0.0f, rays[0].direction.z > 0.0f};
+    const vfloat vinf = vfloat_set1(inf), vzero = vfloat_set1(0.0f);
+    const vfloat veps = vfloat_set1(epsilon);
 
-    glm::vec3 invDir(1.f/r.direction.x, 1.f/r.direction.y, 1.f/r.direction.z);
+    // The watertight test needs the same axes in all lanes, those of the first ray are used. Coherent packets have
+    // no zero direction components, so they work for all rays, if not always as precisely as their own.
+    const RayShear shear(rays[0]);
+    const int kx = shear.kx, ky = shear.ky, kz = shear.kz;
+    const vfloat sz = 1.0f / dir[kz], sx = dir[kx] * sz, sy = dir[ky] * sz;
 
-    NodeToDo todo[200];
+    // Nearest hits found so far.
+    vfloat best_t = vinf, best_a = vzero, best_b = vzero;
+    const Triangle* best_tri[SIMD_WIDTH] = {nullptr};
+
+    // Lanes that have not found their intersection yet.
+    vmask alive = vmask_set1(true);
+
+    struct PacketToDo{
+        const CompressedKdNode* node;
+        vfloat tmin, tmax;
+    };
+
+    PacketToDo todo[200];
     int todo_size = 1;
-    todo[0] = NodeToDo{compressed_array, t0, t1};
+    todo[0] = PacketToDo{compressed_array, vfloat_load(tmin_l), vfloat_load(tmax_l)};
 
     while(todo_size > 0){
         todo_size--;
         const CompressedKdNode* node = todo[todo_size].node;
-        float tmin = todo[todo_size].tmin;
-        float tmax = todo[todo_size].tmax;
+        vfloat tmin = todo[todo_size].tmin;
+        vfloat tmax = todo[todo_size].tmax;
 
-        // Abort if we got too far.
-        if(r.far < tmin) break;
+        vmask active = alive & (tmin <= tmax);
+        if(!vany(active)) continue;
 
         if(node->IsLeaf()){ // leaf node
-
-            bool hit = false;
-            // Search for intersections with triangles inside this node
-            unsigned int n = node->GetTrianglesN();
-            uint32_t tri_start = node->GetFirstTrianglePos();
-            for(unsigned int p = 0; p < n; p++){
-                // For each triangle ...
-                unsigned int i = compressed_triangles[tri_start + p];
-                const Triangle& tri = triangles[i];
-                float t, a, b;
-
-                // Skip the triangle if it matches ignore condition
-                if(&tri == ignored) continue;
-
-                //  ... test for an intersection
-                if(tri.TestIntersection(r, t, a, b)){
-
-                    // Skip the triangle, if the material is in thinglass set
-                    const Material* mat = &(tri.GetMaterial());
-                    if(mat->is_thinglass){
-                        // Add this triangle data to intersection.
-                        res.thinglass.push_back(std::make_pair(&tri,t));
-                        // Skip.
-                        continue;
-                    }
-                    if(t < tmin - epsilon || t > tmax + epsilon){
-                        continue;
-                    }
-                    if(t < res.t){
-                        // New closest intersect!
-                        res.triangle = &tri;
-                        res.t = t;
-
-                        float c = 1.0f - a - b;
-                        res.a = c;
-                        res.b = a;
-                        res.c = b;
-
-                        hit = true;
-                    }
-                }
-            }
-
-            if(hit){
-                return res;
+            vmask hit = vmask_set1(false);
+            vfloat lo = tmin - veps, hi = tmax + veps;
+            unsigned int tn = node->GetTrianglesN();
+            const unsigned int* tri_indices = compressed_triangles + node->GetFirstTrianglePos();
+            for(unsigned int p = 0; p < tn; p++){
+                // The watertight test, as in IntersectBlock, but one triangle against all lanes.
+                const Triangle& tri = triangles[tri_indices[p]];
+                const glm::vec3 v0 = vertices[tri.va], v1 = vertices[tri.vb], v2 = vertices[tri.vc];
+                vfloat az = v0[kz] - org[kz], bz = v1[kz] - org[kz], cz = v2[kz] - org[kz];
+                vfloat ax = v0[kx] - org[kx] - sx * az, ay = v0[ky] - org[ky] - sy * az;
+                vfloat bx = v1[kx] - org[kx] - sx * bz, by = v1[ky] - org[ky] - sy * bz;
+                vfloat cx = v2[kx] - org[kx] - sx * cz, cy = v2[ky] - org[ky] - sy * cz;
+                vfloat U = cx * by - cy * bx;
+                vfloat V = ax * cy - ay * cx;
+                vfloat W = bx * ay - by * ax;
+                vfloat det = U + V + W;
+                vfloat inv = 1.0f / det;
+                vfloat alpha = V * inv;
+                vfloat beta = W * inv;
+                vfloat t = (U * az + V * bz + W * cz) * sz * inv;
+                vmask m = active & (((U >= vzero) & (V >= vzero) & (W >= vzero)) |
+                                    ((U <= vzero) & (V <= vzero) & (W <= vzero))) & (det != vzero) &
+                          (t >= lo) & (t <= hi) & (t < best_t);
+                if(!vany(m)) continue;
+
+                // New closest intersects!
+                best_t = vselect(m, t, best_t);
+                best_a = vselect(m, alpha, best_a);
+                best_b = vselect(m, beta, best_b);
+                for(unsigned int j = 0; j < n; j++)
+                    if(m[j]) best_tri[j] = &tri;
+                hit |= m;
             }
+            // Rays that hit something in this leaf are done.
+            alive &= ~hit;
+            if(!vany(alive)) break;
 
         }else{ // internal node
-
-            // Compute parametric distance along ray to split plane
             int axis = node->GetSplitAxis();
-            float tplane = (node->GetSplitPlane() - r.origin[axis]) * invDir[axis];
-
-            // Get node children pointers for ray
-            const CompressedKdNode *firstChild, *secondChild;
-            int belowFirst = (r.origin[axis] <  node->GetSplitPlane()) ||
-                             (r.origin[axis] == node->GetSplitPlane() && r.direction[axis] <= 0);
-            if (belowFirst) {
-                firstChild = node + 1;
-                secondChild = compressed_array + node->GetOtherChildIndex();
+            vfloat d = (vfloat_set1(node->GetSplitPlane()) - org[axis]) * inv[axis];
+
+            // The near child is the one that rays enter first.
+            const CompressedKdNode *nearChild, *farChild;
+            const CompressedKdNode* children = compressed_array + node->GetFirstChildIndex();
+            if(positive[axis]){
+                nearChild = children;
+                farChild = children + 1;
             }else{
-                firstChild = compressed_array + node->GetOtherChildIndex();
-                secondChild = node + 1;
+                nearChild = children + 1;
+                farChild = children;
             }
 
-            // Advance to next child node, possibly enqueue other child
-            if (tplane > tmax || tplane <= 0)
-                todo[todo_size++] = NodeToDo{firstChild, tmin, tmax};
-            else if (tplane < tmin)
-                todo[todo_size++] = NodeToDo{secondChild, tmin, tmax};
-            else {
-                // Enqueue _secondChild_ in todo list
-                todo[todo_size++] = NodeToDo{secondChild, tplane, tmax};
-                todo[todo_size++] = NodeToDo{firstChild,  tmin, tplane};
-            }
+            // Lanes which only need one of the children. A plane behind the origin means the origin is on the far side.
+            vmask near_only = d > tmax;
+            vmask far_only = (d < tmin) | (d <= vzero);
+            vmask both = ~(near_only | far_only);
+
+            if(vany(active & ~near_only))
+                todo[todo_size++] = PacketToDo{farChild,
+                                               vselect(near_only, vinf, vselect(both, d, tmin)),
+                                               tmax};
+            if(vany(active & ~far_only))
+                todo[todo_size++] = PacketToDo{nearChild,
+                                               vselect(far_only, vinf, tmin),
+                                               vselect(both, d, tmax)};
         }
     }
 
-    // No hit found at all.
-    return res;
+    for(unsigned int j = 0; j < n; j++){
+        Intersection& res = results[j];
+        res.triangle = best_tri[j];
+        res.instance = nullptr;
+        res.t = best_t[j];
+        res.a = 1.0f - best_a[j] - best_b[j];
+        res.b = best_a[j];
+        res.c = best_b[j];
+    }
 }
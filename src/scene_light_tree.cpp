@@ -0,0 +1,251 @@
+#include "scene.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "glm.hpp"
+#include <glm/gtx/norm.hpp>
+#include <glm/gtx/rotate_vector.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "out.hpp"
+
+namespace{
+
+// The bounds of a light tree node, while it is built.
+struct LightBounds{
+    glm::vec3 lo = glm::vec3( std::numeric_limits<float>::infinity());
+    glm::vec3 hi = glm::vec3(-std::numeric_limits<float>::infinity());
+    glm::vec3 axis = glm::vec3(0.0f, 0.0f, 1.0f);
+    // Angle of the orientation cone, or negative for no directions (an empty node).
+    float theta_o = -1.0f;
+    float weight = 0.0f;
+    void Extend(const LightBounds& o){
+        lo = glm::min(lo, o.lo);
+        hi = glm::max(hi, o.hi);
+        weight += o.weight;
+        // The smallest cone around both cones.
+        if(o.theta_o < 0.0f) return;
+        if(theta_o < 0.0f){
+            axis = o.axis;
+            theta_o = o.theta_o;
+            return;
+        }
+        float theta_d = glm::acos(glm::clamp(glm::dot(axis, o.axis), -1.0f, 1.0f));
+        if(theta_d + o.theta_o <= theta_o) return;
+        if(theta_d + theta_o <= o.theta_o){
+            axis = o.axis;
+            theta_o = o.theta_o;
+            return;
+        }
+        float theta = (theta_o + theta_d + o.theta_o) * 0.5f;
+        glm::vec3 r = glm::cross(axis, o.axis);
+        if(theta >= glm::pi<float>() || glm::length2(r) <= 0.0f){
+            theta_o = glm::pi<float>();
+            return;
+        }
+        axis = glm::rotate(axis, theta - theta_o, glm::normalize(r));
+        theta_o = theta;
+    }
+};
+
+struct LightItem{
+    LightBounds bounds;
+    glm::vec3 centroid;
+    LightTreeEmitter emitter;
+};
+
+struct LightTreeBuilder{
+    std::vector<LightItem> items;
+    std::vector<LightTreeNode> nodes;
+    std::vector<LightTreeEmitter> emitters;
+
+    // Splits items at the median of their centroids along the axis in which they are most spread out.
+    void Build(unsigned int begin, unsigned int end){
+        LightBounds b, centroids;
+        for(unsigned int i = begin; i < end; i++){
+            b.Extend(items[i].bounds);
+            centroids.lo = glm::min(centroids.lo, items[i].centroid);
+            centroids.hi = glm::max(centroids.hi, items[i].centroid);
+        }
+        unsigned int n = nodes.size();
+        nodes.push_back(LightTreeNode{b.lo, b.hi, b.axis, glm::cos(b.theta_o), b.weight, 0, false});
+        if(end - begin == 1){
+            nodes[n].leaf = true;
+            nodes[n].offset = emitters.size();
+            emitters.push_back(items[begin].emitter);
+            return;
+        }
+        glm::vec3 d = centroids.hi - centroids.lo;
+        int axis = (d.x > d.y) ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+        unsigned int mid = (begin + end) / 2;
+        std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                         [axis](const LightItem& a, const LightItem& b){return a.centroid[axis] < b.centroid[axis];});
+        Build(begin, mid);
+        nodes[n].offset = nodes.size();
+        Build(mid, end);
+    }
+};
+
+// cos(max(0, a - b)), given sines and cosines of a and b, both in [0, pi].
+inline float CosSubClamped(float sin_a, float cos_a, float sin_b, float cos_b){
+    if(cos_a >= cos_b) return 1.0f;
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+inline float SinFromCos(float c){
+    return glm::sqrt(glm::max(0.0f, 1.0f - c * c));
+}
+
+// An estimate of how much the emitters below the node illuminate the point. Only zero if none of them can.
+float Importance(const LightTreeNode& node, glm::vec3 pos, glm::vec3 normal){
+    glm::vec3 center = 0.5f * (node.bb_min + node.bb_max);
+    glm::vec3 to_pos = pos - center;
+    float d2 = glm::length2(to_pos);
+    float r2 = 0.25f * glm::length2(node.bb_max - node.bb_min);
+    // The angle of the cone from pos around the node's bounding sphere. Inside the sphere, it is all directions.
+    float cos_b = -1.0f, sin_b = 0.0f;
+    if(d2 > r2){
+        float sin2 = r2 / d2;
+        sin_b = glm::sqrt(sin2);
+        cos_b = glm::sqrt(1.0f - sin2);
+    }
+    glm::vec3 w = (d2 > 0.0f) ? to_pos / glm::sqrt(d2) : node.axis;
+    // The smallest angle between an emitter below and the direction towards pos.
+    float cos_w = glm::dot(node.axis, w);
+    float cos_x = CosSubClamped(SinFromCos(cos_w), cos_w, SinFromCos(node.cos_o), node.cos_o);
+    float cos_p = CosSubClamped(SinFromCos(cos_x), cos_x, sin_b, cos_b);
+    if(cos_p <= 0.0f) return 0.0f;
+    // The same for the angle of incidence at pos, on either side of the surface.
+    float cos_i = glm::abs(glm::dot(w, normal));
+    float cos_pi = CosSubClamped(SinFromCos(cos_i), cos_i, sin_b, cos_b);
+    // Close to the node, the distance to its center says little about the distance to its emitters.
+    d2 = glm::max(d2, glm::max(r2, 1e-8f));
+    return node.weight * cos_p * cos_pi / d2;
+}
+
+} // namespace
+
+void Scene::BuildLightTree(){
+    LightTreeBuilder builder;
+    for(unsigned int i = 0; i < pointlights.size(); i++){
+        const Light& l = pointlights[i];
+        LightItem item;
+        item.bounds.lo = l.pos - glm::vec3(l.size);
+        item.bounds.hi = l.pos + glm::vec3(l.size);
+        item.bounds.theta_o = glm::pi<float>();
+        // Weights are the light emitted, so that point lights and triangles compare fairly.
+        item.bounds.weight = 4.0f * glm::pi<float>() * l.intensity * (l.color.r + l.color.g + l.color.b);
+        item.centroid = l.pos;
+        item.emitter = LightTreeEmitter{i, LIGHT_TREE_POINT_LIGHT};
+        if(item.bounds.weight > 0.0f) builder.items.push_back(item);
+    }
+    for(unsigned int i = 0; i < areal_lights.size(); i++){
+        const ArealLight& al = areal_lights[i].second;
+        float radiance = al.emission.r + al.emission.g + al.emission.b;
+        for(const auto& p : al.triangles_with_areas){
+            unsigned int t = p.second;
+            LightItem item;
+            for(glm::vec3 v : {GetVertexA(t), GetVertexB(t), GetVertexC(t)}){
+                item.bounds.lo = glm::min(item.bounds.lo, v);
+                item.bounds.hi = glm::max(item.bounds.hi, v);
+            }
+            // Light samples take the normal interpolated from vertex normals, see GetRandomPoint. Their cone is wider
+            // than a hemisphere only when the interpolated normal may be zero, and the face normal is used instead.
+            glm::vec3 na = GetNormalA(t), nb = GetNormalB(t), nc = GetNormalC(t);
+            glm::vec3 axis = na + nb + nc;
+            float cos_o = -1.0f;
+            if(glm::length2(axis) > 0.0f){
+                axis = glm::normalize(axis);
+                cos_o = glm::min(glm::dot(axis, glm::normalize(na)),
+                                 glm::min(glm::dot(axis, glm::normalize(nb)), glm::dot(axis, glm::normalize(nc))));
+            }
+            if(!(cos_o > 0.0f)){
+                axis = glm::vec3(0.0f, 0.0f, 1.0f);
+                cos_o = -1.0f;
+            }
+            item.bounds.axis = axis;
+            item.bounds.theta_o = glm::acos(glm::clamp(cos_o, -1.0f, 1.0f));
+            item.bounds.weight = glm::pi<float>() * p.first * radiance;
+            item.centroid = 0.5f * (item.bounds.lo + item.bounds.hi);
+            item.emitter = LightTreeEmitter{i, t};
+            if(item.bounds.weight > 0.0f) builder.items.push_back(item);
+        }
+    }
+    light_tree_nodes.clear();
+    light_tree_emitters.clear();
+    light_tree_leaves.clear();
+    if(builder.items.empty()) return;
+    builder.Build(0, builder.items.size());
+    light_tree_nodes = std::move(builder.nodes);
+    light_tree_emitters = std::move(builder.emitters);
+    for(unsigned int n = 0; n < light_tree_nodes.size(); n++){
+        if(!light_tree_nodes[n].leaf) continue;
+        const LightTreeEmitter& e = light_tree_emitters[light_tree_nodes[n].offset];
+        if(e.triangle != LIGHT_TREE_POINT_LIGHT) light_tree_leaves[e.triangle] = n;
+    }
+    out::cout(3) << "Light tree has " << light_tree_emitters.size() << " emitters in "
+                 << light_tree_nodes.size() << " nodes." << std::endl;
+}
+
+bool Scene::SampleLightTree(glm::vec3 pos, glm::vec3 normal, float choice_sample, glm::vec2 triangle_sample,
+                            Light& light) const{
+    float u = choice_sample;
+    float pdf = 1.0f;
+    unsigned int n = 0;
+    while(!light_tree_nodes[n].leaf){
+        unsigned int a = n + 1, b = light_tree_nodes[n].offset;
+        float ia = Importance(light_tree_nodes[a], pos, normal);
+        float ib = Importance(light_tree_nodes[b], pos, normal);
+        if(ia + ib <= 0.0f) return false;
+        // Choose a child, and rescale the sample to choose within it.
+        float pa = ia / (ia + ib);
+        if(u < pa){
+            u = u / pa;
+            pdf *= pa;
+            n = a;
+        }else{
+            u = (u - pa) / (1.0f - pa);
+            pdf *= 1.0f - pa;
+            n = b;
+        }
+        u = glm::min(u, 0.99999994f);
+    }
+    const LightTreeNode& leaf = light_tree_nodes[n];
+    const LightTreeEmitter& e = light_tree_emitters[leaf.offset];
+    // The tree is used where GetRandomLight did not choose the environment.
+    pdf *= 1.0f - environment_probability;
+    if(e.triangle == LIGHT_TREE_POINT_LIGHT){
+        light = pointlights[e.light];
+        light.intensity /= pdf;
+    }else{
+        light = Light(Light::Type::HEMISPHERE);
+        light.pos = GetRandomPoint(e.triangle, triangle_sample, light.normal);
+        light.color = areal_lights[e.light].second.emission;
+        light.pdf = pdf / GetTriangleArea(e.triangle);
+        light.intensity = 1.0f / light.pdf;
+    }
+    return true;
+}
+
+float Scene::LightTreeProbability(unsigned int leaf, glm::vec3 pos, glm::vec3 normal) const{
+    // The choices SampleLightTree makes on the way to the leaf. Nodes are depth-first, so the leaf is below the
+    // second child if it is not before it.
+    float p = 1.0f;
+    unsigned int n = 0;
+    while(n != leaf){
+        unsigned int a = n + 1, b = light_tree_nodes[n].offset;
+        float ia = Importance(light_tree_nodes[a], pos, normal);
+        float ib = Importance(light_tree_nodes[b], pos, normal);
+        if(ia + ib <= 0.0f) return 0.0f;
+        float pa = ia / (ia + ib);
+        if(leaf < b){
+            p *= pa;
+            n = a;
+        }else{
+            p *= 1.0f - pa;
+            n = b;
+        }
+    }
+    return p;
+}
@@ -0,0 +1,62 @@
+#ifndef __SIMD_HPP__
+#define __SIMD_HPP__
+
+#include <cstdint>
+#include <limits>
+
+// Portable SIMD types, implemented with GCC vector extensions. The
+// compiler maps them onto whatever instruction set the build targets
+// (e.g. SSE by default, AVX when compiled with -mavx), so there are no
+// intrinsics here. The width is chosen to match a native register.
+
+#if defined(__AVX__)
+  #define SIMD_WIDTH 8
+#else
+  #define SIMD_WIDTH 4
+#endif
+
+typedef float   vfloat __attribute__((vector_size(SIMD_WIDTH * sizeof(float))));
+// Comparisons of vfloats produce vmasks: all bits set in lanes where the condition holds.
+typedef int32_t vmask  __attribute__((vector_size(SIMD_WIDTH * sizeof(int32_t))));
+
+inline vfloat vfloat_set1(float x){
+    vfloat v;
+    for(int i = 0; i < SIMD_WIDTH; i++) v[i] = x;
+    return v;
+}
+inline vfloat vfloat_load(const float* p){
+    vfloat v;
+    for(int i = 0; i < SIMD_WIDTH; i++) v[i] = p[i];
+    return v;
+}
+inline vmask vmask_set1(bool b){
+    vmask m;
+    for(int i = 0; i < SIMD_WIDTH; i++) m[i] = b ? -1 : 0;
+    return m;
+}
+// Broadcasts an integer, e.g. for comparing against integer lanes.
+inline vmask vmask_set1i(int32_t x){
+    vmask m;
+    for(int i = 0; i < SIMD_WIDTH; i++) m[i] = x;
+    return m;
+}
+
+// Per-lane m ? a : b
+inline vfloat vselect(vmask m, vfloat a, vfloat b){
+    return (vfloat)((m & (vmask)a) | (~m & (vmask)b));
+}
+inline vfloat vmin(vfloat a, vfloat b){ return vselect(a < b, a, b); }
+inline vfloat vmax(vfloat a, vfloat b){ return vselect(a > b, a, b); }
+
+inline bool vany(vmask m){
+    int32_t r = 0;
+    for(int i = 0; i < SIMD_WIDTH; i++) r |= m[i];
+    return r != 0;
+}
+inline bool vall(vmask m){
+    int32_t r = -1;
+    for(int i = 0; i < SIMD_WIDTH; i++) r &= m[i];
+    return r != 0;
+}
+
+#endif // __SIMD_HPP__
@@ -5,6 +5,7 @@
 #include <jerror.h>
 
 #include <cmath>
+#include <limits>
 
 #include "utils.hpp"
 #include "out.hpp"
@@ -332,27 +333,53 @@ void FileTexture::FillStripes(unsigned int size, Color a, Color b){
 }
 
 
-EXRTexture::EXRTexture(int xsize, int ysize):
-    xsize(xsize), ysize(ysize)
+EXRTexture::EXRTexture(int xsize, int ysize, int xoffset, int yoffset):
+    xsize(xsize), ysize(ysize), xoffset(xoffset), yoffset(yoffset)
 {
     data.resize(xsize*ysize);
     count.resize(xsize*ysize, 0);
+    moment2.resize(xsize*ysize, 0.0f);
 }
 
-void EXRTexture::AddPixel(int x, int y, Radiance c, unsigned int n)
+void EXRTexture::AddPixel(int x, int y, Radiance c, unsigned int n, float m2)
 {
     // Current implementation assumes single-thread access
     //std::lock_guard<std::mutex> lk(mx);
+    x -= xoffset; y -= yoffset;
     data[y*xsize + x] += c;
     count[y*xsize + x] += n;
+    moment2[y*xsize + x] += m2;
 }
 Radiance EXRTexture::GetPixel(int x, int y) const{
     //std::lock_guard<std::mutex> lk(mx);
-    int n = y*xsize + x;
+    int n = (y - yoffset)*xsize + (x - xoffset);
     if(count[n] == 0) return Radiance();
     return data[n]/count[n];
 }
 
+float EXRTexture::GetRelativeError(int x, int y, float floor) const{
+    int n = (y - yoffset)*xsize + (x - xoffset);
+    if(count[n] < 2) return std::numeric_limits<float>::infinity();
+    float mean = data[n].luminance() / count[n];
+    float variance = std::max(0.0f, moment2[n] / count[n] - mean*mean) * count[n] / (count[n] - 1);
+    // The floor acts as a prior on the variance, so that pixels which happened to get few (or no) bright samples
+    // are not considered converged before they have been sampled (1/threshold)^2 times. It also keeps very dark
+    // pixels from chasing a relative threshold they would never reach.
+    float d = std::max(mean, floor);
+    return std::sqrt((variance + floor*floor) / count[n]) / d;
+}
+
+float EXRTexture::GetMeanLuminance() const{
+    double sum = 0.0;
+    unsigned int n = 0;
+    for(unsigned int i = 0; i < data.size(); i++){
+        if(count[i] == 0) continue;
+        sum += data[i].luminance() / count[i];
+        n++;
+    }
+    return n ? sum / n : 0.0f;
+}
+
 bool EXRTexture::Write(std::string path) const{
     Imf::RgbaOutputFile file(path.c_str(), xsize, ysize, Imf::WRITE_RGBA);
     // Create Rgba data
@@ -360,7 +387,7 @@ bool EXRTexture::Write(std::string path) const{
     for(unsigned int y = 0; y < ysize; y++)
         for(unsigned int x = 0; x < xsize; x++){
             int n = y*xsize + x;
-            auto q = GetPixel(x, y);
+            auto q = GetPixel(x + xoffset, y + yoffset);
             buffer[n].a = 1.0;
             buffer[n].r = q.r;
             buffer[n].g = q.g;
@@ -374,15 +401,16 @@ bool EXRTexture::Write(std::string path) const{
 }
 
 EXRTexture EXRTexture::Normalize(float val) const{
-    EXRTexture out(xsize, ysize);
+    EXRTexture out(xsize, ysize, xoffset, yoffset);
     out.data = data;
     out.count = count;
+    out.moment2 = moment2;
 
     if(val <= 0.0f){
         float m = 0.0f;
         for(unsigned int y = 0; y < ysize; y++)
             for(unsigned int x = 0; x < xsize; x++){
-                auto q = GetPixel(x, y);
+                auto q = GetPixel(x + xoffset, y + yoffset);
                 m = std::max(m, q.r);
                 m = std::max(m, q.g);
                 m = std::max(m, q.b);
@@ -401,12 +429,43 @@ EXRTexture EXRTexture::Normalize(float val) const{
 
 
 void EXRTexture::Accumulate(const EXRTexture& other){
-    qassert_true(xsize == other.xsize);
-    qassert_true(ysize == other.ysize);
-    for(unsigned int y = 0; y < ysize; y++){
-        for(unsigned int x = 0; x < xsize; x++){
-            data[y*xsize + x] += other.data[y*xsize + x];
-            count[y*xsize + x] += other.count[y*xsize + x];
+    qassert_true(other.xoffset >= xoffset && other.xoffset + other.xsize <= xoffset + xsize);
+    qassert_true(other.yoffset >= yoffset && other.yoffset + other.ysize <= yoffset + ysize);
+    for(unsigned int y = 0; y < other.ysize; y++){
+        unsigned int row = (y + other.yoffset - yoffset)*xsize + (other.xoffset - xoffset);
+        for(unsigned int x = 0; x < other.xsize; x++){
+            data[row + x] += other.data[y*other.xsize + x];
+            count[row + x] += other.count[y*other.xsize + x];
+            moment2[row + x] += other.moment2[y*other.xsize + x];
         }
     }
 }
+
+SplatFilm::SplatFilm(unsigned int xsize, unsigned int ysize) :
+    xsize(xsize), ysize(ysize), data(new std::atomic<float>[3*xsize*ysize])
+{
+    for(unsigned int i = 0; i < 3*xsize*ysize; i++) data[i] = 0.0f;
+}
+
+static inline void AtomicAdd(std::atomic<float>& a, float x){
+    float old = a.load(std::memory_order_relaxed);
+    while(!a.compare_exchange_weak(old, old + x, std::memory_order_relaxed));
+}
+
+void SplatFilm::Splat(int x, int y, Radiance c){
+    std::atomic<float>* p = &data[3*(y*xsize + x)];
+    AtomicAdd(p[0], c.r);
+    AtomicAdd(p[1], c.g);
+    AtomicAdd(p[2], c.b);
+}
+
+void SplatFilm::DrainInto(EXRTexture& out){
+    for(unsigned int y = 0; y < ysize; y++)
+        for(unsigned int x = 0; x < xsize; x++){
+            std::atomic<float>* p = &data[3*(y*xsize + x)];
+            Radiance c(p[0].exchange(0.0f, std::memory_order_relaxed),
+                       p[1].exchange(0.0f, std::memory_order_relaxed),
+                       p[2].exchange(0.0f, std::memory_order_relaxed));
+            out.AddPixel(x, y, c, 0);
+        }
+}
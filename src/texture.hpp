@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
 
 #include "radiance.hpp"
 
@@ -13,6 +15,9 @@ public:
     virtual Color GetPixelInterpolated(glm::vec2 pos, bool debug = false) const = 0;
     virtual float GetSlopeRight(glm::vec2 pos) const = 0;
     virtual float GetSlopeBottom(glm::vec2 pos) const = 0;
+    // Resolution in pixels, 1x1 for textures that are the same everywhere.
+    virtual unsigned int GetWidth() const = 0;
+    virtual unsigned int GetHeight() const = 0;
     inline Color operator[](const glm::vec2& pos) const {
         return GetPixelInterpolated(pos);
     }
@@ -46,6 +51,9 @@ public:
 
     virtual Color GetPixelInterpolated(glm::vec2 pos, bool debug = false) const override;
 
+    virtual unsigned int GetWidth() const override {return xsize;}
+    virtual unsigned int GetHeight() const override {return ysize;}
+
     static FileTexture* CreateNewFromPNG(std::string path);
     static FileTexture* CreateNewFromJPEG(std::string path);
     static FileTexture* CreateNewFromHDR(std::string path);
@@ -68,6 +76,8 @@ public:
     virtual Color GetPixelInterpolated(glm::vec2, bool) const override {return color;}
     virtual float GetSlopeRight(glm::vec2) const override {return 0;}
     virtual float GetSlopeBottom(glm::vec2) const override {return 0;}
+    virtual unsigned int GetWidth() const override {return 1;}
+    virtual unsigned int GetHeight() const override {return 1;}
     virtual bool Empty() const override {return false;}
 private:
     Color color;
@@ -82,39 +92,77 @@ public:
 
 class EXRTexture{
 public:
-    EXRTexture(int xsize = 0, int ysize = 0);
+    // A texture may cover just a rectangle of the full image, starting at (xoffset, yoffset). Pixel coordinates
+    // passed to AddPixel and GetPixel are always full image coordinates.
+    EXRTexture(int xsize = 0, int ysize = 0, int xoffset = 0, int yoffset = 0);
     EXRTexture(const EXRTexture& other) :
         xsize(other.xsize), ysize(other.ysize),
-        data(other.data),  count(other.count) {
+        xoffset(other.xoffset), yoffset(other.yoffset),
+        data(other.data),  count(other.count), moment2(other.moment2) {
     }
     EXRTexture(EXRTexture&& other){
         std::swap(xsize,other.xsize);
         std::swap(ysize,other.ysize);
+        std::swap(xoffset,other.xoffset);
+        std::swap(yoffset,other.yoffset);
         std::swap(data,other.data);
         std::swap(count,other.count);
+        std::swap(moment2,other.moment2);
     }
     EXRTexture& operator=(EXRTexture&& other){
         std::swap(xsize,other.xsize);
         std::swap(ysize,other.ysize);
+        std::swap(xoffset,other.xoffset);
+        std::swap(yoffset,other.yoffset);
         std::swap(data,other.data);
         std::swap(count,other.count);
+        std::swap(moment2,other.moment2);
         return *this;
     }
     bool Write(std::string path) const;
-    void AddPixel(int x, int y, Radiance c, unsigned int n = 1);
+    // c is the sum of n samples, and m2 the sum of their squared luminances.
+    void AddPixel(int x, int y, Radiance c, unsigned int n = 1, float m2 = 0.0f);
     Radiance GetPixel(int x, int y) const;
+    // Estimated standard error of the pixel's mean luminance, relative to that mean. Infinite if the pixel has
+    // fewer than two samples. The floor is the luminance below which a pixel counts as dark, usually a fraction of
+    // the image's mean luminance.
+    float GetRelativeError(int x, int y, float floor) const;
+    // Average of the mean luminance of all pixels that have samples.
+    float GetMeanLuminance() const;
     // A positive value will be applied as a scaling factor to the entire texture.
     // A negative value enables automatic scaling factor detection
     EXRTexture Normalize(float val) const;
 
+    // Adds other's pixels to this texture. Other has to lie within this texture's rectangle, and only its
+    // rectangle is visited.
     void Accumulate(const EXRTexture& other);
 
 private:
-    unsigned int xsize, ysize;
+    unsigned int xsize = 0, ysize = 0;
+    unsigned int xoffset = 0, yoffset = 0;
     std::vector<Radiance> data;
     std::vector<unsigned int> count;
+    // Sum of squared sample luminances, for variance estimation.
+    std::vector<float> moment2;
 
     mutable std::mutex mx;
 };
 
+// A full image of radiance that any number of threads may add to at the same time, without locks. Used for light
+// tracing side effects, which may land anywhere in the image.
+class SplatFilm{
+public:
+    SplatFilm(unsigned int xsize, unsigned int ysize);
+
+    void Splat(int x, int y, Radiance c);
+    // Adds all collected radiance to out (with no samples) and resets it to zero. Splats made concurrently are
+    // either drained now, or kept for the next call.
+    void DrainInto(EXRTexture& out);
+
+private:
+    unsigned int xsize, ysize;
+    // Three channels per pixel.
+    std::unique_ptr<std::atomic<float>[]> data;
+};
+
 #endif // __TEXTURE_HPP__
@@ -3,10 +3,14 @@
 #include "global_config.hpp"
 #include "utils.hpp"
 
-void Tracer::Render(const RenderTask& task, EXRTexture* output, std::atomic<int>& pixel_count, std::atomic<unsigned int>& ray_count){
+void Tracer::Render(const RenderTask& task, EXRTexture* output, SplatFilm* splats,
+                    std::atomic<int>& pixel_count, std::atomic<unsigned int>& ray_count){
+    this->splats = splats;
     unsigned int pxdone = 0, raysdone = 0;
+    unsigned int width = task.xrange_end - task.xrange_start;
     for(unsigned int y = task.yrange_start; y < task.yrange_end; y++){
         for(unsigned int x = task.xrange_start; x < task.xrange_end; x++){
+            if(!task.skip.empty() && task.skip[(y - task.yrange_start)*width + (x - task.xrange_start)]) continue;
             bool debug = false;
 #if ENABLE_DEBUG
             if(debug_trace && x == debug_x && y == debug_y) debug = true;
@@ -15,15 +19,7 @@ void Tracer::Render(const RenderTask& task, EXRTexture* output, std::atomic<int>
 
             // Temporarily disabled for light tracing
             // output->AddPixel(x, y, px.main_pixel, multisample);
-            output->AddPixel(x, y, px.main_pixel, multisample);
-
-            for(const auto& t : px.side_effects){
-                int x2 = std::get<0>(t);
-                int y2 = std::get<1>(t);
-                Radiance r = std::get<2>(t);
-                IFDEBUG std::cout << "Setting extra pixel at: " << x2 << " " << y2 << " to " << r  << std::endl;
-                output->AddPixel(x2, y2, r, 0);
-            }
+            output->AddPixel(x, y, px.main_pixel, multisample, px.moment2);
 
             pxdone++;
             if(pxdone % 100 == 0){
@@ -34,4 +30,5 @@ void Tracer::Render(const RenderTask& task, EXRTexture* output, std::atomic<int>
     }
     pixel_count += pxdone;
     ray_count += raysdone;
+    this->splats = nullptr;
 }
@@ -3,13 +3,13 @@
 
 #include <vector>
 #include <atomic>
-#include <tuple>
 
 #include "glm.hpp"
 #include "radiance.hpp"
 class Scene;
 class Camera;
 class EXRTexture;
+class SplatFilm;
 
 struct RenderTask{
     RenderTask(unsigned int xres, unsigned int yres, unsigned int x1, unsigned int x2, unsigned int y1, unsigned int y2)
@@ -21,13 +21,16 @@ struct RenderTask{
     unsigned int xrange_start, xrange_end;
     unsigned int yrange_start, yrange_end;
     glm::vec2 midpoint;
+    // Pixels that are not rendered, row by row within the task's rectangle. Empty if all pixels are rendered.
+    std::vector<bool> skip;
 };
 
 struct PixelRenderResult{
     PixelRenderResult() {};
     PixelRenderResult(Radiance main) : main_pixel(main) {}
     Radiance main_pixel;
-    std::vector<std::tuple<int,int,Radiance>> side_effects;
+    // Sum of squared luminances of individual samples that make up main_pixel.
+    float moment2 = 0.0f;
 };
 
 class Tracer{
@@ -46,7 +49,11 @@ protected:
     {}
 
 public:
-    void Render(const RenderTask& task, EXRTexture* output, std::atomic<int>& pixel_count, std::atomic<unsigned int>& ray_count);
+    // Renders the task's pixels into output, which only needs to cover the task's rectangle. Side effects may land
+    // anywhere in the image, these are added to splats, which may be shared with other threads. It may be null if
+    // no side effects are produced.
+    void Render(const RenderTask& task, EXRTexture* output, SplatFilm* splats,
+                std::atomic<int>& pixel_count, std::atomic<unsigned int>& ray_count);
 
 protected:
     virtual PixelRenderResult RenderPixel(int x, int y, unsigned int & raycount, bool debug = false) = 0;
@@ -55,6 +62,8 @@ protected:
     const Camera& camera;
     unsigned int xres, yres;
     unsigned int multisample;
+    // Valid while rendering a task.
+    SplatFilm* splats = nullptr;
 
     float bumpmap_scale;
 };
@@ -90,6 +90,26 @@ bool Utils::GetFileExists(std::string name)
   return (bool)std::ifstream(name);
 }
 
+uint64_t Utils::HashFNV1a(const void* data, size_t size, uint64_t h){
+    const unsigned char* p = (const unsigned char*)data;
+    for(size_t i = 0; i < size; i++){
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+bool Utils::HashFile(std::string path, uint64_t& h){
+    std::ifstream file(path, std::ios::binary);
+    if(!file) return false;
+    std::vector<char> buffer(1 << 20);
+    while(file){
+        file.read(buffer.data(), buffer.size());
+        h = HashFNV1a(buffer.data(), file.gcount(), h);
+    }
+    return true;
+}
+
 
 std::string Utils::FormatIntThousands(unsigned int value){
     class comma_sep
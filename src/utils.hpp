@@ -5,6 +5,7 @@
 #include <vector>
 #include <list>
 #include <iostream>
+#include <cstdint>
 
 #include "glm.hpp"
 
@@ -56,6 +57,11 @@ public:
     static std::string InsertFileSuffix(std::string path, std::string suffix);
     static bool GetFileExists(std::string path);
 
+    // 64-bit FNV-1a. Pass a previous result as h to hash several pieces of data together.
+    static uint64_t HashFNV1a(const void* data, size_t size, uint64_t h = 14695981039346656037ull);
+    // Hashes the entire contents of a file into h. Returns false if the file cannot be read.
+    static bool HashFile(std::string path, uint64_t& h);
+
     class LowPass{
     public:
         LowPass(unsigned int size);
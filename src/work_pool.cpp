@@ -0,0 +1,94 @@
+#include "work_pool.hpp"
+
+#include <algorithm>
+
+WorkPool::WorkPool(unsigned int size){
+    size = std::max(1u, size);
+    for(unsigned int i = 0; i < size; i++)
+        workers.emplace_back(new Worker);
+    for(unsigned int i = 0; i < size; i++)
+        threads.emplace_back(&WorkPool::WorkerLoop, this, i);
+}
+
+WorkPool::~WorkPool(){
+    Wait();
+    {
+        std::lock_guard<std::mutex> lk(mx);
+        stopping = true;
+    }
+    cv_work.notify_all();
+    for(std::thread& t : threads) t.join();
+}
+
+void WorkPool::Push(Task task){
+    {
+        // The task is counted as queued only together with being put in a deque, so a woken worker always finds
+        // something to take.
+        std::lock_guard<std::mutex> lk(mx);
+        Worker& w = *workers[next_worker];
+        next_worker = (next_worker + 1) % workers.size();
+        {
+            std::lock_guard<std::mutex> wlk(w.mx);
+            w.tasks.push_back(std::move(task));
+        }
+        queued++;
+        pending++;
+    }
+    cv_work.notify_one();
+}
+
+void WorkPool::WaitDrained(){
+    std::unique_lock<std::mutex> lk(mx);
+    cv_state.wait(lk, [this]{return queued == 0;});
+}
+
+void WorkPool::Wait(){
+    std::unique_lock<std::mutex> lk(mx);
+    cv_state.wait(lk, [this]{return pending == 0;});
+}
+
+bool WorkPool::TakeTask(int id, Task& out){
+    // Own deque first, in push order.
+    {
+        Worker& own = *workers[id];
+        std::lock_guard<std::mutex> lk(own.mx);
+        if(!own.tasks.empty()){
+            out = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    // Steal the most recently pushed task of some other worker, starting with the next one.
+    for(unsigned int i = 1; i < workers.size(); i++){
+        Worker& victim = *workers[(id + i) % workers.size()];
+        std::lock_guard<std::mutex> lk(victim.mx);
+        if(!victim.tasks.empty()){
+            out = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkPool::WorkerLoop(int id){
+    while(true){
+        Task task;
+        if(TakeTask(id, task)){
+            {
+                std::lock_guard<std::mutex> lk(mx);
+                if(--queued == 0) cv_state.notify_all();
+            }
+            task(id);
+            {
+                std::lock_guard<std::mutex> lk(mx);
+                if(--pending == 0) cv_state.notify_all();
+            }
+            continue;
+        }
+        // Nothing to take, sleep until something is pushed.
+        std::unique_lock<std::mutex> lk(mx);
+        cv_work.wait(lk, [this]{return stopping || queued > 0;});
+        if(stopping && queued == 0) return;
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef __WORK_POOL_HPP__
+#define __WORK_POOL_HPP__
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// A persistent thread pool with a task deque per worker. New tasks are dealt to the deques round-robin, so they
+// are started roughly in the order they were pushed. A worker takes tasks from the front of its own deque, and
+// when it runs out, it steals from the back of other workers' deques. Unlike ctpl::thread_pool, the pool is meant
+// to stay alive for many batches of tasks, so that no barrier is needed between them.
+class WorkPool{
+public:
+    // The argument passed to tasks is the id of the worker thread that runs it, in [0, size).
+    typedef std::function<void(int)> Task;
+
+    WorkPool(unsigned int size);
+    // Waits for all pushed tasks to complete.
+    ~WorkPool();
+
+    // Copying is forbidden
+    WorkPool(const WorkPool&) = delete;
+    WorkPool& operator=(const WorkPool&) = delete;
+
+    void Push(Task task);
+
+    // Blocks until all pushed tasks have been taken by workers (some may still be running).
+    void WaitDrained();
+    // Blocks until all pushed tasks have completed.
+    void Wait();
+
+    unsigned int Size() const {return workers.size();}
+
+private:
+    struct Worker{
+        std::mutex mx;
+        std::deque<Task> tasks;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    unsigned int next_worker = 0;
+
+    // Guards the counters below. Taken before a worker's mutex, never after it.
+    std::mutex mx;
+    std::condition_variable cv_work;
+    std::condition_variable cv_state;
+    // Tasks pushed, but not yet taken by any worker.
+    unsigned int queued = 0;
+    // Tasks pushed, but not yet completed.
+    unsigned int pending = 0;
+    bool stopping = false;
+
+    void WorkerLoop(int id);
+    bool TakeTask(int id, Task& out);
+};
+
+#endif // __WORK_POOL_HPP__